@@ -0,0 +1,86 @@
+#ifndef BACKEND_H
+#define BACKEND_H
+
+#include <linux/types.h>
+#include <linux/mm_types.h>
+
+struct module;
+struct prime_device;
+
+//Operations a backend provides to reach the registers of its card. The PCI
+//backend in pcie_ctrl.c goes through BAR0. Each callback is handed the
+//backend_data pointer given to prime_device_alloc. The register callbacks
+//are called from interrupt context and with spinlocks held so they must not
+//sleep.
+struct prime_backend_ops {
+    //Module that provides the callbacks. It is pinned while the card is in
+    //use so the callbacks can not be unloaded under an open file.
+    struct module *owner;
+
+    //Reads and writes a single 32bit register
+    u32 (*read_register)(void *backend_data, unsigned int offset);
+    void (*write_register)(void *backend_data, unsigned int offset, u32 value);
+
+    //Copies count bytes of registers starting at offset into buffer
+    void (*read_window)(void *backend_data, unsigned int offset, void *buffer, size_t count);
+
+    //Maps the registers into a process. Optional, the device file refuses
+    //mmap of the registers if it is NULL.
+    int (*mmap_registers)(void *backend_data, struct vm_area_struct *vma);
+
+    //Brings a stalled card back to idle with its search dropped. Called
+    //from process context with no lock held, so it may sleep. Optional,
+    //without it the card is only restarted with the next search.
+    int (*reset)(void *backend_data);
+
+    //Frees the backend's state once the last reference to the card is
+    //dropped. Optional.
+    void (*release)(void *backend_data);
+};
+
+/*
+    Allocates the state of a card driven by a backend. The card is not
+    visible to user space until it is registered.
+
+    Paramaters:
+        ops             -> Register access callbacks of the backend.
+        backend_data    -> Handed to every callback.
+    Return:
+        The card, or NULL if it could not be allocated.
+*/
+struct prime_device *prime_device_alloc(const struct prime_backend_ops *ops, void *backend_data);
+
+/*
+    Gives the card a minor number and creates its character device.
+
+    Paramaters:
+        device  -> Card returned by prime_device_alloc.
+    Return:
+        0 on success and a negative value on failure.
+*/
+int prime_device_register(struct prime_device *device);
+
+/*
+    Removes the card's character device, fails every search still waiting
+    on it and drops the reference taken by prime_device_alloc. The backend
+    must have stopped raising interrupts for the card before calling this.
+    Also used to free a card whose registration failed.
+
+    Paramaters:
+        device  -> Card to remove.
+*/
+void prime_device_unregister(struct prime_device *device);
+
+/*
+    Delivers a completion interrupt of the card. Must be called from
+    interrupt context, the way a real interrupt handler runs. The finished
+    searches are completed later from a work item, the way the interrupt
+    thread of a PCI card completes them. Interrupts delivered while the
+    card is polled are ignored, as if they were masked.
+
+    Paramaters:
+        device  -> Card whose search finished.
+*/
+void prime_device_interrupt(struct prime_device *device);
+
+#endif
@@ -0,0 +1,596 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "device_specific.h"
+#include "prime.h"
+#include "client.h"
+#include "timing.h"
+
+//Sweeps every way of running a search on the card and reports latency
+//percentiles, searches per second and system calls per search for each
+//combination of access path, start value distribution, number of threads
+//and batch size. Every result is one line of CSV or JSON so runs can be
+//compared over time. When the device file cannot be opened the software
+//emulator is used instead.
+//
+//  ./benchmark [-d device] [-p paths] [-i poll intervals in us]
+//              [-s distributions] [-t thread counts] [-b batch sizes]
+//              [-n searches per thread] [-f csv|json]
+
+//Searches each thread runs for one combination
+#define DEFAULT_SEARCHES 2000
+//Largest batch size that can be asked for
+#define MAX_BATCH 1024
+//Largest number of values in one list argument
+#define MAX_LIST 16
+//Buckets of the log2 latency histogram in the JSON output
+#define HISTOGRAM_BUCKETS 40
+
+//Ways of running a search
+enum access_path {
+    //start_search() and then check_complete() with pread until the done
+    //flag is set, sleeping for the poll interval between reads
+    PATH_PREAD,
+    //Blocking ioctl that sleeps on the interrupt
+    PATH_IOCTL,
+    //Blocking ioctl with the hybrid spin
+    PATH_HYBRID,
+    //Registers mapped with map_registers() and polled with loads
+    PATH_MMAP,
+    //find_primes_batch()
+    PATH_BATCH,
+    //One client shared by every thread, each thread keeping batch futures
+    //in flight
+    PATH_CLIENT,
+    PATH_COUNT
+};
+
+static const char *path_names[PATH_COUNT] = {"pread", "ioctl", "hybrid", "mmap", "batch", "client"};
+
+//Where start values are drawn from
+enum distribution {
+    //Below 2^16, where prime gaps are short
+    DIST_SMALL,
+    //Anywhere in the 32 bit range
+    DIST_UNIFORM,
+    //Above 2^31, where prime gaps are longest
+    DIST_HIGH,
+    DIST_COUNT
+};
+
+static const char *distribution_names[DIST_COUNT] = {"small", "uniform", "high"};
+
+//One combination of the sweep
+struct bench_config {
+    const char *device_path;
+    enum access_path path;
+    enum distribution distribution;
+    unsigned int poll_interval_us;
+    unsigned int threads;
+    unsigned int batch;
+    unsigned int searches;
+    //Client the threads of the client path share
+    struct prime_client *client;
+};
+
+//Work and results of one thread
+struct bench_thread {
+    const struct bench_config *config;
+    unsigned int id;
+    //Latency of every call, one search or one batch
+    uint64_t *samples;
+    unsigned int sample_count;
+    uint64_t device_calls;
+    int started;
+    int failed;
+};
+
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t*) a;
+    uint64_t y = *(const uint64_t*) b;
+    return (x > y) - (x < y);
+}
+
+/*
+    Draws the next start value of a thread.
+
+    Paramaters:
+        state           -> xorshift state of the thread.
+        distribution    -> Distribution to draw from.
+    Return:
+        The start value.
+*/
+static uint32_t next_start_value(uint64_t *state, enum distribution distribution) {
+    uint64_t x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+
+    switch(distribution) {
+        case DIST_SMALL:
+            return (uint32_t) (x & 0xffff);
+        case DIST_HIGH:
+            return (uint32_t) (x >> 32) | 0x80000000u;
+        default:
+            return (uint32_t) (x >> 32);
+    }
+}
+
+/*
+    Runs one search by starting it and polling the done flag.
+
+    Paramaters:
+        fd              -> File descriptor of the device.
+        start_val       -> Value to start the search from.
+        interval_us     -> Time to sleep between polls, 0 to spin.
+        result          -> Where to store the result.
+    Return:
+        0 on success and a negative value on failure.
+*/
+static int polled_search(int fd, uint32_t start_val, unsigned int interval_us, uint32_t *result) {
+    uint32_t complete;
+
+    if(start_search(fd, start_val) != 0) {
+        return -1;
+    }
+
+    for(;;) {
+        if(check_complete(fd, &complete) != 0) {
+            return -1;
+        }
+        if(complete == 1) {
+            break;
+        }
+        if(interval_us > 0) {
+            usleep(interval_us);
+        }
+    }
+
+    return read_result(fd, result);
+}
+
+/*
+    Thread body of the client path. Submits a batch of futures to the
+    shared client and waits for all of them, timing each batch. The device
+    calls are the client's and are counted by run_config().
+
+    Paramaters:
+        thread  -> The thread's struct bench_thread.
+        futures -> Room for MAX_BATCH futures.
+*/
+static void *client_thread_main(struct bench_thread *thread, struct prime_future *futures) {
+    const struct bench_config *config = thread->config;
+    uint64_t state = 0x9e3779b97f4a7c15ull * (thread->id + 1);
+    uint64_t start, result;
+    unsigned int done, batch, i;
+
+    for(done = 0; done < config->searches; done += batch) {
+        batch = config->batch;
+        if(batch > config->searches - done) {
+            batch = config->searches - done;
+        }
+
+        start = now_ns();
+        for(i = 0; i < batch; i++) {
+            prime_client_submit(config->client, &futures[i], next_start_value(&state, config->distribution));
+        }
+        for(i = 0; i < batch; i++) {
+            if(prime_future_wait(&futures[i], &result) != 0) {
+                thread->failed = 1;
+            }
+        }
+        thread->samples[thread->sample_count++] = now_ns() - start;
+
+        if(thread->failed) {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+    Thread body of a combination. Opens its own device, runs its searches
+    and times every call.
+
+    Paramaters:
+        arg     -> The thread's struct bench_thread.
+*/
+static void *bench_thread_main(void *arg) {
+    struct bench_thread *thread = arg;
+    const struct bench_config *config = thread->config;
+    uint32_t start_vals[MAX_BATCH];
+    uint32_t results[MAX_BATCH];
+    struct prime_future futures[MAX_BATCH];
+    uint64_t state = 0x9e3779b97f4a7c15ull * (thread->id + 1);
+    uint64_t start, calls;
+    unsigned int done, batch, i;
+    int fd, status;
+
+    thread->sample_count = 0;
+    thread->device_calls = 0;
+    thread->failed = 0;
+
+    if(config->path == PATH_CLIENT) {
+        return client_thread_main(thread, futures);
+    }
+
+    fd = open_device(config->device_path);
+    if(fd < 0) {
+        thread->failed = 1;
+        return NULL;
+    }
+
+    if(config->path == PATH_MMAP && map_registers(fd) != 0) {
+        close_device(fd);
+        thread->failed = 1;
+        return NULL;
+    }
+
+    calls = device_call_count();
+    for(done = 0; done < config->searches; done += batch) {
+        batch = config->path == PATH_BATCH ? config->batch : 1;
+        if(batch > config->searches - done) {
+            batch = config->searches - done;
+        }
+        for(i = 0; i < batch; i++) {
+            start_vals[i] = next_start_value(&state, config->distribution);
+        }
+
+        start = now_ns();
+        switch(config->path) {
+            case PATH_PREAD:
+            case PATH_MMAP:
+                status = polled_search(fd, start_vals[0], config->poll_interval_us, &results[0]);
+                break;
+            case PATH_IOCTL:
+                status = find_prime_wait(fd, start_vals[0], WAIT_MODE_INTERRUPT, &results[0]);
+                break;
+            case PATH_HYBRID:
+                status = find_prime_wait(fd, start_vals[0], WAIT_MODE_HYBRID, &results[0]);
+                break;
+            default:
+                status = find_primes_batch(fd, start_vals, results, batch);
+                break;
+        }
+        thread->samples[thread->sample_count++] = now_ns() - start;
+
+        if(status != 0) {
+            thread->failed = 1;
+            break;
+        }
+    }
+    thread->device_calls = device_call_count() - calls;
+
+    if(config->path == PATH_MMAP) {
+        unmap_registers();
+    }
+    close_device(fd);
+
+    return NULL;
+}
+
+/*
+    Prints the results of a combination as one CSV or JSON line.
+
+    Paramaters:
+        config      -> The combination.
+        json        -> Non-zero for JSON.
+        samples     -> Sorted latencies of every call.
+        count       -> Number of latencies.
+        searches    -> Number of searches the calls ran.
+        elapsed_ns  -> Wall clock time of the combination.
+        calls       -> Device system calls of every thread.
+*/
+static void print_result(const struct bench_config *config, int json, const uint64_t *samples, uint64_t count,
+                         uint64_t searches, uint64_t elapsed_ns, uint64_t calls) {
+    uint64_t histogram[HISTOGRAM_BUCKETS] = {0};
+    uint64_t p50 = samples[count / 2];
+    uint64_t p99 = samples[count * 99 / 100];
+    uint64_t p999 = samples[count * 999 / 1000];
+    double rate = elapsed_ns ? searches * 1e9 / elapsed_ns : 0.0;
+    double calls_per_search = searches ? (double) calls / searches : 0.0;
+    uint64_t i;
+    int bucket;
+
+    if(!json) {
+        printf("%s,%s,%u,%u,%u,%lu,%lu,%lu,%lu,%lu,%.0f,%.2f\n",
+               path_names[config->path], distribution_names[config->distribution],
+               config->poll_interval_us, config->threads, config->batch, searches,
+               samples[0], p50, p99, p999, rate, calls_per_search);
+        return;
+    }
+
+    //Bucket b holds the calls that took [2^b, 2^(b+1)) ns
+    for(i = 0; i < count; i++) {
+        bucket = samples[i] ? 63 - __builtin_clzll(samples[i]) : 0;
+        if(bucket >= HISTOGRAM_BUCKETS) bucket = HISTOGRAM_BUCKETS - 1;
+        histogram[bucket]++;
+    }
+
+    printf("{\"path\":\"%s\",\"distribution\":\"%s\",\"poll_interval_us\":%u,\"threads\":%u,\"batch\":%u,"
+           "\"searches\":%lu,\"min_ns\":%lu,\"p50_ns\":%lu,\"p99_ns\":%lu,\"p999_ns\":%lu,"
+           "\"searches_per_second\":%.0f,\"syscalls_per_search\":%.2f,\"log2_histogram\":[",
+           path_names[config->path], distribution_names[config->distribution],
+           config->poll_interval_us, config->threads, config->batch, searches,
+           samples[0], p50, p99, p999, rate, calls_per_search);
+    for(bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+        printf(bucket ? ",%lu" : "%lu", histogram[bucket]);
+    }
+    printf("]}\n");
+}
+
+/*
+    Runs one combination on its threads and prints the results.
+
+    Paramaters:
+        config  -> The combination.
+        json    -> Non-zero for JSON output.
+    Return:
+        0 on success and a negative value on failure.
+*/
+static int run_config(const struct bench_config *config, int json) {
+    struct bench_thread *threads;
+    pthread_t *handles;
+    uint64_t *samples;
+    uint64_t count = 0, calls = 0, start;
+    struct bench_config run = *config;
+    struct prime_client_stats client_stats;
+    unsigned int t;
+    int status = 0;
+
+    threads = calloc(config->threads, sizeof(struct bench_thread));
+    handles = calloc(config->threads, sizeof(pthread_t));
+    samples = malloc(sizeof(uint64_t) * config->threads * config->searches);
+    if(threads == NULL || handles == NULL || samples == NULL) {
+        free(threads);
+        free(handles);
+        free(samples);
+        return -1;
+    }
+
+    //Every thread of the client path submits to the same client
+    if(config->path == PATH_CLIENT) {
+        run.client = prime_client_open(config->device_path, NULL);
+        if(run.client == NULL) {
+            free(threads);
+            free(handles);
+            free(samples);
+            return -1;
+        }
+    }
+
+    //Each thread writes its latencies into its own part of samples
+    for(t = 0; t < config->threads; t++) {
+        threads[t].config = &run;
+        threads[t].id = t;
+        threads[t].samples = samples + (uint64_t) t * config->searches;
+    }
+
+    start = now_ns();
+    for(t = 0; t < config->threads; t++) {
+        threads[t].started = pthread_create(&handles[t], NULL, bench_thread_main, &threads[t]) == 0;
+        if(!threads[t].started) {
+            threads[t].failed = 1;
+        }
+    }
+    for(t = 0; t < config->threads; t++) {
+        if(threads[t].started) {
+            pthread_join(handles[t], NULL);
+        }
+    }
+
+    //Pack the latencies of every thread together
+    for(t = 0; t < config->threads; t++) {
+        if(threads[t].failed) {
+            status = -1;
+        }
+        memmove(samples + count, threads[t].samples, sizeof(uint64_t) * threads[t].sample_count);
+        count += threads[t].sample_count;
+        calls += threads[t].device_calls;
+    }
+
+    //Searches on a client are sent to the device one batch per call
+    if(config->path == PATH_CLIENT) {
+        prime_client_get_stats(run.client, &client_stats);
+        prime_client_close(run.client);
+        calls = client_stats.batches;
+    }
+
+    if(status == 0 && count > 0) {
+        qsort(samples, count, sizeof(uint64_t), compare_u64);
+        print_result(config, json, samples, count, (uint64_t) config->searches * config->threads,
+                     now_ns() - start, calls);
+    }
+
+    free(threads);
+    free(handles);
+    free(samples);
+
+    return status;
+}
+
+/*
+    Parses a comma separated list of numbers.
+
+    Paramaters:
+        text    -> The list.
+        values  -> Where to store the numbers, room for MAX_LIST.
+    Return:
+        The number of values.
+*/
+static int parse_list(const char *text, unsigned int *values) {
+    int count = 0;
+    char *end;
+
+    while(*text != '\0' && count < MAX_LIST) {
+        values[count] = strtoul(text, &end, 0);
+        if(end == text) break;
+        count++;
+        if(*end != ',') break;
+        text = end + 1;
+    }
+
+    return count;
+}
+
+/*
+    Parses a comma separated list of names.
+
+    Paramaters:
+        text    -> The list.
+        names   -> Names that may appear.
+        count   -> Number of names.
+        enabled -> Set to 1 for every name in the list.
+    Return:
+        0 on success and a negative value for an unknown name.
+*/
+static int parse_names(const char *text, const char **names, int count, int *enabled) {
+    const char *end;
+    size_t length;
+    int i, found;
+
+    memset(enabled, 0, sizeof(int) * count);
+    while(*text != '\0') {
+        end = strchr(text, ',');
+        length = end ? (size_t) (end - text) : strlen(text);
+
+        found = 0;
+        for(i = 0; i < count; i++) {
+            if(strlen(names[i]) == length && strncmp(names[i], text, length) == 0) {
+                enabled[i] = 1;
+                found = 1;
+            }
+        }
+        if(!found) {
+            fprintf(stderr, "Unknown name %.*s\n", (int) length, text);
+            return -1;
+        }
+
+        text += length;
+        if(*text == ',') text++;
+    }
+
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    unsigned int intervals[MAX_LIST] = {0, 100, 1000};
+    unsigned int thread_counts[MAX_LIST] = {1, 2, 4};
+    unsigned int batches[MAX_LIST] = {1, 16, 256};
+    int interval_count = 3, thread_count = 3, batch_count = 3;
+    int paths[PATH_COUNT] = {1, 1, 1, 1, 1, 1};
+    int distributions[DIST_COUNT] = {1, 1, 1};
+    struct bench_config config;
+    int json = 0;
+    int opt, p, d, i, t, b, fd;
+
+    config.device_path = "/dev/prime_finder";
+    config.searches = DEFAULT_SEARCHES;
+
+    while((opt = getopt(argc, argv, "d:p:i:s:t:b:n:f:")) != -1) {
+        switch(opt) {
+            case 'd':
+                config.device_path = optarg;
+                break;
+            case 'p':
+                if(parse_names(optarg, path_names, PATH_COUNT, paths) != 0) return -1;
+                break;
+            case 'i':
+                interval_count = parse_list(optarg, intervals);
+                break;
+            case 's':
+                if(parse_names(optarg, distribution_names, DIST_COUNT, distributions) != 0) return -1;
+                break;
+            case 't':
+                thread_count = parse_list(optarg, thread_counts);
+                break;
+            case 'b':
+                batch_count = parse_list(optarg, batches);
+                break;
+            case 'n':
+                config.searches = strtoul(optarg, NULL, 0);
+                break;
+            case 'f':
+                json = strcmp(optarg, "json") == 0;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-d device] [-p paths] [-i intervals] [-s distributions] "
+                                "[-t threads] [-b batches] [-n searches] [-f csv|json]\n", argv[0]);
+                return -1;
+        }
+    }
+
+    if(config.searches == 0) {
+        fprintf(stderr, "Invalid search count\n");
+        return -1;
+    }
+
+    //Fall back to the software stand-in when there is no card
+    fd = open_device(config.device_path);
+    if(fd < 0) {
+        fprintf(stderr, "Failed to open %s, using the emulator\n", config.device_path);
+        config.device_path = PRIME_EMULATED_PATH;
+        //The emulator has no BAR0 to map
+        paths[PATH_MMAP] = 0;
+    }
+    else {
+        //Neither the emulator nor a card without BAR0, such as a mock
+        //card, can be mapped
+        if(paths[PATH_MMAP] && map_registers(fd) != 0) {
+            fprintf(stderr, "Failed to map BAR0, skipping the mmap path\n");
+            paths[PATH_MMAP] = 0;
+        }
+        unmap_registers();
+        close_device(fd);
+    }
+
+    if(!json) {
+        printf("path,distribution,poll_interval_us,threads,batch,searches,"
+               "min_ns,p50_ns,p99_ns,p999_ns,searches_per_second,syscalls_per_search\n");
+    }
+
+    for(p = 0; p < PATH_COUNT; p++) {
+        if(!paths[p]) continue;
+        config.path = p;
+
+        for(d = 0; d < DIST_COUNT; d++) {
+            if(!distributions[d]) continue;
+            config.distribution = d;
+
+            for(t = 0; t < thread_count; t++) {
+                config.threads = thread_counts[t];
+                if(config.threads == 0) continue;
+                //The library maps the registers of one device at a time
+                if(p == PATH_MMAP && config.threads > 1) continue;
+
+                //Only the polled paths have an interval and only the batch
+                //and client paths a batch size
+                for(i = 0; i < (p == PATH_PREAD || p == PATH_MMAP ? interval_count : 1); i++) {
+                    config.poll_interval_us = p == PATH_PREAD || p == PATH_MMAP ? intervals[i] : 0;
+
+                    for(b = 0; b < (p == PATH_BATCH || p == PATH_CLIENT ? batch_count : 1); b++) {
+                        config.batch = p == PATH_BATCH || p == PATH_CLIENT ? batches[b] : 1;
+                        if(config.batch == 0 || config.batch > MAX_BATCH) continue;
+
+                        if(run_config(&config, json) != 0) {
+                            fprintf(stderr, "%s %s with %u threads failed\n", path_names[p],
+                                    distribution_names[d], config.threads);
+                        }
+                        fflush(stdout);
+                    }
+                }
+            }
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,31 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "prime_index.h"
+
+//Default path of the index file
+#define DEFAULT_INDEX_PATH "prime_finder.idx"
+
+
+int main(int argc, char *argv[]) {
+    const char *path = DEFAULT_INDEX_PATH;
+    struct timespec start, end;
+
+    //The output path can be given on the command line
+    if(argc >= 2) {
+        path = argv[1];
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if(prime_index_build(path) != 0) {
+        printf("Failed to build the index\n");
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    printf("Built %s in %.1f s\n", path,
+           (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+
+    return 0;
+}
@@ -0,0 +1,516 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "client.h"
+#include "prime.h"
+#include "verify.h"
+#include "timing.h"
+
+//Default largest batch, the number of searches the driver copies in at once
+#define DEFAULT_MAX_BATCH 64
+//Default time to wait for a batch to fill
+#define DEFAULT_MAX_LINGER_US 50
+
+//States of a future
+#define FUTURE_PENDING 0
+#define FUTURE_DONE 1
+//Pending with a thread asleep on it
+#define FUTURE_WAITING 2
+
+struct prime_client {
+    int fd;
+    struct prime_client_config config;
+
+    //Intrusive multi-producer single-consumer queue of submitted searches.
+    //Producers swap themselves in at the tail and then link the node before
+    //them to themselves. Only the submission thread touches head. stub is a
+    //placeholder node that keeps the queue from ever being empty of nodes.
+    struct prime_future *tail;
+    struct prime_future *head;
+    struct prime_future stub;
+
+    //1 while the submission thread is asleep or about to be. Futex word.
+    uint32_t sleeping;
+    //Set by prime_client_close()
+    uint32_t closing;
+
+    pthread_t thread;
+    //Searches of the batch being run
+    struct prime_future **batch;
+    uint64_t *start_vals;
+    uint64_t *results;
+
+    struct prime_client_stats stats;
+};
+
+
+static long futex(uint32_t *word, int op, uint32_t value, const struct timespec *timeout) {
+    return syscall(SYS_futex, word, op, value, timeout, NULL, 0);
+}
+
+/*
+    Adds a search to the tail of the queue. Lock-free, any thread.
+
+    Paramaters:
+        client  -> Client to add to.
+        future  -> Search to add.
+*/
+static void queue_push(struct prime_client *client, struct prime_future *future) {
+    struct prime_future *prev;
+
+    __atomic_store_n(&future->next, NULL, __ATOMIC_RELAXED);
+    prev = __atomic_exchange_n(&client->tail, future, __ATOMIC_ACQ_REL);
+    //Between the exchange and this store the queue is cut in two and the
+    //submission thread cannot get past prev
+    __atomic_store_n(&prev->next, future, __ATOMIC_RELEASE);
+}
+
+/*
+    Takes the search at the head of the queue. Submission thread only.
+
+    Paramaters:
+        client  -> Client to take from.
+    Return:
+        The search, or NULL when the queue is empty or a push is half done.
+*/
+static struct prime_future *queue_pop(struct prime_client *client) {
+    struct prime_future *head = client->head;
+    struct prime_future *next = __atomic_load_n(&head->next, __ATOMIC_ACQUIRE);
+
+    if(head == &client->stub) {
+        if(next == NULL) {
+            return NULL;
+        }
+        client->head = next;
+        head = next;
+        next = __atomic_load_n(&next->next, __ATOMIC_ACQUIRE);
+    }
+
+    if(next != NULL) {
+        client->head = next;
+        return head;
+    }
+
+    //head is the last linked node. It can only be taken once the stub is
+    //queued behind it, which cannot happen while another push is linking.
+    if(head != __atomic_load_n(&client->tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    queue_push(client, &client->stub);
+    next = __atomic_load_n(&head->next, __ATOMIC_ACQUIRE);
+    if(next != NULL) {
+        client->head = next;
+        return head;
+    }
+
+    return NULL;
+}
+
+/*
+    Checks if nothing is queued, including pushes that are half done.
+    Submission thread only.
+
+    Paramaters:
+        client  -> Client to check.
+    Return:
+        1 if the queue is empty and 0 if not.
+*/
+static int queue_empty(struct prime_client *client) {
+    return client->head == &client->stub &&
+           __atomic_load_n(&client->tail, __ATOMIC_SEQ_CST) == &client->stub;
+}
+
+/*
+    Puts the submission thread to sleep until a search is queued, the
+    client is closed or a timeout passes.
+
+    Paramaters:
+        client      -> Client of the thread.
+        timeout_ns  -> Longest time to sleep, or 0 for no limit.
+*/
+static void client_idle(struct prime_client *client, uint64_t timeout_ns) {
+    struct timespec timeout;
+
+    timeout.tv_sec = timeout_ns / 1000000000ull;
+    timeout.tv_nsec = timeout_ns % 1000000000ull;
+
+    //Producers check sleeping after their push, and the queue is checked
+    //after sleeping is set, so one of the two sees the other
+    __atomic_store_n(&client->sleeping, 1, __ATOMIC_SEQ_CST);
+    if(queue_empty(client) && !__atomic_load_n(&client->closing, __ATOMIC_SEQ_CST)) {
+        futex(&client->sleeping, FUTEX_WAIT_PRIVATE, 1, timeout_ns ? &timeout : NULL);
+    }
+    __atomic_store_n(&client->sleeping, 0, __ATOMIC_RELAXED);
+}
+
+/*
+    Wakes the submission thread if it is asleep.
+
+    Paramaters:
+        client  -> Client of the thread.
+*/
+static void client_wake(struct prime_client *client) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&client->sleeping, __ATOMIC_RELAXED) &&
+       __atomic_exchange_n(&client->sleeping, 0, __ATOMIC_RELAXED)) {
+        futex(&client->sleeping, FUTEX_WAKE_PRIVATE, 1, NULL);
+    }
+}
+
+/*
+    Stores the result of a search and completes its future or calls its
+    callback. The future may be gone once this returns.
+
+    Paramaters:
+        future  -> Search that finished.
+        status  -> Status of the search.
+        result  -> Prime found.
+*/
+static void complete_future(struct prime_future *future, int status, uint64_t result) {
+    future->status = status;
+    future->result = status == 0 ? result : 0;
+
+    if(future->callback != NULL) {
+        future->callback(future->arg, future->status, future->start_val, future->result);
+        free(future);
+        return;
+    }
+
+    if(__atomic_exchange_n(&future->state, FUTURE_DONE, __ATOMIC_ACQ_REL) == FUTURE_WAITING) {
+        futex(&future->state, FUTEX_WAKE_PRIVATE, INT_MAX, NULL);
+    }
+}
+
+/*
+    Runs a batch as one find_primes_batch64() call and completes its
+    searches. A failed batch fails every search in it.
+
+    Paramaters:
+        client  -> Client the batch was taken from.
+        count   -> Number of searches in client->batch.
+*/
+static void run_batch(struct prime_client *client, uint32_t count) {
+    uint32_t i;
+    int status;
+
+    for(i = 0; i < count; i++) {
+        client->start_vals[i] = client->batch[i]->start_val;
+    }
+
+    status = find_primes_batch64(client->fd, client->start_vals, client->results, count);
+
+    for(i = 0; i < count; i++) {
+        complete_future(client->batch[i], status, client->results[i]);
+    }
+
+    __atomic_fetch_add(&client->stats.searches, count, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&client->stats.batches, 1, __ATOMIC_RELAXED);
+    if(status != 0) {
+        __atomic_fetch_add(&client->stats.failed_batches, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+    Submission thread of a client. Takes searches off the queue in batches
+    until the client is closed and the queue is empty.
+
+    Paramaters:
+        arg     -> The client.
+*/
+static void *client_thread_main(void *arg) {
+    struct prime_client *client = arg;
+    struct prime_future *future;
+    uint64_t deadline, now;
+    uint32_t count;
+
+    while(1) {
+        future = queue_pop(client);
+        if(future == NULL) {
+            if(!queue_empty(client)) {
+                sched_yield();
+            }
+            else if(__atomic_load_n(&client->closing, __ATOMIC_ACQUIRE)) {
+                break;
+            }
+            else {
+                client_idle(client, 0);
+            }
+            continue;
+        }
+
+        //Fill the batch until it is full or has lingered long enough
+        client->batch[0] = future;
+        count = 1;
+        deadline = now_ns() + (uint64_t) client->config.max_linger_us * 1000;
+        while(count < client->config.max_batch) {
+            future = queue_pop(client);
+            if(future != NULL) {
+                client->batch[count++] = future;
+                continue;
+            }
+            if(!queue_empty(client)) {
+                sched_yield();
+                continue;
+            }
+            now = now_ns();
+            if(now >= deadline || __atomic_load_n(&client->closing, __ATOMIC_ACQUIRE)) {
+                break;
+            }
+            client_idle(client, deadline - now);
+        }
+
+        run_batch(client, count);
+    }
+
+    //The spot checks of the samples this thread took
+    verify_flush();
+
+    return NULL;
+}
+
+/*
+    Fills in the default batching knobs.
+
+    Paramaters:
+        config  -> Knobs to fill in.
+*/
+void prime_client_default_config(struct prime_client_config *config) {
+    config->max_batch = DEFAULT_MAX_BATCH;
+    config->max_linger_us = DEFAULT_MAX_LINGER_US;
+}
+
+/*
+    Opens a device with open_device() and starts the client's submission
+    thread.
+
+    Paramaters:
+        path    -> Path of the device file.
+        config  -> Batching knobs, or NULL for the defaults.
+    Return:
+        The client, or NULL on failure.
+*/
+struct prime_client *prime_client_open(const char *path, const struct prime_client_config *config) {
+    struct prime_client *client = calloc(1, sizeof(struct prime_client));
+
+    if(client == NULL) {
+        return NULL;
+    }
+
+    if(config != NULL) {
+        client->config = *config;
+    }
+    else {
+        prime_client_default_config(&client->config);
+    }
+    if(client->config.max_batch == 0) {
+        client->config.max_batch = 1;
+    }
+
+    client->head = &client->stub;
+    client->tail = &client->stub;
+
+    client->batch = malloc(sizeof(struct prime_future*) * client->config.max_batch);
+    client->start_vals = malloc(sizeof(uint64_t) * client->config.max_batch);
+    client->results = malloc(sizeof(uint64_t) * client->config.max_batch);
+    if(client->batch == NULL || client->start_vals == NULL || client->results == NULL) {
+        goto free_client;
+    }
+
+    client->fd = open_device(path);
+    if(client->fd < 0) {
+        goto free_client;
+    }
+
+    if(pthread_create(&client->thread, NULL, client_thread_main, client) != 0) {
+        close_device(client->fd);
+        goto free_client;
+    }
+
+    return client;
+
+free_client:
+    free(client->batch);
+    free(client->start_vals);
+    free(client->results);
+    free(client);
+    return NULL;
+}
+
+/*
+    Completes every search already submitted, stops the submission thread
+    and closes the device. No thread may submit during or after the call.
+
+    Paramaters:
+        client  -> Client to close.
+*/
+void prime_client_close(struct prime_client *client) {
+    __atomic_store_n(&client->closing, 1, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&client->sleeping, 0, __ATOMIC_SEQ_CST);
+    futex(&client->sleeping, FUTEX_WAKE_PRIVATE, 1, NULL);
+    pthread_join(client->thread, NULL);
+
+    close_device(client->fd);
+    free(client->batch);
+    free(client->start_vals);
+    free(client->results);
+    free(client);
+}
+
+/*
+    Submits a search that completes a future. Can be called from any
+    thread.
+
+    Paramaters:
+        client      -> Client to run the search on.
+        future      -> Future the result is stored in.
+        start_val   -> Value to start the prime search from.
+    Return:
+        On success zero is returned, on failure a negative
+        value is returned.
+*/
+int prime_client_submit(struct prime_client *client, struct prime_future *future, uint64_t start_val) {
+    if(client == NULL || future == NULL) {
+        return -1;
+    }
+
+    future->start_val = start_val;
+    future->result = 0;
+    future->status = 0;
+    future->state = FUTURE_PENDING;
+    future->callback = NULL;
+    future->arg = NULL;
+
+    queue_push(client, future);
+    client_wake(client);
+
+    return 0;
+}
+
+/*
+    Submits a search that calls a callback. The callback runs on the
+    submission thread, so it should not block. Can be called from any
+    thread.
+
+    Paramaters:
+        client      -> Client to run the search on.
+        start_val   -> Value to start the prime search from.
+        callback    -> Function called with the result.
+        arg         -> First argument of the callback.
+    Return:
+        On success zero is returned, on failure a negative
+        value is returned.
+*/
+int prime_client_submit_callback(struct prime_client *client, uint64_t start_val, prime_callback callback, void *arg) {
+    struct prime_future *future;
+
+    if(client == NULL || callback == NULL) {
+        return -1;
+    }
+
+    //Freed by complete_future() after the callback
+    future = malloc(sizeof(struct prime_future));
+    if(future == NULL) {
+        return -1;
+    }
+
+    future->start_val = start_val;
+    future->result = 0;
+    future->status = 0;
+    future->state = FUTURE_PENDING;
+    future->callback = callback;
+    future->arg = arg;
+
+    queue_push(client, future);
+    client_wake(client);
+
+    return 0;
+}
+
+/*
+    Checks if the search of a future has completed.
+
+    Paramaters:
+        future  -> Future of the search.
+    Return:
+        1 if the search completed and 0 if not.
+*/
+int prime_future_ready(const struct prime_future *future) {
+    return __atomic_load_n(&future->state, __ATOMIC_ACQUIRE) == FUTURE_DONE;
+}
+
+/*
+    Sleeps until the search of a future completes.
+
+    Paramaters:
+        future  -> Future of the search.
+        result  -> Where to store the prime. Set to 0 when there is no
+                   prime left below 2^64.
+    Return:
+        On success zero is returned, on failure a negative
+        value is returned.
+*/
+int prime_future_wait(struct prime_future *future, uint64_t *result) {
+    uint32_t state = __atomic_load_n(&future->state, __ATOMIC_ACQUIRE);
+    uint32_t expected;
+
+    while(state != FUTURE_DONE) {
+        //Mark the future so the submission thread knows to wake it
+        expected = FUTURE_PENDING;
+        if(state == FUTURE_PENDING &&
+           !__atomic_compare_exchange_n(&future->state, &expected, FUTURE_WAITING, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+            state = expected;
+            continue;
+        }
+        futex(&future->state, FUTEX_WAIT_PRIVATE, FUTURE_WAITING, NULL);
+        state = __atomic_load_n(&future->state, __ATOMIC_ACQUIRE);
+    }
+
+    if(result != NULL) {
+        *result = future->result;
+    }
+
+    return future->status;
+}
+
+/*
+    Runs one search on a client and waits for it.
+
+    Paramaters:
+        client          -> Client to run the search on.
+        start_val       -> Value to start the prime search from.
+        search_result   -> Where to store the prime.
+    Return:
+        On success zero is returned, on failure a negative
+        value is returned.
+*/
+int prime_client_find_prime(struct prime_client *client, uint64_t start_val, uint64_t *search_result) {
+    struct prime_future future;
+
+    if(prime_client_submit(client, &future, start_val) != 0) {
+        return -1;
+    }
+
+    return prime_future_wait(&future, search_result);
+}
+
+/*
+    Reads the totals of a client.
+
+    Paramaters:
+        client  -> Client to read.
+        stats   -> Where to store the totals.
+*/
+void prime_client_get_stats(struct prime_client *client, struct prime_client_stats *stats) {
+    stats->searches = __atomic_load_n(&client->stats.searches, __ATOMIC_RELAXED);
+    stats->batches = __atomic_load_n(&client->stats.batches, __ATOMIC_RELAXED);
+    stats->failed_batches = __atomic_load_n(&client->stats.failed_batches, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,159 @@
+#ifndef CLIENT_H
+#define CLIENT_H
+
+#include <stdint.h>
+
+//Client of the device that any number of threads can share. The free
+//functions of prime.h work on a file descriptor that one thread owns, so
+//threads that share a card each need their own descriptor and their own
+//system call per search. A client owns one descriptor and one submission
+//thread. Searches are pushed onto a lock-free queue from any thread, and
+//the submission thread takes them off in batches of up to max_batch and
+//runs each batch as one find_primes_batch64() call, so the driver has the
+//whole batch queued for the card. After the first search of a batch it
+//lingers for up to max_linger_us for more to arrive. Searches submitted
+//while a batch runs make up the next one. Every search completes a future
+//the caller owns, or calls a callback on the submission thread. The
+//aggregate node reaches every card through one client.
+
+//Batching knobs of a client
+struct prime_client_config {
+    //Largest number of searches in one batch
+    uint32_t max_batch;
+    //Longest time to wait for a batch to fill after its first search, in
+    //microseconds. 0 sends whatever is queued straight away.
+    uint32_t max_linger_us;
+};
+
+//Totals of a client
+struct prime_client_stats {
+    //Searches that were completed
+    uint64_t searches;
+    //Batches the searches were sent in
+    uint64_t batches;
+    //Batches that failed
+    uint64_t failed_batches;
+};
+
+//Called on the submission thread when a search completes
+typedef void (*prime_callback)(void *arg, int status, uint64_t start_val, uint64_t result);
+
+//One search. Owned by the caller and must stay in place until the search
+//completes. The fields belong to the client.
+struct prime_future {
+    struct prime_future *next;
+    uint64_t start_val;
+    uint64_t result;
+    int status;
+    uint32_t state;
+    prime_callback callback;
+    void *arg;
+};
+
+struct prime_client;
+
+/*
+    Fills in the default batching knobs.
+
+    Paramaters:
+        config  -> Knobs to fill in.
+*/
+void prime_client_default_config(struct prime_client_config *config);
+
+/*
+    Opens a device with open_device() and starts the client's submission
+    thread.
+
+    Paramaters:
+        path    -> Path of the device file.
+        config  -> Batching knobs, or NULL for the defaults.
+    Return:
+        The client, or NULL on failure.
+*/
+struct prime_client *prime_client_open(const char *path, const struct prime_client_config *config);
+
+/*
+    Completes every search already submitted, stops the submission thread
+    and closes the device. No thread may submit during or after the call.
+
+    Paramaters:
+        client  -> Client to close.
+*/
+void prime_client_close(struct prime_client *client);
+
+/*
+    Submits a search that completes a future. Can be called from any
+    thread.
+
+    Paramaters:
+        client      -> Client to run the search on.
+        future      -> Future the result is stored in.
+        start_val   -> Value to start the prime search from.
+    Return:
+        On success zero is returned, on failure a negative
+        value is returned.
+*/
+int prime_client_submit(struct prime_client *client, struct prime_future *future, uint64_t start_val);
+
+/*
+    Submits a search that calls a callback. The callback runs on the
+    submission thread, so it should not block. Can be called from any
+    thread.
+
+    Paramaters:
+        client      -> Client to run the search on.
+        start_val   -> Value to start the prime search from.
+        callback    -> Function called with the result.
+        arg         -> First argument of the callback.
+    Return:
+        On success zero is returned, on failure a negative
+        value is returned.
+*/
+int prime_client_submit_callback(struct prime_client *client, uint64_t start_val, prime_callback callback, void *arg);
+
+/*
+    Checks if the search of a future has completed.
+
+    Paramaters:
+        future  -> Future of the search.
+    Return:
+        1 if the search completed and 0 if not.
+*/
+int prime_future_ready(const struct prime_future *future);
+
+/*
+    Sleeps until the search of a future completes.
+
+    Paramaters:
+        future  -> Future of the search.
+        result  -> Where to store the prime. Set to 0 when there is no
+                   prime left below 2^64.
+    Return:
+        On success zero is returned, on failure a negative
+        value is returned.
+*/
+int prime_future_wait(struct prime_future *future, uint64_t *result);
+
+/*
+    Runs one search on a client and waits for it.
+
+    Paramaters:
+        client          -> Client to run the search on.
+        start_val       -> Value to start the prime search from.
+        search_result   -> Where to store the prime.
+    Return:
+        On success zero is returned, on failure a negative
+        value is returned.
+*/
+int prime_client_find_prime(struct prime_client *client, uint64_t start_val, uint64_t *search_result);
+
+/*
+    Reads the totals of a client.
+
+    Paramaters:
+        client  -> Client to read.
+        stats   -> Where to store the totals.
+*/
+void prime_client_get_stats(struct prime_client *client, struct prime_client_stats *stats);
+
+#endif
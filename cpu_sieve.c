@@ -0,0 +1,444 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <immintrin.h>
+
+#include "prime.h"
+#include "cpu_sieve.h"
+#include "timing.h"
+
+//Bit i of the sieve stands for the odd number 2 * i + 1
+
+//Bytes of one segment. Sized to stay in the L1 cache.
+#define SEGMENT_BYTES (32 * 1024)
+#define SEGMENT_WORDS (SEGMENT_BYTES / 8)
+#define SEGMENT_BITS (SEGMENT_BYTES * 8)
+
+//Segments each thread sieves per pass of a range search
+#define STREAM_SEGMENTS 16
+
+//The pre-sieved pattern crosses off 3, 5, 7, 11 and 13 and repeats every
+//3 * 5 * 7 * 11 * 13 bits
+#define PRESIEVE_PERIOD 15015
+//The pattern is stored long enough to copy a whole segment from any phase
+#define PRESIEVE_WORDS ((PRESIEVE_PERIOD + 63) / 64 + SEGMENT_WORDS + 1)
+//First prime that is crossed off segment by segment
+#define FIRST_SIEVE_PRIME 17
+
+//Every composite below 2^32 has a factor below this
+#define SIEVE_PRIME_LIMIT 65536
+//Odd numbers below 2^32 have a bit index below this
+#define INDEX_LIMIT (1ull << 31)
+
+//Copies words of the pre-sieved pattern starting at a bit offset
+typedef void (*presieve_copy_fn)(uint64_t *words, uint64_t word_count, unsigned int bit_offset);
+
+static uint64_t presieve_pattern[PRESIEVE_WORDS];
+//Odd primes from FIRST_SIEVE_PRIME up to SIEVE_PRIME_LIMIT
+static uint32_t *sieve_primes;
+static int sieve_prime_count;
+static presieve_copy_fn presieve_copy;
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+static unsigned int thread_count = 0;
+
+//Work of one thread during a pass of a range search
+struct sieve_stream {
+    uint64_t first_index;
+    uint64_t end_index;
+    uint32_t *primes;
+    uint64_t count;
+};
+
+
+/*
+    Copies the pre-sieved pattern with plain 64 bit operations.
+
+    Paramaters:
+        words       -> Segment to fill.
+        word_count  -> Number of words in the segment.
+        bit_offset  -> Bit of the pattern the segment starts at.
+*/
+static void presieve_copy_scalar(uint64_t *words, uint64_t word_count, unsigned int bit_offset) {
+    const uint64_t *source = presieve_pattern + bit_offset / 64;
+    unsigned int shift = bit_offset % 64;
+    uint64_t j;
+
+    if(shift == 0) {
+        memcpy(words, source, word_count * sizeof(uint64_t));
+        return;
+    }
+
+    for(j = 0; j < word_count; j++) {
+        words[j] = (source[j] >> shift) | (source[j + 1] << (64 - shift));
+    }
+}
+
+/*
+    Copies the pre-sieved pattern four words at a time with AVX2. A vector
+    shift by 64 gives zero so no special case is needed for whole words.
+*/
+__attribute__((target("avx2")))
+static void presieve_copy_avx2(uint64_t *words, uint64_t word_count, unsigned int bit_offset) {
+    const uint64_t *source = presieve_pattern + bit_offset / 64;
+    __m128i right = _mm_cvtsi32_si128(bit_offset % 64);
+    __m128i left = _mm_cvtsi32_si128(64 - bit_offset % 64);
+    __m256i low, high;
+    uint64_t j;
+
+    for(j = 0; j + 4 <= word_count; j += 4) {
+        low = _mm256_loadu_si256((const __m256i*) (source + j));
+        high = _mm256_loadu_si256((const __m256i*) (source + j + 1));
+        _mm256_storeu_si256((__m256i*) (words + j),
+                            _mm256_or_si256(_mm256_srl_epi64(low, right), _mm256_sll_epi64(high, left)));
+    }
+
+    if(j < word_count) {
+        presieve_copy_scalar(words + j, word_count - j, bit_offset + j * 64);
+    }
+}
+
+/*
+    Copies the pre-sieved pattern eight words at a time with AVX-512.
+*/
+__attribute__((target("avx512f")))
+static void presieve_copy_avx512(uint64_t *words, uint64_t word_count, unsigned int bit_offset) {
+    const uint64_t *source = presieve_pattern + bit_offset / 64;
+    __m128i right = _mm_cvtsi32_si128(bit_offset % 64);
+    __m128i left = _mm_cvtsi32_si128(64 - bit_offset % 64);
+    __m512i low, high;
+    uint64_t j;
+
+    for(j = 0; j + 8 <= word_count; j += 8) {
+        low = _mm512_loadu_si512((const void*) (source + j));
+        high = _mm512_loadu_si512((const void*) (source + j + 1));
+        _mm512_storeu_si512((void*) (words + j),
+                            _mm512_or_si512(_mm512_srl_epi64(low, right), _mm512_sll_epi64(high, left)));
+    }
+
+    if(j < word_count) {
+        presieve_copy_scalar(words + j, word_count - j, bit_offset + j * 64);
+    }
+}
+
+/*
+    Builds the pre-sieved pattern and the sieving primes and picks the
+    widest copy kernel the CPU supports. Runs once.
+*/
+static void cpu_sieve_init(void) {
+    static const uint32_t presieve_primes[5] = {3, 5, 7, 11, 13};
+    uint8_t *composite;
+    uint64_t bit, number;
+    uint32_t p, n;
+    int i;
+
+    //Bit 0 of the pattern is at a multiple of the period so the pattern
+    //lines up with every segment start modulo the period
+    memset(presieve_pattern, 0xff, sizeof(presieve_pattern));
+    for(bit = 0; bit < PRESIEVE_WORDS * 64; bit++) {
+        number = 2 * bit + 1;
+        for(i = 0; i < 5; i++) {
+            if(number % presieve_primes[i] == 0) {
+                presieve_pattern[bit / 64] &= ~(1ull << (bit % 64));
+                break;
+            }
+        }
+    }
+
+    composite = calloc(SIEVE_PRIME_LIMIT, 1);
+    sieve_primes = malloc(sizeof(uint32_t) * (SIEVE_PRIME_LIMIT / 8));
+    if(composite == NULL || sieve_primes == NULL) {
+        abort();
+    }
+    for(p = 2; p < SIEVE_PRIME_LIMIT; p++) {
+        if(composite[p]) continue;
+        for(n = p * p; n < SIEVE_PRIME_LIMIT; n += p) {
+            composite[n] = 1;
+        }
+        if(p >= FIRST_SIEVE_PRIME) {
+            sieve_primes[sieve_prime_count++] = p;
+        }
+    }
+    free(composite);
+
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx512f")) {
+        presieve_copy = presieve_copy_avx512;
+    }
+    else if(__builtin_cpu_supports("avx2")) {
+        presieve_copy = presieve_copy_avx2;
+    }
+    else {
+        presieve_copy = presieve_copy_scalar;
+    }
+}
+
+/*
+    Sieves one segment of odd numbers.
+
+    Paramaters:
+        words       -> Bitmap of the segment.
+        first_index -> Bit index of the first number of the segment.
+        bit_count   -> Number of bits in the segment. At most SEGMENT_BITS.
+*/
+static void sieve_segment(uint64_t *words, uint64_t first_index, uint64_t bit_count) {
+    static const uint32_t presieve_primes[5] = {3, 5, 7, 11, 13};
+    uint64_t word_count = (bit_count + 63) / 64;
+    uint64_t low = 2 * first_index + 1;
+    uint64_t last = 2 * (first_index + bit_count - 1) + 1;
+    uint64_t start, multiple, index;
+    uint32_t p;
+    int i;
+
+    presieve_copy(words, word_count, first_index % PRESIEVE_PERIOD);
+
+    //Cross off the odd multiples of each prime from its square
+    for(i = 0; i < sieve_prime_count; i++) {
+        p = sieve_primes[i];
+        if((uint64_t) p * p > last) break;
+
+        start = (uint64_t) p * p > low ? (uint64_t) p * p : low;
+        multiple = (start + p - 1) / p * p;
+        if(multiple % 2 == 0) multiple += p;
+
+        for(index = (multiple - 1) / 2 - first_index; index < bit_count; index += p) {
+            words[index / 64] &= ~(1ull << (index % 64));
+        }
+    }
+
+    //The pattern crossed off the pre-sieved primes themselves and 1 is not
+    //prime
+    for(i = 0; i < 5; i++) {
+        if(presieve_primes[i] >= low && presieve_primes[i] <= last) {
+            index = (presieve_primes[i] - 1) / 2 - first_index;
+            words[index / 64] |= 1ull << (index % 64);
+        }
+    }
+    if(first_index == 0) {
+        words[0] &= ~1ull;
+    }
+
+    //Drop the bits past the end of the segment
+    if(bit_count % 64 != 0) {
+        words[word_count - 1] &= (1ull << (bit_count % 64)) - 1;
+    }
+}
+
+/*
+    Stores the primes of a sieved segment in order.
+
+    Paramaters:
+        words       -> Bitmap of the segment.
+        first_index -> Bit index of the first number of the segment.
+        bit_count   -> Number of bits in the segment.
+        primes      -> Where to store the primes.
+    Return:
+        The number of primes stored.
+*/
+static uint64_t collect_primes(const uint64_t *words, uint64_t first_index, uint64_t bit_count, uint32_t *primes) {
+    uint64_t word_count = (bit_count + 63) / 64;
+    uint64_t count = 0;
+    uint64_t bits, j;
+
+    for(j = 0; j < word_count; j++) {
+        for(bits = words[j]; bits != 0; bits &= bits - 1) {
+            primes[count++] = (uint32_t) (2 * (first_index + j * 64 + __builtin_ctzll(bits)) + 1);
+        }
+    }
+
+    return count;
+}
+
+/*
+    Thread body of a range search. Sieves its run of segments one after
+    the other and keeps the primes in order.
+
+    Paramaters:
+        arg     -> The thread's struct sieve_stream.
+*/
+static void *sieve_stream_main(void *arg) {
+    struct sieve_stream *stream = arg;
+    uint64_t words[SEGMENT_WORDS];
+    uint64_t index, bit_count;
+
+    stream->count = 0;
+    for(index = stream->first_index; index < stream->end_index; index += bit_count) {
+        bit_count = stream->end_index - index;
+        if(bit_count > SEGMENT_BITS) bit_count = SEGMENT_BITS;
+
+        sieve_segment(words, index, bit_count);
+        stream->count += collect_primes(words, index, bit_count, stream->primes + stream->count);
+    }
+
+    return NULL;
+}
+
+/*
+    Sets the number of threads range searches use.
+
+    Paramaters:
+        threads -> Number of threads, or 0 to use one per online CPU.
+*/
+void cpu_sieve_set_threads(unsigned int threads) {
+    thread_count = threads;
+}
+
+/*
+    Finds the first prime at or after a value.
+
+    Paramaters:
+        start_val       -> Value to start the search from.
+        search_result   -> Where to store the prime. Set to 0 when there is
+                           no prime left below 2^32, like the device does.
+    Return:
+        On success zero is returned, on failure a negative
+        value is returned.
+*/
+int cpu_find_prime(uint32_t start_val, uint32_t *search_result) {
+    //Prime gaps below 2^32 are far smaller than this window
+    uint64_t words[64];
+    uint64_t index = start_val / 2;
+    uint64_t bit_count, j;
+
+    pthread_once(&init_once, cpu_sieve_init);
+
+    if(start_val <= 2) {
+        *search_result = 2;
+        return 0;
+    }
+
+    for(; index < INDEX_LIMIT; index += bit_count) {
+        bit_count = INDEX_LIMIT - index;
+        if(bit_count > sizeof(words) * 8) bit_count = sizeof(words) * 8;
+
+        sieve_segment(words, index, bit_count);
+        for(j = 0; j < (bit_count + 63) / 64; j++) {
+            if(words[j] != 0) {
+                *search_result = (uint32_t) (2 * (index + j * 64 + __builtin_ctzll(words[j])) + 1);
+                return 0;
+            }
+        }
+    }
+
+    *search_result = 0;
+    return 0;
+}
+
+/*
+    Finds every prime in [low, high).
+
+    Paramaters:
+        low             -> First value of the range.
+        high            -> End of the range, which is not included. At most
+                           2^32.
+        primes          -> Array the primes are stored in.
+        capacity        -> Number of entries in primes.
+        count           -> Set to the number of primes stored.
+        stats           -> Set to the throughput of the search, a struct
+                           range_stats from prime.h. cycles is always 0.
+                           May be NULL.
+    Return:
+        0 once the whole range has been searched, 1 if primes filled up
+        first, in which case the range continues after the last prime, and a
+        negative value on failure.
+*/
+int cpu_find_primes_in_range(uint32_t low, uint64_t high, uint32_t *primes, uint32_t capacity,
+                             uint32_t *count, struct range_stats *stats) {
+    struct sieve_stream streams[256];
+    pthread_t threads[256];
+    bool threaded[256];
+    uint64_t start_ns = now_ns();
+    uint64_t index = low / 2;
+    uint64_t end_index = high / 2;
+    uint64_t stream_bits, pass_end, copy;
+    unsigned int stream_count, started, t;
+    int status = 0;
+
+    pthread_once(&init_once, cpu_sieve_init);
+
+    *count = 0;
+    if(high > (1ull << 32)) {
+        return -1;
+    }
+
+    stream_count = thread_count;
+    if(stream_count == 0) {
+        stream_count = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if(stream_count < 1) stream_count = 1;
+    if(stream_count > 256) stream_count = 256;
+
+    //2 is the only even prime
+    if(low <= 2 && high > 2 && capacity > 0) {
+        primes[(*count)++] = 2;
+    }
+
+    //Every number of a pass is one of the 5760 in 15015 odd numbers that
+    //the pattern leaves, so this bounds the primes a stream can find
+    stream_bits = (uint64_t) STREAM_SEGMENTS * SEGMENT_BITS;
+    for(t = 0; t < stream_count; t++) {
+        streams[t].primes = malloc(sizeof(uint32_t) * (stream_bits * 2 / 5 + 64));
+        if(streams[t].primes == NULL) {
+            status = -1;
+        }
+    }
+
+    while(status == 0 && index < end_index && *count < capacity) {
+        //One run of segments per thread. Small ranges stay on this thread.
+        pass_end = end_index - index < stream_bits * stream_count ? end_index : index + stream_bits * stream_count;
+        started = 0;
+        for(t = 0; t < stream_count && index < pass_end; t++) {
+            streams[t].first_index = index;
+            streams[t].end_index = pass_end - index < stream_bits ? pass_end : index + stream_bits;
+            index = streams[t].end_index;
+
+            threaded[t] = !(t == 0 && index == pass_end) &&
+                          pthread_create(&threads[t], NULL, sieve_stream_main, &streams[t]) == 0;
+            if(!threaded[t]) {
+                sieve_stream_main(&streams[t]);
+            }
+            started++;
+        }
+
+        //Merge the streams in order
+        for(t = 0; t < started; t++) {
+            if(threaded[t]) {
+                pthread_join(threads[t], NULL);
+            }
+
+            copy = streams[t].count;
+            if(copy > capacity - *count) {
+                copy = capacity - *count;
+                //The primes that did not fit are found again next time
+                status = 1;
+            }
+            memcpy(primes + *count, streams[t].primes, copy * sizeof(uint32_t));
+            *count += copy;
+        }
+    }
+
+    for(t = 0; t < stream_count; t++) {
+        free(streams[t].primes);
+    }
+
+    if(stats != NULL) {
+        stats->primes = *count;
+        stats->cycles = 0;
+        stats->elapsed_ns = now_ns() - start_ns;
+    }
+
+    if(status < 0) {
+        return -1;
+    }
+
+    //The buffer filled up before the end of the range
+    if(status == 1 || (*count == capacity && index < end_index)) {
+        return 1;
+    }
+
+    return 0;
+}
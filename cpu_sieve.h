@@ -0,0 +1,57 @@
+#ifndef CPU_SIEVE_H
+#define CPU_SIEVE_H
+
+#include <stdint.h>
+
+//CPU engine that answers the same searches as the device with a segmented
+//sieve of Eratosthenes. Only odd numbers are stored, one bit each, and a
+//segment is sized to fit in the L1 cache. Each segment starts from a copy
+//of a pre-sieved pattern for 3, 5, 7, 11 and 13. The pattern is copied with
+//AVX-512 or AVX2 when the CPU has them and with plain 64 bit operations
+//otherwise. Range searches give each thread its own run of segments.
+
+struct range_stats;
+
+/*
+    Sets the number of threads range searches use.
+
+    Paramaters:
+        threads -> Number of threads, or 0 to use one per online CPU.
+*/
+void cpu_sieve_set_threads(unsigned int threads);
+
+/*
+    Finds the first prime at or after a value.
+
+    Paramaters:
+        start_val       -> Value to start the search from.
+        search_result   -> Where to store the prime. Set to 0 when there is
+                           no prime left below 2^32, like the device does.
+    Return:
+        On success zero is returned, on failure a negative
+        value is returned.
+*/
+int cpu_find_prime(uint32_t start_val, uint32_t *search_result);
+
+/*
+    Finds every prime in [low, high).
+
+    Paramaters:
+        low             -> First value of the range.
+        high            -> End of the range, which is not included. At most
+                           2^32.
+        primes          -> Array the primes are stored in.
+        capacity        -> Number of entries in primes.
+        count           -> Set to the number of primes stored.
+        stats           -> Set to the throughput of the search, a struct
+                           range_stats from prime.h. cycles is always 0.
+                           May be NULL.
+    Return:
+        0 once the whole range has been searched, 1 if primes filled up
+        first, in which case the range continues after the last prime, and a
+        negative value on failure.
+*/
+int cpu_find_primes_in_range(uint32_t low, uint64_t high, uint32_t *primes, uint32_t capacity,
+                             uint32_t *count, struct range_stats *stats);
+
+#endif
@@ -1,10 +1,15 @@
 #!/bin/bash
 
-PCI_ID=$(lspci | grep -i xilinx | awk '{print $1}')
+#Last resort for a wedged card. "./user_space_test reset" resets it in
+#place without dropping the driver or the open files.
+PCI_IDS=$(lspci | grep -i xilinx | awk '{print $1}')
 
-echo $PCI_ID
+#Remove every card before rescanning the bus
+for PCI_ID in $PCI_IDS; do
+    echo $PCI_ID
 
-echo /sys/bus/pci/devices/0000\:$PCI_ID/remove
+    echo /sys/bus/pci/devices/0000\:$PCI_ID/remove
 
-echo 1 > /sys/bus/pci/devices/0000\:$PCI_ID/remove
+    echo 1 > /sys/bus/pci/devices/0000\:$PCI_ID/remove
+done
 echo 1 > /sys/bus/pci/rescan
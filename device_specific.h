@@ -11,3 +11,42 @@
 #define PRIME_NUMBER 12
 #define CYCLE_COUNT_HIGH 16
 #define CYCLE_COUNT_LOW 20
+//Size in bytes of the block of registers above
+#define REGISTER_WINDOW_SIZE 24
+
+
+//IOCTL command IDs
+#define IOCTL_FIND_PRIME 0
+#define IOCTL_FIND_PRIMES_BATCH 1
+#define IOCTL_RING_ENTER 2
+#define IOCTL_SET_EVENTFD 3
+#define IOCTL_FIND_PRIME_WAIT 4
+#define IOCTL_FIND_PRIMES_RANGE 5
+#define IOCTL_READ_STATUS 6
+#define IOCTL_CANCEL 7
+#define IOCTL_RESET 8
+
+
+//How a blocking search waits for the device. WAIT_MODE_DEFAULT uses the
+//wait_mode module parameter. WAIT_MODE_HYBRID spins on DONE_FLAG for
+//searches expected to be short and sleeps on the interrupt otherwise.
+#define WAIT_MODE_DEFAULT 0
+#define WAIT_MODE_INTERRUPT 1
+#define WAIT_MODE_HYBRID 2
+
+
+//Submission/completion ring layout shared with userspace. The rings are
+//mapped by passing RING_MMAP_PAGE_OFFSET pages as the mmap() offset, well
+//past the end of BAR0. RING_ENTRIES must be a power of two.
+#define RING_MMAP_PAGE_OFFSET 0x10000
+#define RING_ENTRIES 256
+//Set by the driver in the ring flags when the device has gone idle and
+//IOCTL_RING_ENTER is needed to start the next submission.
+#define RING_FLAG_NEED_WAKEUP 1
+
+
+//Each card gets its own minor number starting at zero. The aggregate node
+//that spreads searches across every card uses the minor after the last
+//card.
+#define MAX_DEVICES 8
+#define AGGREGATE_MINOR MAX_DEVICES
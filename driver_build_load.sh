@@ -5,7 +5,9 @@ DEVICE_FILE_NAME=prime_finder
 
 ./device_refresh.sh
 
-#Remove the driver if it is already loaded
+#Remove the driver if it is already loaded. The mock module uses the
+#driver so it has to go first.
+rmmod ${DRIVER_NAME}_mock
 rmmod $DRIVER_NAME
 #Rebuild the driver
 make
@@ -14,5 +16,17 @@ insmod $DRIVER_NAME.ko
 
 MAJOR_NUMBER=`cat /proc/devices | grep $DRIVER_NAME | awk '{print $1}'`
 
-#The c argument creates a character device
+#The c argument creates a character device. Each card gets its own node
+#and /dev/prime_finder stays pointed at the first card.
+MAX_DEVICES=8
 mknod /dev/$DEVICE_FILE_NAME c $MAJOR_NUMBER 0
+for MINOR in $(seq 0 $((MAX_DEVICES - 1))); do
+    mknod /dev/$DEVICE_FILE_NAME$MINOR c $MAJOR_NUMBER $MINOR
+done
+#The aggregate node spreads searches across every card
+mknod /dev/${DEVICE_FILE_NAME}_all c $MAJOR_NUMBER $MAX_DEVICES
+
+#Passing mock adds a virtual card for machines without the hardware
+if [ "$1" == "mock" ]; then
+    insmod ${DRIVER_NAME}_mock.ko
+fi
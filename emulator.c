@@ -0,0 +1,520 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include "device_specific.h"
+#include "emulator.h"
+#include "timing.h"
+
+//Most emulated devices that can be open at once
+#define MAX_EMULATED_DEVICES 8
+
+#define DEFAULT_LATENCY_NS 0
+#define DEFAULT_CLOCK_HZ 125000000ull
+
+//Register indexes of the 32 bit register window
+#define REGISTER_COUNT (REGISTER_WINDOW_SIZE / 4)
+
+struct emulated_device {
+    //Eventfd handed out as the device's file descriptor
+    int fd;
+    struct emulator_config config;
+
+    //Protects everything below
+    pthread_mutex_t lock;
+    //Signaled when a search is started or finishes and on shutdown
+    pthread_cond_t cond;
+
+    uint32_t registers[REGISTER_COUNT];
+    //Bumped every time a search is started. A search that was replaced
+    //while it ran does not publish its result.
+    uint64_t generation;
+    //Generation of the last search that finished
+    uint64_t done_generation;
+    int event_fd;
+    int stop;
+
+    //Serializes emulator_find_prime callers
+    pthread_mutex_t search_lock;
+
+    pthread_t worker;
+};
+
+//Emulated devices that are open. Looked up by file descriptor.
+static struct emulated_device *devices[MAX_EMULATED_DEVICES];
+static pthread_mutex_t devices_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/*
+    Checks whether a number is prime by trial division with 6k +/- 1.
+
+    Paramaters:
+        n   -> Number to test.
+    Return:
+        1 if n is prime and 0 otherwise.
+*/
+static int is_prime(uint32_t n) {
+    uint32_t i;
+
+    if(n < 2) return 0;
+    if(n < 4) return 1;
+    if(n % 2 == 0 || n % 3 == 0) return 0;
+
+    for(i = 5; (uint64_t) i * i <= n; i += 6) {
+        if(n % i == 0 || n % (i + 2) == 0) return 0;
+    }
+
+    return 1;
+}
+
+/*
+    Finds the first prime at or after a value, like the card does.
+
+    Paramaters:
+        start_val   -> Value to start the search from.
+    Return:
+        The prime, or 0 if there is none below 2^32.
+*/
+static uint32_t next_prime(uint32_t start_val) {
+    uint64_t n;
+
+    for(n = start_val; n <= UINT32_MAX; n++) {
+        if(is_prime((uint32_t) n)) {
+            return (uint32_t) n;
+        }
+    }
+
+    return 0;
+}
+
+/*
+    Signals the device's own eventfd and the registered one, if any. Must
+    be called with the device lock held.
+
+    Paramaters:
+        device  -> Device whose search finished.
+*/
+static void signal_done(struct emulated_device *device) {
+    uint64_t one = 1;
+
+    //The counter only has to become non-zero so a failed write is harmless
+    if(write(device->fd, &one, sizeof(one)) < 0) {}
+    if(device->event_fd >= 0 && write(device->event_fd, &one, sizeof(one)) < 0) {}
+}
+
+/*
+    Worker thread of an emulated device. Waits for START_FLAG to be set,
+    computes the next prime and publishes it the way the card would.
+
+    Paramaters:
+        arg     -> The emulated device.
+*/
+static void *worker_main(void *arg) {
+    struct emulated_device *device = arg;
+    uint64_t generation;
+    uint64_t start_ns, elapsed_ns, cycles;
+    uint32_t start_val, result;
+    struct timespec delay;
+
+    pthread_mutex_lock(&device->lock);
+    while(!device->stop) {
+        if(device->done_generation == device->generation) {
+            pthread_cond_wait(&device->cond, &device->lock);
+            continue;
+        }
+
+        generation = device->generation;
+        start_val = device->registers[START_NUMBER / 4];
+        pthread_mutex_unlock(&device->lock);
+
+        start_ns = now_ns();
+        result = next_prime(start_val);
+
+        //Pad the search out to the configured latency
+        elapsed_ns = now_ns() - start_ns;
+        if(elapsed_ns < device->config.latency_ns) {
+            delay.tv_sec = (device->config.latency_ns - elapsed_ns) / 1000000000ull;
+            delay.tv_nsec = (device->config.latency_ns - elapsed_ns) % 1000000000ull;
+            nanosleep(&delay, NULL);
+            elapsed_ns = now_ns() - start_ns;
+        }
+        cycles = elapsed_ns * device->config.clock_hz / 1000000000ull;
+
+        pthread_mutex_lock(&device->lock);
+        if(device->generation != generation) {
+            //Restarted while running, start over with the new value
+            continue;
+        }
+
+        device->registers[PRIME_NUMBER / 4] = result;
+        device->registers[CYCLE_COUNT_HIGH / 4] = (uint32_t) (cycles >> 32);
+        device->registers[CYCLE_COUNT_LOW / 4] = (uint32_t) cycles;
+        device->registers[DONE_FLAG / 4] = 1;
+        device->done_generation = generation;
+
+        signal_done(device);
+        pthread_cond_broadcast(&device->cond);
+    }
+    pthread_mutex_unlock(&device->lock);
+
+    return NULL;
+}
+
+/*
+    Finds the emulated device behind a file descriptor.
+
+    Paramaters:
+        fd  -> File descriptor to look up.
+    Return:
+        The device, or NULL if fd is not emulated.
+*/
+static struct emulated_device *lookup(int fd) {
+    struct emulated_device *device = NULL;
+    int i;
+
+    if(fd < 0) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&devices_lock);
+    for(i = 0; i < MAX_EMULATED_DEVICES; i++) {
+        if(devices[i] != NULL && devices[i]->fd == fd) {
+            device = devices[i];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&devices_lock);
+
+    return device;
+}
+
+/*
+    Reads an unsigned integer setting from the environment.
+
+    Paramaters:
+        name    -> Name of the environment variable.
+        value   -> Left unchanged if the variable is not set.
+*/
+static void read_env_setting(const char *name, uint64_t *value) {
+    const char *text = getenv(name);
+
+    if(text != NULL && *text != '\0') {
+        *value = strtoull(text, NULL, 0);
+    }
+}
+
+/*
+    Fills in the default settings. The PRIME_FINDER_EMULATE_LATENCY_NS and
+    PRIME_FINDER_EMULATE_CLOCK_HZ environment variables override them.
+
+    Paramaters:
+        config  -> Settings to fill in.
+*/
+void emulator_default_config(struct emulator_config *config) {
+    config->latency_ns = DEFAULT_LATENCY_NS;
+    config->clock_hz = DEFAULT_CLOCK_HZ;
+
+    read_env_setting("PRIME_FINDER_EMULATE_LATENCY_NS", &config->latency_ns);
+    read_env_setting("PRIME_FINDER_EMULATE_CLOCK_HZ", &config->clock_hz);
+}
+
+/*
+    Creates an emulated device and starts its worker thread.
+
+    Paramaters:
+        config  -> Settings of the device.
+    Return:
+        A file descriptor that stands for the device, or a negative value
+        on failure. Like the device file it is readable for poll() once
+        the running search has finished.
+*/
+int emulator_open(const struct emulator_config *config) {
+    struct emulated_device *device;
+    int slot = -1;
+    int i;
+
+    device = calloc(1, sizeof(struct emulated_device));
+    if(device == NULL) {
+        return -1;
+    }
+
+    device->fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if(device->fd < 0) {
+        free(device);
+        return -1;
+    }
+    device->config = *config;
+    device->event_fd = -1;
+    pthread_mutex_init(&device->lock, NULL);
+    pthread_mutex_init(&device->search_lock, NULL);
+    pthread_cond_init(&device->cond, NULL);
+
+    pthread_mutex_lock(&devices_lock);
+    for(i = 0; i < MAX_EMULATED_DEVICES; i++) {
+        if(devices[i] == NULL) {
+            devices[i] = device;
+            slot = i;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&devices_lock);
+
+    if(slot < 0 || pthread_create(&device->worker, NULL, worker_main, device) != 0) {
+        if(slot >= 0) {
+            pthread_mutex_lock(&devices_lock);
+            devices[slot] = NULL;
+            pthread_mutex_unlock(&devices_lock);
+        }
+        close(device->fd);
+        free(device);
+        return -1;
+    }
+
+    return device->fd;
+}
+
+/*
+    Stops the worker thread of an emulated device and frees it.
+
+    Paramaters:
+        fd  -> File descriptor returned by emulator_open.
+    Return:
+        0 on success and a negative value if fd is not an emulated device.
+*/
+int emulator_close(int fd) {
+    struct emulated_device *device = NULL;
+    int i;
+
+    pthread_mutex_lock(&devices_lock);
+    for(i = 0; i < MAX_EMULATED_DEVICES; i++) {
+        if(devices[i] != NULL && devices[i]->fd == fd) {
+            device = devices[i];
+            devices[i] = NULL;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&devices_lock);
+
+    if(device == NULL) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&device->lock);
+    device->stop = 1;
+    pthread_cond_broadcast(&device->cond);
+    pthread_mutex_unlock(&device->lock);
+    pthread_join(device->worker, NULL);
+
+    close(device->fd);
+    pthread_cond_destroy(&device->cond);
+    pthread_mutex_destroy(&device->search_lock);
+    pthread_mutex_destroy(&device->lock);
+    free(device);
+
+    return 0;
+}
+
+/*
+    Reports whether a file descriptor belongs to an emulated device.
+
+    Paramaters:
+        fd  -> File descriptor to check.
+    Return:
+        1 if it is emulated and 0 otherwise.
+*/
+int emulator_is_emulated(int fd) {
+    return lookup(fd) != NULL;
+}
+
+/*
+    Reads registers of an emulated device.
+
+    Paramaters:
+        fd      -> Emulated device.
+        offset  -> Register offset to start reading from.
+        buffer  -> Where to store the register values.
+        count   -> Number of bytes to read.
+    Return:
+        The number of bytes read, which is cut short at the end of the
+        register window, or a negative value on failure.
+*/
+int emulator_read(int fd, int offset, void *buffer, size_t count) {
+    struct emulated_device *device = lookup(fd);
+
+    if(device == NULL || offset < 0) {
+        return -1;
+    }
+    if(offset >= REGISTER_WINDOW_SIZE) {
+        return 0;
+    }
+    if(count > (size_t) (REGISTER_WINDOW_SIZE - offset)) {
+        count = REGISTER_WINDOW_SIZE - offset;
+    }
+
+    pthread_mutex_lock(&device->lock);
+    memcpy(buffer, (uint8_t*) device->registers + offset, count);
+    pthread_mutex_unlock(&device->lock);
+
+    return count;
+}
+
+/*
+    Writes registers of an emulated device. Writing 1 to START_FLAG starts
+    a search from the value in START_NUMBER. As with the card, a burst that
+    covers both registers is applied from the highest register down.
+
+    Paramaters:
+        fd      -> Emulated device.
+        offset  -> Register offset to start writing to.
+        buffer  -> Register values to write.
+        count   -> Number of bytes to write.
+    Return:
+        The number of bytes written, or a negative value on failure.
+*/
+int emulator_write(int fd, int offset, const void *buffer, size_t count) {
+    struct emulated_device *device = lookup(fd);
+    uint32_t words[REGISTER_COUNT] = { 0 };
+    int first, last, i;
+
+    //Only whole registers can be written
+    if(device == NULL || offset < 0 || offset % 4 != 0) {
+        return -1;
+    }
+    if(offset >= REGISTER_WINDOW_SIZE) {
+        return 0;
+    }
+    if(count > (size_t) (REGISTER_WINDOW_SIZE - offset)) {
+        count = REGISTER_WINDOW_SIZE - offset;
+    }
+    memcpy(words, buffer, count);
+
+    first = offset / 4;
+    last = first + (count + 3) / 4 - 1;
+
+    pthread_mutex_lock(&device->lock);
+    for(i = last; i >= first; i--) {
+        //Only the user writable registers can be changed
+        if(i == START_NUMBER / 4) {
+            device->registers[i] = words[i - first];
+        }
+        else if(i == START_FLAG / 4) {
+            device->registers[i] = words[i - first];
+            if(words[i - first] == 1) {
+                //Drain the handle so poll() reports the new search as busy
+                uint64_t drained;
+                if(read(device->fd, &drained, sizeof(drained)) < 0) {}
+
+                device->registers[DONE_FLAG / 4] = 0;
+                device->generation++;
+                pthread_cond_broadcast(&device->cond);
+            }
+        }
+    }
+    pthread_mutex_unlock(&device->lock);
+
+    return count;
+}
+
+/*
+    Waits for the running search of an emulated device to finish.
+
+    Paramaters:
+        fd          -> Emulated device.
+        timeout_ms  -> Longest time to wait in milliseconds, or -1 to wait
+                       forever.
+    Return:
+        1 if the search has finished, 0 on timeout and a negative value on
+        failure.
+*/
+int emulator_wait_done(int fd, int timeout_ms) {
+    struct emulated_device *device = lookup(fd);
+    struct timespec deadline;
+    int status = 0;
+
+    if(device == NULL) {
+        return -1;
+    }
+
+    if(timeout_ms >= 0) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += timeout_ms / 1000;
+        deadline.tv_nsec += (long) (timeout_ms % 1000) * 1000000;
+        if(deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+    }
+
+    pthread_mutex_lock(&device->lock);
+    while(device->registers[DONE_FLAG / 4] != 1 && status == 0) {
+        if(timeout_ms < 0) {
+            status = pthread_cond_wait(&device->cond, &device->lock);
+        }
+        else {
+            status = pthread_cond_timedwait(&device->cond, &device->lock, &deadline);
+        }
+    }
+    status = (device->registers[DONE_FLAG / 4] == 1) ? 1 : (status == ETIMEDOUT ? 0 : -1);
+    pthread_mutex_unlock(&device->lock);
+
+    return status;
+}
+
+/*
+    Runs a search to completion. Concurrent callers take turns, as they
+    do with the driver's blocking ioctl.
+
+    Paramaters:
+        fd              -> Emulated device.
+        start_val       -> Value to start the prime search from.
+        search_result   -> Where to store the result.
+    Return:
+        0 on success and a negative value on failure.
+*/
+int emulator_find_prime(int fd, uint32_t start_val, uint32_t *search_result) {
+    struct emulated_device *device = lookup(fd);
+    uint32_t registers[2] = {1, start_val};
+    int status = -1;
+
+    if(device == NULL) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&device->search_lock);
+    if(emulator_write(fd, START_FLAG, registers, sizeof(registers)) == sizeof(registers) &&
+       emulator_wait_done(fd, -1) == 1 &&
+       emulator_read(fd, PRIME_NUMBER, search_result, sizeof(uint32_t)) == sizeof(uint32_t)) {
+        status = 0;
+    }
+    pthread_mutex_unlock(&device->search_lock);
+
+    return status;
+}
+
+/*
+    Registers an eventfd that is signaled every time a search finishes.
+
+    Paramaters:
+        fd          -> Emulated device.
+        event_fd    -> Eventfd to signal, or -1 to unregister it.
+    Return:
+        0 on success and a negative value on failure.
+*/
+int emulator_set_eventfd(int fd, int event_fd) {
+    struct emulated_device *device = lookup(fd);
+
+    if(device == NULL) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&device->lock);
+    device->event_fd = event_fd;
+    pthread_mutex_unlock(&device->lock);
+
+    return 0;
+}
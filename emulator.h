@@ -0,0 +1,129 @@
+#ifndef EMULATOR_H
+#define EMULATOR_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+//Software stand-in for the prime finder card. It implements the register
+//map from device_specific.h in memory and runs each search on a CPU worker
+//thread. The prime.c low-level API sends every access on an emulated file
+//descriptor here, so the rest of the library works unchanged.
+
+//Settings of an emulated device
+struct emulator_config {
+    //Extra time added to every search in nanoseconds, to mimic the time
+    //the card takes
+    uint64_t latency_ns;
+    //Clock frequency used to turn search time into the value of the cycle
+    //count registers
+    uint64_t clock_hz;
+};
+
+/*
+    Fills in the default settings. The PRIME_FINDER_EMULATE_LATENCY_NS and
+    PRIME_FINDER_EMULATE_CLOCK_HZ environment variables override them.
+
+    Paramaters:
+        config  -> Settings to fill in.
+*/
+void emulator_default_config(struct emulator_config *config);
+
+/*
+    Creates an emulated device and starts its worker thread.
+
+    Paramaters:
+        config  -> Settings of the device.
+    Return:
+        A file descriptor that stands for the device, or a negative value
+        on failure. Like the device file it is readable for poll() once
+        the running search has finished.
+*/
+int emulator_open(const struct emulator_config *config);
+
+/*
+    Stops the worker thread of an emulated device and frees it.
+
+    Paramaters:
+        fd  -> File descriptor returned by emulator_open.
+    Return:
+        0 on success and a negative value if fd is not an emulated device.
+*/
+int emulator_close(int fd);
+
+/*
+    Reports whether a file descriptor belongs to an emulated device.
+
+    Paramaters:
+        fd  -> File descriptor to check.
+    Return:
+        1 if it is emulated and 0 otherwise.
+*/
+int emulator_is_emulated(int fd);
+
+/*
+    Reads registers of an emulated device.
+
+    Paramaters:
+        fd      -> Emulated device.
+        offset  -> Register offset to start reading from.
+        buffer  -> Where to store the register values.
+        count   -> Number of bytes to read.
+    Return:
+        The number of bytes read, which is cut short at the end of the
+        register window, or a negative value on failure.
+*/
+int emulator_read(int fd, int offset, void *buffer, size_t count);
+
+/*
+    Writes registers of an emulated device. Writing 1 to START_FLAG starts
+    a search from the value in START_NUMBER. As with the card, a burst that
+    covers both registers is applied from the highest register down.
+
+    Paramaters:
+        fd      -> Emulated device.
+        offset  -> Register offset to start writing to.
+        buffer  -> Register values to write.
+        count   -> Number of bytes to write.
+    Return:
+        The number of bytes written, or a negative value on failure.
+*/
+int emulator_write(int fd, int offset, const void *buffer, size_t count);
+
+/*
+    Waits for the running search of an emulated device to finish.
+
+    Paramaters:
+        fd          -> Emulated device.
+        timeout_ms  -> Longest time to wait in milliseconds, or -1 to wait
+                       forever.
+    Return:
+        1 if the search has finished, 0 on timeout and a negative value on
+        failure.
+*/
+int emulator_wait_done(int fd, int timeout_ms);
+
+/*
+    Runs a search to completion. Concurrent callers take turns, as they
+    do with the driver's blocking ioctl.
+
+    Paramaters:
+        fd              -> Emulated device.
+        start_val       -> Value to start the prime search from.
+        search_result   -> Where to store the result.
+    Return:
+        0 on success and a negative value on failure.
+*/
+int emulator_find_prime(int fd, uint32_t start_val, uint32_t *search_result);
+
+/*
+    Registers an eventfd that is signaled every time a search finishes.
+
+    Paramaters:
+        fd          -> Emulated device.
+        event_fd    -> Eventfd to signal, or -1 to unregister it.
+    Return:
+        0 on success and a negative value on failure.
+*/
+int emulator_set_eventfd(int fd, int event_fd);
+
+#endif
@@ -1,27 +1,36 @@
 #include "file_ops.h"
 #include "device_specific.h"
 #include "pcie_ctrl.h"
+#include "ring.h"
+#include "queue.h"
+#include "prime_finder_trace.h"
 
 #include <linux/uaccess.h>
-#include <linux/slab.h>
 #include <linux/types.h>
+#include <linux/kernel.h>
+#include <linux/uio.h>
+#include <linux/io.h>
+#include <linux/slab.h>
+#include <linux/eventfd.h>
+#include <linux/version.h>
+#include <linux/capability.h>
 
 
 const struct file_operations file_ops = {
     .owner = THIS_MODULE,
     .read = read,
     .write = write,
+    .read_iter = read_iter,
+    .write_iter = write_iter,
     .llseek = llseek,
     .open = open,
     .release = release,
     .mmap = mmap,
+    .poll = poll,
     .unlocked_ioctl = ioctl,
 };
 
 
-DECLARE_COMPLETION(ioctl_completion);
-
-
 //This scruct is defined here since it should not be used outside
 //of this file. This structure is mirrored in prime.c but uses
 //the stdint.h integer definitions (uint32_t).
@@ -30,40 +39,592 @@ struct ioctl_struct {
     u32 search_result;
 };
 
+//Argument of the batch search command. The two pointer fields hold
+//userspace addresses of u32 arrays that are count entries long. They are
+//stored as u64 so the layout is the same for 32 and 64 bit processes.
+//completed is written back so the caller knows how many results are
+//valid if the batch was interrupted. Mirrored in prime.c.
+struct ioctl_batch_struct {
+    u64 start_vals;
+    u64 search_results;
+    u32 count;
+    u32 completed;
+};
+
+//State of an open device file, stored in filp->private_data.
+struct file_state {
+    //Card the file was opened on. NULL for the aggregate node.
+    struct prime_device *device;
+    //Rings mapped through the file. NULL until they are first mapped.
+    struct ring_shared *ring;
+    //Eventfd signaled on every interrupt of the card and the entry that
+    //links the file into the card's event_files list while it is set.
+    struct eventfd_ctx *eventfd;
+    struct list_head event_node;
+    //Place of the file in the round robin of each card's request queue,
+    //indexed by minor number. Only the file's own card is used unless it
+    //belongs to the aggregate node.
+    struct queue_client clients[MAX_DEVICES];
+};
+
+//Argument of IOCTL_FIND_PRIME_WAIT. The same as ioctl_struct with the
+//WAIT_MODE_* value to wait with and the longest time in ms to wait for
+//the result, 0 for the search_timeout_ms module parameter. Mirrored in
+//prime.c.
+struct ioctl_wait_struct {
+    u32 start_val;
+    u32 search_result;
+    u32 wait_mode;
+    u32 timeout_ms;
+};
+
+//Argument of IOCTL_FIND_PRIMES_RANGE. Every prime in [low, high) is
+//stored in the u32 array at the userspace address results until capacity
+//of them have been found. count, next and cycles are written back, also
+//when the search was interrupted. next is where the range continues and
+//high once it is finished. Mirrored in prime.c.
+struct ioctl_range_struct {
+    u64 results;
+    u64 high;
+    u64 next;
+    u64 cycles;
+    u32 low;
+    u32 capacity;
+    u32 count;
+    u32 reserved;
+};
+
+//Argument of IOCTL_READ_STATUS. A snapshot of the DONE_FLAG,
+//PRIME_NUMBER, CYCLE_COUNT_HIGH and CYCLE_COUNT_LOW registers of the
+//file's card. Mirrored in prime.c.
+struct ioctl_status_struct {
+    u32 done_flag;
+    u32 search_result;
+    u64 cycles;
+};
+
+//Number of values moved between user and kernel space at a time
+//during a batch search.
+#define BATCH_CHUNK_SIZE 64
+
+//Number of primes a range search collects on the card before they are
+//copied to userspace. Other files get a turn on the card between chunks.
+#define RANGE_CHUNK_SIZE 256
+
+
+/*
+    Returns the card a file was opened on.
+
+    Paramaters:
+        filp    -> Pointer to the devices file sturcture.
+
+    Return:
+        The card, or NULL if the file belongs to the aggregate node or the
+        card has been removed.
+*/
+static struct prime_device *file_device(struct file *filp) {
+    struct file_state *state = filp->private_data;
+
+    if(state->device == NULL || READ_ONCE(state->device->removed)) {
+        return NULL;
+    }
+
+    return state->device;
+}
+
+
+/*
+    Returns the state an open file keeps for one card.
+
+    Paramaters:
+        filp    -> Pointer to the devices file sturcture.
+        device  -> Card the file submits to.
+
+    Return:
+        The file's queue client for the card.
+*/
+static struct queue_client *file_client(struct file *filp, struct prime_device *device) {
+    struct file_state *state = filp->private_data;
+
+    return &state->clients[device->minor];
+}
+
+/*
+    Picks the card with the fewest searches waiting or running on it.
+
+    Paramaters:
+        device_list     -> Cards to choose from.
+        device_count    -> Number of cards in device_list. Must not be zero.
+
+    Return:
+        The least loaded card.
+*/
+static struct prime_device *least_loaded_device(struct prime_device **device_list, int device_count) {
+    struct prime_device *best = device_list[0];
+    int i;
+
+    for(i = 1; i < device_count; i++) {
+        if(queue_depth(device_list[i]) < queue_depth(best)) {
+            best = device_list[i];
+        }
+    }
+
+    return best;
+}
+
+/*
+    Takes a reference to every card that searches issued through a file
+    may run on. That is the file's own card, or every card for the
+    aggregate node.
+
+    Paramaters:
+        filp            -> Pointer to the devices file sturcture.
+        device_list     -> Array with room for MAX_DEVICES entries that is
+                           filled with the cards.
+
+    Return:
+        The number of cards stored in device_list, 0 if there is none. Each
+        one must be released with prime_device_put.
+*/
+static int get_search_devices(struct file *filp, struct prime_device **device_list) {
+    struct file_state *state = filp->private_data;
+
+    if(state->device == NULL) {
+        return prime_device_get_all(device_list);
+    }
+
+    //Pinned the same way as prime_device_get, since prime_device_put drops
+    //the backend module too
+    if(!try_module_get(state->device->ops->owner)) {
+        return 0;
+    }
+    kref_get(&state->device->ref);
+    device_list[0] = state->device;
+    return 1;
+}
+
+/*
+    Drops the references taken by get_search_devices.
+
+    Paramaters:
+        device_list     -> Cards to release.
+        device_count    -> Number of cards in device_list.
+*/
+static void put_search_devices(struct prime_device **device_list, int device_count) {
+    int i;
+
+    for(i = 0; i < device_count; i++) {
+        prime_device_put(device_list[i]);
+    }
+}
+
+/*
+    Counts a copy to or from userspace that failed against the file's card,
+    or against the driver for the aggregate node.
+
+    Paramaters:
+        filp    -> Pointer to the devices file sturcture.
+*/
+static void count_copy_failure(struct file *filp) {
+    struct file_state *state = filp->private_data;
+    struct prime_stats __percpu *stats = state->device != NULL ? state->device->stats : driver_stats;
+
+    this_cpu_inc(stats->copy_failures);
+}
+
+
+/*
+    Runs a single blocking search on the file's card, or on the least
+    loaded card for the aggregate node.
+
+    Paramaters:
+        filp            -> Pointer to the devices file sturcture.
+        start_value     -> Value to start the prime search from.
+        search_result   -> Pointer to where the result should be stored.
+        mode            -> How to wait for the search. One of the
+                           WAIT_MODE_* values.
+        timeout_ms      -> Longest time to wait for the result, or 0 for
+                           the search_timeout_ms module parameter.
+
+    Return:
+        0 on success and a negative value on failure.
+*/
+static int run_single_search(struct file *filp, u32 start_value, u32 *search_result, unsigned int mode,
+                             unsigned int timeout_ms) {
+    struct prime_device *device_list[MAX_DEVICES];
+    struct prime_device *device;
+    struct search_request request;
+    int device_count;
+    int status;
+
+    device_count = get_search_devices(filp, device_list);
+    if(device_count == 0) {
+        return -ENODEV;
+    }
+
+    device = least_loaded_device(device_list, device_count);
+    status = queue_submit(device, file_client(filp, device), &request, start_value, mode, timeout_ms,
+                          (filp->f_flags & O_NONBLOCK) != 0);
+    if(status == 0) {
+        status = queue_wait(&request);
+        *search_result = request.search_result;
+    }
+
+    put_search_devices(device_list, device_count);
+
+    return status;
+}
+
+/*
+    Runs every search of a batch on the cards. The start values are pulled
+    from userspace a chunk at a time. All searches of a chunk are queued
+    before the first one is waited on, so the card is started on the next
+    search straight from the interrupt handler. With more than one card
+    each search goes to the least loaded one. The chunk's results are
+    written back before the next chunk is fetched.
+
+    Paramaters:
+        filp            -> Pointer to the devices file sturcture.
+        device_list     -> Cards the searches may run on.
+        device_count    -> Number of cards in device_list. Must not be zero.
+        user_space_ptr  -> Userspace pointer to an ioctl_batch_struct.
+
+    Return:
+        0 on success and a negative value on failure.
+*/
+static long int run_batch_search(struct file *filp, struct prime_device **device_list, int device_count,
+                                 struct ioctl_batch_struct __user *user_space_ptr) {
+    struct ioctl_batch_struct batch;
+    u32 __user *start_vals;
+    u32 __user *search_results;
+    u32 buffer[BATCH_CHUNK_SIZE];
+    struct search_request *requests;
+    struct prime_device *device;
+    bool nonblock = (filp->f_flags & O_NONBLOCK) != 0;
+    u32 chunk_size;
+    u32 submitted;
+    u32 finished;
+    u32 i;
+    int result;
+    int status = 0;
+
+    if(copy_from_user(&batch, user_space_ptr, sizeof(struct ioctl_batch_struct)) != 0) {
+        count_copy_failure(filp);
+        return -2;
+    }
+
+    start_vals = u64_to_user_ptr(batch.start_vals);
+    search_results = u64_to_user_ptr(batch.search_results);
+
+    if(!access_ok(start_vals, (size_t) batch.count * sizeof(u32)) ||
+       !access_ok(search_results, (size_t) batch.count * sizeof(u32))) {
+        return -1;
+    }
+
+    //Too large for the stack. Allocated once per batch.
+    requests = kmalloc_array(BATCH_CHUNK_SIZE, sizeof(struct search_request), GFP_KERNEL);
+    if(requests == NULL) {
+        return -ENOMEM;
+    }
+
+    batch.completed = 0;
+    while(batch.completed < batch.count && status == 0) {
+        chunk_size = min_t(u32, batch.count - batch.completed, BATCH_CHUNK_SIZE);
+
+        if(copy_from_user(buffer, start_vals + batch.completed, chunk_size * sizeof(u32)) != 0) {
+            count_copy_failure(filp);
+            status = -2;
+            break;
+        }
+
+        for(submitted = 0; submitted < chunk_size; submitted++) {
+            device = least_loaded_device(device_list, device_count);
+            status = queue_submit(device, file_client(filp, device), &requests[submitted],
+                                  buffer[submitted], WAIT_MODE_DEFAULT, 0, nonblock);
+            if(status != 0) {
+                break;
+            }
+        }
+
+        //Every queued request has to be waited on, even once one of them
+        //has failed. Each result overwrites its start value in the chunk
+        //buffer.
+        finished = 0;
+        for(i = 0; i < submitted; i++) {
+            result = queue_wait(&requests[i]);
+            if(result == 0 && finished == i) {
+                buffer[i] = requests[i].search_result;
+                finished++;
+            }
+            else if(status == 0) {
+                status = result;
+            }
+        }
+
+        if(copy_to_user(search_results + batch.completed, buffer, finished * sizeof(u32)) != 0) {
+            count_copy_failure(filp);
+            status = -2;
+            break;
+        }
+        batch.completed += finished;
+    }
+
+    kfree(requests);
+
+    //Always report progress so that an interrupted batch can be resumed
+    if(put_user(batch.completed, &user_space_ptr->completed) != 0) {
+        count_copy_failure(filp);
+        return -2;
+    }
+
+    return status;
+}
+
+
+/*
+    Runs a range search on the file's card, or on the least loaded card for
+    the aggregate node. Each chunk is a single queued request that the
+    interrupt handler keeps restarting from the previous result, so the
+    card never waits on the caller within a chunk.
+
+    Paramaters:
+        filp            -> Pointer to the devices file sturcture.
+        device_list     -> Cards the search may run on.
+        device_count    -> Number of cards in device_list. Must not be zero.
+        user_space_ptr  -> Userspace pointer to an ioctl_range_struct.
+
+    Return:
+        0 on success and a negative value on failure.
+*/
+static long int run_range_search(struct file *filp, struct prime_device **device_list, int device_count,
+                                 struct ioctl_range_struct __user *user_space_ptr) {
+    struct ioctl_range_struct range;
+    struct search_request request;
+    struct prime_device *device;
+    u32 __user *results;
+    u32 *buffer;
+    u32 chunk_size;
+    int status = 0;
+
+    if(copy_from_user(&range, user_space_ptr, sizeof(struct ioctl_range_struct)) != 0) {
+        count_copy_failure(filp);
+        return -2;
+    }
+
+    results = u64_to_user_ptr(range.results);
+    if(range.high > (1ull << 32) || !access_ok(results, (size_t) range.capacity * sizeof(u32))) {
+        return -1;
+    }
+
+    buffer = kmalloc_array(RANGE_CHUNK_SIZE, sizeof(u32), GFP_KERNEL);
+    if(buffer == NULL) {
+        return -ENOMEM;
+    }
+
+    //The searches of a range depend on each other so it stays on one card
+    device = least_loaded_device(device_list, device_count);
+
+    range.next = range.low;
+    range.count = 0;
+    range.cycles = 0;
+    while(range.next < range.high && range.count < range.capacity) {
+        chunk_size = min_t(u32, range.capacity - range.count, RANGE_CHUNK_SIZE);
+
+        status = queue_submit_range(device, file_client(filp, device), &request, (u32) range.next,
+                                    range.high, buffer, chunk_size, (filp->f_flags & O_NONBLOCK) != 0);
+        if(status != 0) {
+            break;
+        }
+
+        //The primes found before a failure are still handed back
+        status = queue_wait(&request);
+
+        if(copy_to_user(results + range.count, buffer, request.range_count * sizeof(u32)) != 0) {
+            count_copy_failure(filp);
+            status = -2;
+            break;
+        }
+        range.count += request.range_count;
+        range.cycles += request.range_cycles;
+        range.next = request.range_next;
+
+        if(status != 0) {
+            break;
+        }
+    }
+
+    kfree(buffer);
+
+    //Always report progress so that an interrupted range can be resumed
+    if(copy_to_user(user_space_ptr, &range, sizeof(struct ioctl_range_struct)) != 0) {
+        count_copy_failure(filp);
+        return -2;
+    }
+
+    return status;
+}
+
+
+/*
+    Registers the eventfd that the card's interrupt handler signals for this
+    file, replacing any that was registered before.
+
+    Paramaters:
+        filp    -> Pointer to the devices file sturcture.
+        fd      -> Eventfd file descriptor, or a negative value to only
+                   unregister the current one.
+
+    Return:
+        0 on success and a negative value on failure.
+*/
+static long int set_eventfd(struct file *filp, int fd) {
+    struct file_state *state = filp->private_data;
+    struct prime_device *device = state->device;
+    struct eventfd_ctx *new_ctx = NULL;
+    struct eventfd_ctx *old_ctx;
+    unsigned long flags;
+
+    if(device == NULL) {
+        return -1;
+    }
+
+    if(fd >= 0) {
+        new_ctx = eventfd_ctx_fdget(fd);
+        if(IS_ERR(new_ctx)) {
+            return PTR_ERR(new_ctx);
+        }
+    }
+
+    spin_lock_irqsave(&device->event_lock, flags);
+    old_ctx = state->eventfd;
+    if(old_ctx != NULL) {
+        list_del(&state->event_node);
+    }
+    state->eventfd = new_ctx;
+    if(new_ctx != NULL) {
+        list_add_tail(&state->event_node, &device->event_files);
+    }
+    spin_unlock_irqrestore(&device->event_lock, flags);
+
+    if(old_ctx != NULL) {
+        eventfd_ctx_put(old_ctx);
+    }
+
+    return 0;
+}
+
+/*
+    Wakes every poller of a card and signals every eventfd registered on
+    it. Called after each pass that completed searches, from the
+    interrupt thread or the poller.
+
+    Paramaters:
+        device  -> Card whose searches finished.
+*/
+void notify_search_done(struct prime_device *device) {
+    struct file_state *state;
+    unsigned long flags;
+
+    wake_up_interruptible_all(&device->poll_wait);
+
+    spin_lock_irqsave(&device->event_lock, flags);
+    list_for_each_entry(state, &device->event_files, event_node) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0)
+        eventfd_signal(state->eventfd);
+#else
+        eventfd_signal(state->eventfd, 1);
+#endif
+    }
+    spin_unlock_irqrestore(&device->event_lock, flags);
+}
+
+
+/*
+    Cancels every search the file has waiting or running, on its own card
+    or on every card for the aggregate node. The callers waiting on them
+    get -ECANCELED.
+
+    Paramaters:
+        filp    -> Pointer to the devices file sturcture.
+
+    Return:
+        The number of searches cancelled.
+*/
+static long int cancel_searches(struct file *filp) {
+    struct prime_device *device_list[MAX_DEVICES];
+    int device_count;
+    long int cancelled = 0;
+    int i;
+
+    device_count = get_search_devices(filp, device_list);
+    for(i = 0; i < device_count; i++) {
+        cancelled += queue_cancel(device_list[i], file_client(filp, device_list[i]));
+    }
+    put_search_devices(device_list, device_count);
+
+    return cancelled;
+}
+
 
 /*
     Function for non-standard I/O and control functions. In this driver
     it is used to activate a blocking prime search where the function
-    will wait for the FPGA to finish its search before returning.
+    will wait for the FPGA to finish its search before returning. On the
+    aggregate node the searches go to the least loaded card.
 
     Paramater:
         filp    -> Pointer to the devices file sturcture.
-        cmd     -> Command ID. Currently the only valid command ID is 0.
+        cmd     -> Command ID. IOCTL_FIND_PRIME runs a single search and
+                   IOCTL_FIND_PRIMES_BATCH runs a batch of searches.
+                   IOCTL_RING_ENTER starts the file's submission ring.
+                   IOCTL_SET_EVENTFD registers an eventfd.
+                   IOCTL_FIND_PRIME_WAIT runs a single search with a
+                   chosen wait mode. IOCTL_FIND_PRIMES_RANGE finds every
+                   prime in a range. IOCTL_READ_STATUS reads the status
+                   registers of the file's card. IOCTL_CANCEL cancels
+                   every search of the file. IOCTL_RESET resets the
+                   file's card in place.
         arg     -> Argument value. What this value represents can change
                    based on use case but in this driver it is a pointer to
-                   an ioctl_struct in userspace.
+                   an ioctl_struct, ioctl_batch_struct, ioctl_wait_struct,
+                   ioctl_range_struct or ioctl_status_struct in userspace. For
+                   IOCTL_SET_EVENTFD it is the eventfd file descriptor, or
+                   -1 to unregister it. IOCTL_CANCEL and IOCTL_RESET take
+                   no argument.
 
     Return:
-        Returns 0 on success and a negative value on failure.
+        Returns 0 on success and a negative value on failure. Searches
+        fail with -ETIMEDOUT once their deadline passes and -ECANCELED
+        when they are cancelled. IOCTL_CANCEL returns the number of
+        searches cancelled.
 */
 long int ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
+    struct file_state *state = filp->private_data;
+    struct prime_device *device_list[MAX_DEVICES];
+    int device_count;
     
     //Case 0 variables
-    u32 start_value;
-    int completion_status;
+    int status;
     struct ioctl_struct kernel_space_struct;
     unsigned long not_copied_count;
     struct ioctl_struct __user *user_space_ptr;
+
+    //Case 4 variables
+    struct ioctl_wait_struct wait_struct;
+
+    //Case 6 and 8 variables
+    struct prime_device *device;
+    struct ioctl_status_struct status_struct;
+    unsigned long flags;
     
-    //Pring logging data
-    printk(KERN_INFO "IOCTL: %d\n", cmd);
-    printk(KERN_INFO "IOCTL ARG: %lu\n", arg);
+    //Only logged when enabled through dynamic debug
+    pr_debug("IOCTL: %d ARG: %lu\n", cmd, arg);
 
 
     switch(cmd) {
         
         //0 -> blocking prime search operation
-        case 0:
+        case IOCTL_FIND_PRIME:
 
             //The arg is a pointer to a userspace structure containing
             //the start value for the search and an additionaly field for
@@ -72,44 +633,157 @@ long int ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
 
             //Check that the userspace pointer is valid
             if(!access_ok(user_space_ptr, sizeof(struct ioctl_struct))) {
-                printk(KERN_INFO "Ioctl struct error\n");
+                pr_debug("Ioctl struct error\n");
                 return -1;
             }
             
             //Copy the userspace struct to kernel space
-            //not_copied_count = copy_from_user(&kernel_space_struct, user_space_ptr, sizeof(struct ioctl_struct));
             not_copied_count = copy_from_user(&kernel_space_struct, user_space_ptr, sizeof(struct ioctl_struct));
 
             //Make sure all of the data could be copied
             if(not_copied_count != 0) {
-                printk(KERN_INFO "Failed to copy ioctl struct from user space\n");
+                pr_debug("Failed to copy ioctl struct from user space\n");
+                count_copy_failure(filp);
                 return -2;
             }
 
-            start_value = (u32) kernel_space_struct.start_val;
-            //Write the start value
-            iowrite32(start_value, bar0_ptr + START_NUMBER);
-            //Set the start bit
-            iowrite32(1, bar0_ptr + START_FLAG);
-
-            //Wait for the interrupt to fire which tells us the task is complete
-            if( wait_for_completion_interruptible(&ioctl_completion) != 0 ) {
-                return -3;
+            status = run_single_search(filp, kernel_space_struct.start_val, &kernel_space_struct.search_result,
+                                       WAIT_MODE_DEFAULT, 0);
+            if(status != 0) {
+                return status;
             }
 
-            //Read back the value and return the result
-            kernel_space_struct.search_result = ioread32(bar0_ptr + PRIME_NUMBER);
-
             //Copy the structure back to user space
             not_copied_count = copy_to_user(user_space_ptr, &kernel_space_struct, sizeof(struct ioctl_struct));
 
             if(not_copied_count != 0) {
-                printk(KERN_INFO "Failed to copy ioctl struct from user space\n");
+                pr_debug("Failed to copy ioctl struct from user space\n");
+                count_copy_failure(filp);
+                return -2;
+            }
+
+            return 0;
+
+        //1 -> blocking batch of prime searches
+        case IOCTL_FIND_PRIMES_BATCH:
+
+            //Check that the userspace pointer is valid
+            if(!access_ok((void __user *) arg, sizeof(struct ioctl_batch_struct))) {
+                pr_debug("Ioctl batch struct error\n");
+                return -1;
+            }
+
+            device_count = get_search_devices(filp, device_list);
+            if(device_count == 0) {
+                return -ENODEV;
+            }
+
+            status = run_batch_search(filp, device_list, device_count, (struct ioctl_batch_struct __user *) arg);
+            put_search_devices(device_list, device_count);
+            return status;
+
+        //2 -> start working through the submission ring
+        case IOCTL_RING_ENTER:
+            //Rings are only supported on the node of a single card
+            if(state->device == NULL) {
+                return -1;
+            }
+            return ring_enter(state->device, READ_ONCE(state->ring));
+
+        //3 -> signal an eventfd whenever the card raises its interrupt
+        case IOCTL_SET_EVENTFD:
+            return set_eventfd(filp, (int) arg);
+
+        //4 -> blocking prime search with a chosen wait mode
+        case IOCTL_FIND_PRIME_WAIT:
+
+            if(copy_from_user(&wait_struct, (void __user *) arg, sizeof(struct ioctl_wait_struct)) != 0) {
+                pr_debug("Failed to copy ioctl wait struct from user space\n");
+                count_copy_failure(filp);
+                return -2;
+            }
+
+            if(wait_struct.wait_mode > WAIT_MODE_HYBRID) {
+                return -1;
+            }
+
+            status = run_single_search(filp, wait_struct.start_val, &wait_struct.search_result,
+                                       wait_struct.wait_mode, wait_struct.timeout_ms);
+            if(status != 0) {
+                return status;
+            }
+
+            if(copy_to_user((void __user *) arg, &wait_struct, sizeof(struct ioctl_wait_struct)) != 0) {
+                pr_debug("Failed to copy ioctl wait struct to user space\n");
+                count_copy_failure(filp);
                 return -2;
             }
 
             return 0;
 
+        //5 -> every prime in a range
+        case IOCTL_FIND_PRIMES_RANGE:
+
+            if(!access_ok((void __user *) arg, sizeof(struct ioctl_range_struct))) {
+                pr_debug("Ioctl range struct error\n");
+                return -1;
+            }
+
+            device_count = get_search_devices(filp, device_list);
+            if(device_count == 0) {
+                return -ENODEV;
+            }
+
+            status = run_range_search(filp, device_list, device_count, (struct ioctl_range_struct __user *) arg);
+            put_search_devices(device_list, device_count);
+            return status;
+
+        //6 -> snapshot of the status registers
+        case IOCTL_READ_STATUS:
+            //The aggregate node has no single card to read
+            device = file_device(filp);
+            if(device == NULL) {
+                return -ENODEV;
+            }
+
+            //The done flag is read first. Once it is set the result and
+            //cycle count do not change until the next search starts, so a
+            //set flag always comes with the matching result and cycles.
+            //The driver retires and starts queued and ring searches under
+            //dispatch_lock, so holding it keeps the next search from
+            //starting between the reads.
+            spin_lock_irqsave(&device->dispatch_lock, flags);
+            status_struct.done_flag = prime_read_register(device, DONE_FLAG);
+            status_struct.search_result = prime_read_register(device, PRIME_NUMBER);
+            status_struct.cycles = prime_read_cycles(device);
+            spin_unlock_irqrestore(&device->dispatch_lock, flags);
+
+            if(copy_to_user((void __user *) arg, &status_struct, sizeof(struct ioctl_status_struct)) != 0) {
+                pr_debug("Failed to copy ioctl status struct to user space\n");
+                count_copy_failure(filp);
+                return -2;
+            }
+
+            return 0;
+
+        //7 -> cancel the file's searches
+        case IOCTL_CANCEL:
+            return cancel_searches(filp);
+
+        //8 -> reset the card without removing it
+        case IOCTL_RESET:
+            //Every file on the card sees its searches held up
+            if(!capable(CAP_SYS_ADMIN)) {
+                return -EPERM;
+            }
+
+            device = file_device(filp);
+            if(device == NULL) {
+                return -ENODEV;
+            }
+
+            return prime_device_reset(device);
+
         default:
             return -1;
 
@@ -118,7 +792,9 @@ long int ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
 
 
 /*
-    Allows the userspace program to map BAR0 into its address space
+    Allows the userspace program to map BAR0 into its address space. Mapping
+    at a page offset of RING_MMAP_PAGE_OFFSET maps the file's submission and
+    completion rings instead.
 
     Paramaters:
         filep   -> Pointer to the devices file sturcture.
@@ -130,31 +806,86 @@ long int ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
         0 on success and a negative value otherwise.
 */
 int mmap(struct file *filep, struct vm_area_struct *vma) {
-    int status;
+    struct file_state *state = filep->private_data;
+    struct prime_device *device = file_device(filep);
 
-    //Convert the page offset to an address offset
-    unsigned long off = vma->vm_pgoff << PAGE_SHIFT;
-    
-    //The VM_RESERVED flag has been replaced by VM_DONTEXPAND and VM_DONTDUMP in newer kernel versions
-    vma->vm_flags = VM_IO | VM_DONTEXPAND | VM_DONTDUMP;
+    //The aggregate node has no registers or rings of its own
+    if(device == NULL) {
+        return -ENODEV;
+    }
 
-    //Make sure that the memory region is not cached
-    vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
+    //The reserved offset maps the submission and completion rings instead of BAR0
+    if(vma->vm_pgoff == RING_MMAP_PAGE_OFFSET) {
+        return ring_mmap(&state->ring, vma);
+    }
 
-    //Actually perform the mapping. NOTE that the offset paramater is in terms of pages which is why the >>PAGE_SHIFT is needed
-    //inorder to get back to pages from an address.
-    status = io_remap_pfn_range(vma, vma->vm_start, (bar0_start+off)>>PAGE_SHIFT, vma->vm_end - vma->vm_start, vma->vm_page_prot);
+    //Not every backend has registers that can be mapped
+    if(device->ops->mmap_registers == NULL) {
+        return -ENODEV;
+    }
 
-    //Log the operation
-    printk("MMAP STATUS: %d\n", status);
-    printk("MMAP START ADDRESS: %lu\n", vma->vm_start);
-    return status;
+    return device->ops->mmap_registers(device->backend_data, vma);
+}
+
+
+/*
+    Works out how many bytes of a transfer fall inside the register window.
+
+    Paramaters:
+        offset  -> Offset within BAR0 that the transfer starts at.
+        count   -> Requested transfer size in bytes.
+    Return:
+        The number of bytes that can be transferred, zero once the offset
+        is past the end of the register window.
+*/
+static size_t window_transfer_size(loff_t offset, size_t count) {
+    if(offset < 0 || offset >= REGISTER_WINDOW_SIZE) {
+        return 0;
+    }
+
+    return min_t(size_t, count, REGISTER_WINDOW_SIZE - offset);
+}
+
+/*
+    Copies registers out of the card through its backend.
+
+    Paramaters:
+        device  -> Card to read from.
+        offset  -> Offset within BAR0 to start reading from.
+        buffer  -> Kernel buffer to read into.
+        count   -> Number of bytes to read.
+*/
+static void bar0_read_window(struct prime_device *device, loff_t offset, void *buffer, size_t count) {
+    device->ops->read_window(device->backend_data, offset, buffer, count);
 }
 
+/*
+    Copies registers into BAR0 as a burst of 32bit writes. The registers are
+    written from the highest offset down so that a burst covering both
+    START_NUMBER and START_FLAG only arms the search once the start value is
+    in place. A trailing partial word is zero extended.
+
+    Paramaters:
+        device  -> Card to write to.
+        offset  -> Offset within BAR0 to start writing to.
+        buffer  -> Kernel buffer to write from.
+        count   -> Number of bytes to write.
+*/
+static void bar0_write_window(struct prime_device *device, loff_t offset, const void *buffer, size_t count) {
+    u32 words[REGISTER_WINDOW_SIZE / sizeof(u32)] = { 0 };
+    int i;
+
+    memcpy(words, buffer, count);
+
+    for(i = DIV_ROUND_UP(count, sizeof(u32)) - 1; i >= 0; i--) {
+        prime_write_register(device, offset + i * sizeof(u32), words[i]);
+    }
+}
 
 /*
-    Performs a blocking read from the device's BAR0. NOTE: For simplicity this function
-    only reads a single 32bit value regardless of how large the provided buffer is.
+    Performs a blocking read from the device's BAR0. Reads as many registers
+    as fit in the buffer, stopping at the end of the register window. The
+    offset is taken from offp so pread() works without a prior lseek().
 
     Paramaters:
         filep   -> Pointer to the devices file sturcture.
@@ -167,34 +898,50 @@ int mmap(struct file *filep, struct vm_area_struct *vma) {
         Returns the number of bytes read during the operation.
 */
 ssize_t read(struct file *filp, char __user *buff, size_t count, loff_t *offp) {
-    //The way that this works is that the offset is not "remembered" between function calls
-    unsigned int val;
+    struct prime_device *device = file_device(filp);
+    u8 buffer[REGISTER_WINDOW_SIZE];
     unsigned long not_copied_count;
 
+    if(device == NULL) {
+        return -ENODEV;
+    }
+
     //Check that the user space buffer is OK to be used
     if(!access_ok(buff, count)) {
-        printk(KERN_INFO "Read buffer error\n");
+        pr_debug("Read buffer error\n");
         return -1;
     }
 
-    //Log the operation in the kernel log
-    printk(KERN_INFO "READ\n");
-    printk(KERN_INFO "READ OFFSET: %lld", *offp);
+    count = window_transfer_size(*offp, count);
+    if(count == 0) {
+        return 0;
+    }
+
+    //Trace the operation. Nothing is logged unless the tracepoint or
+    //dynamic debug is enabled.
+    trace_prime_read(*offp, count);
+    pr_debug("READ OFFSET: %lld COUNT: %zu\n", *offp, count);
+
+    //Read in the registers starting at the provided offset from the BAR0 start.
+    bar0_read_window(device, *offp, buffer, count);
 
-    //Read in the value at the provided offset from the BAR0 start.
-    val = ioread32(bar0_ptr + *offp);
+    not_copied_count = copy_to_user(buff, buffer, count);
+    if(not_copied_count != 0) {
+        count_copy_failure(filp);
+    }
 
     //Move the offset by the amount read. This is stored between
     //operations.
-    *offp += count;
+    *offp += count - not_copied_count;
 
-    not_copied_count = copy_to_user(buff, &val, sizeof(unsigned int));
     return (count - not_copied_count);
 }
 
 /*
-    Function to write data to the PCIe device's BAR0. NOTE: For simplicity this function
-    only writes a single 32bit value regardless of how large the provided buffer is.
+    Function to write data to the PCIe device's BAR0. Writes as many registers
+    as the buffer holds, stopping at the end of the register window, as one
+    burst. The offset is taken from offp so pwrite() works without a prior
+    lseek().
     Paramaters:
         filep   -> Pointer to the devices file sturcture.
         buff    -> User space buffer from user space. Cannont be directly accessed
@@ -206,42 +953,139 @@ ssize_t read(struct file *filp, char __user *buff, size_t count, loff_t *offp) {
         Returns the number of bytes written during the operation.
 */
 ssize_t write(struct file *filp, const char __user *buff, size_t count, loff_t *offp) {
-
+    struct prime_device *device = file_device(filp);
+    u8 buffer[REGISTER_WINDOW_SIZE];
     unsigned long not_copied_count;
-    u32 *kernel_ptr;
+
+    if(device == NULL) {
+        return -ENODEV;
+    }
 
     //Check that the userspace buffer is valid
     if(!access_ok(buff, count)) {
-        printk(KERN_INFO "Write buffer error\n");
+        pr_debug("Write buffer error\n");
         return -1;
     }
-    
-    //Copy the userspace buffer to a kernel space buffer. This is needed
-    //inorder to use the iowrite32 function which needs a kernal space
-    //address.
-    kernel_ptr = (u32*) kmalloc(count * sizeof(char), GFP_KERNEL);
-    not_copied_count = copy_from_user(kernel_ptr, buff, count);
 
-    //Log the operation in the kernel log
-    printk(KERN_INFO "WRITE\n");
-    printk(KERN_INFO "WRITE OFFSET: %lld", *offp);
+    count = window_transfer_size(*offp, count);
+    if(count == 0) {
+        return 0;
+    }
+
+    //Stage the data in a buffer on the stack. It never has to hold more
+    //than the register window so no allocation is needed.
+    not_copied_count = copy_from_user(buffer, buff, count);
+    if(not_copied_count != 0) {
+        count_copy_failure(filp);
+    }
+    count -= not_copied_count;
+    if(count == 0) {
+        return -EFAULT;
+    }
 
-    //Read in the value at the provided offset from the BAR0 start.
-    iowrite32(kernel_ptr[0], bar0_ptr + *offp);
+    //Trace the operation. Nothing is logged unless the tracepoint or
+    //dynamic debug is enabled.
+    trace_prime_write(*offp, count);
+    pr_debug("WRITE OFFSET: %lld COUNT: %zu\n", *offp, count);
 
-    //Free the internal buffer
-    kfree(kernel_ptr);
+    //Write the registers starting at the provided offset from the BAR0 start.
+    bar0_write_window(device, *offp, buffer, count);
 
-    //Move the offset by the amount read. This is stored between
+    //Move the offset by the amount written. This is stored between
     //operations.
     *offp += count;
 
-    return (count - not_copied_count);
+    return count;
+}
+
+/*
+    Vectored read from the device's BAR0 used by readv() and preadv(). The
+    register window starting at the file position is read in one pass and
+    scattered across the provided buffers, so DONE_FLAG through
+    CYCLE_COUNT_LOW can be fetched with a single system call.
+
+    Paramaters:
+        iocb    -> Describes the file and the position to read from.
+        to      -> Userspace buffers to fill.
+    Return:
+        Returns the number of bytes read during the operation.
+*/
+ssize_t read_iter(struct kiocb *iocb, struct iov_iter *to) {
+    struct prime_device *device = file_device(iocb->ki_filp);
+    u8 buffer[REGISTER_WINDOW_SIZE];
+    size_t count;
+    size_t copied;
+
+    if(device == NULL) {
+        return -ENODEV;
+    }
+
+    count = window_transfer_size(iocb->ki_pos, iov_iter_count(to));
+    if(count == 0) {
+        return 0;
+    }
+
+    trace_prime_read(iocb->ki_pos, count);
+    bar0_read_window(device, iocb->ki_pos, buffer, count);
+
+    copied = copy_to_iter(buffer, count, to);
+    if(copied != count) {
+        count_copy_failure(iocb->ki_filp);
+    }
+    if(copied == 0) {
+        return -EFAULT;
+    }
+    iocb->ki_pos += copied;
+
+    return copied;
+}
+
+/*
+    Vectored write to the device's BAR0 used by writev() and pwritev(). The
+    provided buffers are gathered and written to the register window starting
+    at the file position.
+
+    Paramaters:
+        iocb    -> Describes the file and the position to write to.
+        from    -> Userspace buffers holding the register values.
+    Return:
+        Returns the number of bytes written during the operation.
+*/
+ssize_t write_iter(struct kiocb *iocb, struct iov_iter *from) {
+    struct prime_device *device = file_device(iocb->ki_filp);
+    u8 buffer[REGISTER_WINDOW_SIZE];
+    size_t count;
+    size_t copied;
+
+    if(device == NULL) {
+        return -ENODEV;
+    }
+
+    count = window_transfer_size(iocb->ki_pos, iov_iter_count(from));
+    if(count == 0) {
+        return 0;
+    }
+
+    copied = copy_from_iter(buffer, count, from);
+    if(copied != count) {
+        count_copy_failure(iocb->ki_filp);
+    }
+    if(copied == 0) {
+        return -EFAULT;
+    }
+
+    trace_prime_write(iocb->ki_pos, copied);
+    bar0_write_window(device, iocb->ki_pos, buffer, copied);
+    iocb->ki_pos += copied;
+
+    return copied;
 }
 
 
 /*
     Function to let user space programs open the driver's device file.
+    The file holds a reference to the card behind its minor number, or to
+    no card for the aggregate node.
     Paramaters:
         inode   -> Pointer to the devices inode sturcture
         filep   -> Pointer to the devices file sturcture
@@ -251,9 +1095,28 @@ ssize_t write(struct file *filp, const char __user *buff, size_t count, loff_t *
         0 on success negative value on failure.
 */
 int open (struct inode *inode, struct file *filp) {
-    //Nothing to be done here. Just log that the file was
-    //opened and return.
-    printk(KERN_INFO "File Opened\n");
+    struct file_state *state;
+    unsigned int minor = iminor(inode);
+    int i;
+
+    state = kzalloc(sizeof(struct file_state), GFP_KERNEL);
+    if(state == NULL) {
+        return -ENOMEM;
+    }
+    for(i = 0; i < MAX_DEVICES; i++) {
+        queue_client_init(&state->clients[i]);
+    }
+
+    if(minor != AGGREGATE_MINOR) {
+        state->device = prime_device_get(minor);
+        if(state->device == NULL) {
+            kfree(state);
+            return -ENODEV;
+        }
+    }
+
+    filp->private_data = state;
+    pr_debug("File Opened\n");
 
     return 0;
 }
@@ -269,13 +1132,65 @@ int open (struct inode *inode, struct file *filp) {
         0 on success negative value on failure.
 */
 int release(struct inode *inode, struct file *filp) {
-    //Nothing to be done here. Just log that the file was
-    //closed and return.
-    printk(KERN_INFO "File Closed\n");
+    struct file_state *state = filp->private_data;
+
+    if(state->device != NULL) {
+        //Stop signaling the file's eventfd
+        set_eventfd(filp, -1);
+        //Free the file's rings if it mapped any
+        ring_release(state->device, state->ring);
+        prime_device_put(state->device);
+    }
+    kfree(state);
+
+    pr_debug("File Closed\n");
 
     return 0;
 }
 
+/*
+    Reports which events are ready on the device file for poll(), select()
+    and epoll. The caller is woken by the card's interrupt. A file with
+    rings is readable while its completion ring holds entries, any other
+    file is readable once DONE_FLAG is set.
+
+    Paramaters:
+        filp    -> Pointer to the devices file sturcture.
+        wait    -> Poll table the card's wait queue is added to.
+    Return:
+        The ready poll events.
+*/
+__poll_t poll(struct file *filp, struct poll_table_struct *wait) {
+    struct file_state *state = filp->private_data;
+    struct prime_device *device = state->device;
+    struct ring_shared *ring;
+
+    //The aggregate node has nothing to wait on
+    if(device == NULL) {
+        return EPOLLERR;
+    }
+
+    poll_wait(filp, &device->poll_wait, wait);
+
+    if(READ_ONCE(device->removed)) {
+        return EPOLLERR | EPOLLHUP;
+    }
+    if(READ_ONCE(device->dead)) {
+        return EPOLLERR;
+    }
+
+    ring = READ_ONCE(state->ring);
+    if(ring != NULL) {
+        return ring_poll(ring);
+    }
+
+    //The registers can always be written
+    if(prime_read_register(device, DONE_FLAG) == 1) {
+        return EPOLLIN | EPOLLRDNORM | EPOLLOUT | EPOLLWRNORM;
+    }
+    return EPOLLOUT | EPOLLWRNORM;
+}
+
 /*
     Allows to set the offset that will be written to or read from.
     Paramaters:
@@ -300,9 +1215,8 @@ loff_t llseek(struct file *filp, loff_t offset, int whence) {
         filp->f_pos += offset;
     }
 
-    //Log the operation.
-    printk(KERN_INFO "SEEK\n");
-    printk(KERN_INFO "SEEK OFFSET: %lld\n", filp->f_pos);
+    //Log the operation when enabled through dynamic debug.
+    pr_debug("SEEK OFFSET: %lld\n", filp->f_pos);
 
     return filp->f_pos;
 }
@@ -3,9 +3,14 @@
 
 #include <linux/fs.h>
 #include <linux/completion.h>
+#include <linux/poll.h>
+
+struct prime_device;
 
 /*
-    Allows the userspace program to map BAR0 into its address space
+    Allows the userspace program to map BAR0 into its address space. Mapping
+    at a page offset of RING_MMAP_PAGE_OFFSET maps the file's submission and
+    completion rings instead.
 
     Paramaters:
         filep   -> Pointer to the devices file sturcture.
@@ -19,8 +24,9 @@
 int mmap(struct file *filep, struct vm_area_struct *vma);
 
 /*
-    Performs a blocking read from the device's BAR0. NOTE: For simplicity this function
-    only reads a single 32bit value regardless of how large the provided buffer is.
+    Performs a blocking read from the device's BAR0. Reads as many registers
+    as fit in the buffer, stopping at the end of the register window. The
+    offset is taken from offp so pread() works without a prior lseek().
 
     Paramaters:
         filep   -> Pointer to the devices file sturcture.
@@ -35,8 +41,10 @@ int mmap(struct file *filep, struct vm_area_struct *vma);
 ssize_t read(struct file *filp, char __user *buff, size_t count, loff_t *offp);
 
 /*
-    Function to write data to the PCIe device's BAR0. NOTE: For simplicity this function
-    only writes a single 32bit value regardless of how large the provided buffer is.
+    Function to write data to the PCIe device's BAR0. Writes as many registers
+    as the buffer holds, stopping at the end of the register window, as one
+    burst. The offset is taken from offp so pwrite() works without a prior
+    lseek().
     Paramaters:
         filep   -> Pointer to the devices file sturcture.
         buff    -> User space buffer from user space. Cannont be directly accessed
@@ -49,8 +57,34 @@ ssize_t read(struct file *filp, char __user *buff, size_t count, loff_t *offp);
 */
 ssize_t write(struct file *filp, const char __user *buff, size_t count, loff_t *offp);
 
+/*
+    Vectored read from the device's BAR0 used by readv() and preadv(). The
+    register window starting at the file position is read in one pass and
+    scattered across the provided buffers.
+
+    Paramaters:
+        iocb    -> Describes the file and the position to read from.
+        to      -> Userspace buffers to fill.
+    Return:
+        Returns the number of bytes read during the operation.
+*/
+ssize_t read_iter(struct kiocb *iocb, struct iov_iter *to);
+
+/*
+    Vectored write to the device's BAR0 used by writev() and pwritev().
+
+    Paramaters:
+        iocb    -> Describes the file and the position to write to.
+        from    -> Userspace buffers holding the register values.
+    Return:
+        Returns the number of bytes written during the operation.
+*/
+ssize_t write_iter(struct kiocb *iocb, struct iov_iter *from);
+
 /*
     Function to let user space programs open the driver's device file.
+    The file holds a reference to the card behind its minor number, or to
+    no card for the aggregate node.
     Paramaters:
         inode   -> Pointer to the devices inode sturcture
         filep   -> Pointer to the devices file sturcture
@@ -73,6 +107,20 @@ int open (struct inode *inode, struct file *filp);
 */
 int release(struct inode *inode, struct file *filp);
 
+/*
+    Reports which events are ready on the device file for poll(), select()
+    and epoll. The caller is woken by the card's interrupt. A file with
+    rings is readable while its completion ring holds entries, any other
+    file is readable once DONE_FLAG is set.
+
+    Paramaters:
+        filp    -> Pointer to the devices file sturcture.
+        wait    -> Poll table the card's wait queue is added to.
+    Return:
+        The ready poll events.
+*/
+__poll_t poll(struct file *filp, struct poll_table_struct *wait);
+
 /*
     Allows to set the offset that will be written to or read from.
     Paramaters:
@@ -91,23 +139,40 @@ loff_t llseek(struct file *filp, loff_t offset, int whence);
 /*
     Function for non-standard I/O and control functions. In this driver
     it is used to activate a blocking prime search where the function
-    will wait for the FPGA to finish its search before returning.
+    will wait for the FPGA to finish its search before returning. On the
+    aggregate node the searches go to the least loaded card.
 
     Paramater:
         filp    -> Pointer to the devices file sturcture.
-        cmd     -> Command ID. Currently the only valid command ID is 0.
+        cmd     -> Command ID. IOCTL_FIND_PRIME runs a single search and
+                   IOCTL_FIND_PRIMES_BATCH runs a batch of searches.
+                   IOCTL_RING_ENTER starts the file's submission ring.
+                   IOCTL_SET_EVENTFD registers an eventfd.
+                   IOCTL_FIND_PRIME_WAIT runs a single search with a
+                   chosen wait mode.
         arg     -> Argument value. What this value represents can change
                    based on use case but in this driver it is a pointer to
-                   an ioctl_struct in userspace.
+                   an ioctl_struct, ioctl_batch_struct or ioctl_wait_struct
+                   in userspace. For
+                   IOCTL_SET_EVENTFD it is the eventfd file descriptor, or
+                   -1 to unregister it.
 
     Return:
         Returns 0 on success and a negative value on failure.
 */
 long int ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
 
+/*
+    Wakes every poller of a card and signals every eventfd registered on
+    it. Called after each pass that completed searches, from the
+    interrupt thread or the poller.
+
+    Paramaters:
+        device  -> Card whose searches finished.
+*/
+void notify_search_done(struct prime_device *device);
+
 //This structure holds all of the file operations that the the driver supports
 extern const struct file_operations file_ops;
 
-extern struct completion ioctl_completion;
-
 #endif
\ No newline at end of file
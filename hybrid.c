@@ -0,0 +1,471 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "prime.h"
+#include "cpu_sieve.h"
+#include "hybrid.h"
+#include "timing.h"
+
+//Clock of the card's cycle count registers. The emulator and the mock
+//card default to the same clock.
+#define DEVICE_CLOCK_HZ 125000000ull
+
+//Time each chunk should take once the speed of its engine is known
+#define TARGET_CHUNK_NS 20000000ull
+//Size of the first chunk of each engine, before its speed is known
+#define INITIAL_CHUNK_NUMBERS (1ull << 16)
+//Bounds of the chunk size. The upper bound keeps the buffer of a chunk
+//small.
+#define MIN_CHUNK_NUMBERS (1ull << 12)
+#define MAX_CHUNK_NUMBERS (1ull << 24)
+
+//Weight of the newest chunk in the speed estimates
+#define RATE_WEIGHT 0.25
+
+enum hybrid_engine {
+    ENGINE_DEVICE,
+    ENGINE_CPU
+};
+
+//Part of the range searched by one engine
+struct hybrid_chunk {
+    //Position of the chunk in the range, chunks are written in this order
+    uint64_t sequence;
+    uint64_t low;
+    uint64_t high;
+    uint32_t *primes;
+    uint32_t capacity;
+    uint32_t count;
+    //Next chunk waiting to be written
+    struct hybrid_chunk *next;
+};
+
+//State shared by the engines of one hybrid range search
+struct hybrid_search {
+    //Protects everything below
+    pthread_mutex_t lock;
+
+    int fd;
+    int out_fd;
+    //Start of the part of the range no engine has taken yet
+    uint64_t cursor;
+    uint64_t high;
+    uint64_t next_sequence;
+    //Sequence of the next chunk to write
+    uint64_t write_sequence;
+    //Chunks that are done but wait for an earlier chunk to be written
+    struct hybrid_chunk *finished;
+    //Set when the device stopped taking chunks
+    int device_stopped;
+    int failed;
+
+    //Numbers per ns each engine managed, 0 until its first chunk is done
+    double device_rate;
+    double cpu_rate;
+    //Device time per number according to the cycle count registers and the
+    //time per chunk the cycle count does not cover, such as the system call
+    //and the interrupt
+    double device_cycle_ns;
+    double device_overhead_ns;
+
+    struct hybrid_stats stats;
+};
+
+
+//Moves a speed estimate towards a new measurement
+static double update_rate(double rate, double sample) {
+    return rate == 0 ? sample : rate + (sample - rate) * RATE_WEIGHT;
+}
+
+/*
+    Picks the size of the next chunk of an engine. Must be called with the
+    search lock held.
+
+    Paramaters:
+        search  -> The range search.
+        engine  -> Engine the chunk is for.
+    Return:
+        Number of values in the chunk.
+*/
+static uint64_t chunk_size(struct hybrid_search *search, enum hybrid_engine engine) {
+    uint64_t remaining = search->high - search->cursor;
+    double own_rate, other_rate;
+    double size;
+
+    if(engine == ENGINE_DEVICE) {
+        own_rate = search->device_rate;
+        other_rate = search->cpu_rate;
+
+        //The cycle count tells how long the card itself takes per number.
+        //The rest of the chunk time is the same for every chunk.
+        if(search->device_cycle_ns > 0) {
+            size = (TARGET_CHUNK_NS - search->device_overhead_ns) / search->device_cycle_ns;
+        }
+        else if(own_rate > 0) {
+            size = own_rate * TARGET_CHUNK_NS;
+        }
+        else {
+            size = INITIAL_CHUNK_NUMBERS;
+        }
+    }
+    else {
+        own_rate = search->cpu_rate;
+        other_rate = search->device_stopped ? 0 : search->device_rate;
+        size = own_rate > 0 ? own_rate * TARGET_CHUNK_NS : INITIAL_CHUNK_NUMBERS;
+    }
+
+    //Towards the end of the range each engine takes no more than its share
+    //of what is left, so neither is left searching alone
+    if(own_rate > 0 && other_rate > 0 && size > remaining * own_rate / (own_rate + other_rate)) {
+        size = remaining * own_rate / (own_rate + other_rate);
+    }
+
+    if(size < MIN_CHUNK_NUMBERS) size = MIN_CHUNK_NUMBERS;
+    if(size > MAX_CHUNK_NUMBERS) size = MAX_CHUNK_NUMBERS;
+    if(size > remaining) size = remaining;
+
+    return (uint64_t) size;
+}
+
+/*
+    Takes the next chunk of the range for an engine.
+
+    Paramaters:
+        search  -> The range search.
+        engine  -> Engine that searches the chunk.
+    Return:
+        The chunk, or NULL once the range is used up or the search failed.
+*/
+static struct hybrid_chunk *claim_chunk(struct hybrid_search *search, enum hybrid_engine engine) {
+    struct hybrid_chunk *chunk = NULL;
+    uint64_t size;
+
+    pthread_mutex_lock(&search->lock);
+    if(search->cursor < search->high && !search->failed) {
+        size = chunk_size(search, engine);
+
+        chunk = malloc(sizeof(struct hybrid_chunk));
+        if(chunk != NULL) {
+            //At most 5760 in 30030 numbers are not divisible by a prime up to
+            //13, which bounds the primes of the chunk
+            chunk->capacity = size / 5 + 16;
+            chunk->primes = malloc(sizeof(uint32_t) * chunk->capacity);
+            if(chunk->primes == NULL) {
+                free(chunk);
+                chunk = NULL;
+            }
+        }
+
+        if(chunk == NULL) {
+            search->failed = 1;
+        }
+        else {
+            chunk->sequence = search->next_sequence++;
+            chunk->low = search->cursor;
+            chunk->high = search->cursor + size;
+            chunk->count = 0;
+            chunk->next = NULL;
+            search->cursor += size;
+        }
+    }
+    pthread_mutex_unlock(&search->lock);
+
+    return chunk;
+}
+
+/*
+    Writes the primes of a chunk as decimal text.
+
+    Paramaters:
+        out_fd  -> File descriptor to write to.
+        chunk   -> Chunk to write.
+    Return:
+        0 on success and a negative value on failure.
+*/
+static int write_chunk(int out_fd, const struct hybrid_chunk *chunk) {
+    //Every prime takes at most 11 characters with its newline
+    char *text = malloc((size_t) chunk->count * 11 + 1);
+    size_t length = 0;
+    ssize_t written;
+    uint32_t i;
+
+    if(text == NULL) {
+        return -1;
+    }
+
+    for(i = 0; i < chunk->count; i++) {
+        length += sprintf(text + length, "%u\n", chunk->primes[i]);
+    }
+
+    for(i = 0; length > 0; ) {
+        written = write(out_fd, text + i, length);
+        if(written < 0) {
+            free(text);
+            return -1;
+        }
+        i += written;
+        length -= written;
+    }
+
+    free(text);
+    return 0;
+}
+
+/*
+    Records a finished chunk and writes every chunk that is now next in
+    range order.
+
+    Paramaters:
+        search      -> The range search.
+        chunk       -> The finished chunk.
+        engine      -> Engine that searched it.
+        elapsed_ns  -> Time the chunk took.
+        cycles      -> Device cycles the chunk took.
+*/
+static void finish_chunk(struct hybrid_search *search, struct hybrid_chunk *chunk, enum hybrid_engine engine,
+                         uint64_t elapsed_ns, uint64_t cycles) {
+    uint64_t numbers = chunk->high - chunk->low;
+    double rate = (double) numbers / (elapsed_ns ? elapsed_ns : 1);
+    double cycle_ns;
+    struct hybrid_chunk **link;
+
+    pthread_mutex_lock(&search->lock);
+
+    if(engine == ENGINE_DEVICE) {
+        search->stats.device_numbers += numbers;
+        search->stats.device_primes += chunk->count;
+        search->stats.device_chunks++;
+        search->stats.device_busy_ns += elapsed_ns;
+        search->stats.device_cycles += cycles;
+        search->device_rate = update_rate(search->device_rate, rate);
+
+        if(cycles > 0) {
+            cycle_ns = (double) cycles * 1e9 / DEVICE_CLOCK_HZ;
+            search->device_cycle_ns = update_rate(search->device_cycle_ns, cycle_ns / numbers);
+            search->device_overhead_ns = update_rate(search->device_overhead_ns,
+                                                     elapsed_ns > cycle_ns ? elapsed_ns - cycle_ns : 0);
+        }
+    }
+    else {
+        search->stats.cpu_numbers += numbers;
+        search->stats.cpu_primes += chunk->count;
+        search->stats.cpu_chunks++;
+        search->stats.cpu_busy_ns += elapsed_ns;
+        search->cpu_rate = update_rate(search->cpu_rate, rate);
+    }
+
+    //Keep the finished chunks sorted by sequence
+    link = &search->finished;
+    while(*link != NULL && (*link)->sequence < chunk->sequence) {
+        link = &(*link)->next;
+    }
+    chunk->next = *link;
+    *link = chunk;
+
+    while(search->finished != NULL && search->finished->sequence == search->write_sequence) {
+        chunk = search->finished;
+        search->finished = chunk->next;
+        search->write_sequence++;
+
+        if(!search->failed && write_chunk(search->out_fd, chunk) != 0) {
+            search->failed = 1;
+        }
+        free(chunk->primes);
+        free(chunk);
+    }
+
+    pthread_mutex_unlock(&search->lock);
+}
+
+/*
+    Searches a chunk with the CPU sieve.
+
+    Paramaters:
+        chunk   -> Chunk to search.
+    Return:
+        0 on success and a negative value on failure.
+*/
+static int cpu_search_chunk(struct hybrid_chunk *chunk) {
+    uint32_t found;
+    uint64_t low = chunk->low;
+    int status;
+
+    chunk->count = 0;
+    do {
+        status = cpu_find_primes_in_range(low, chunk->high, chunk->primes + chunk->count,
+                                          chunk->capacity - chunk->count, &found, NULL);
+        if(status < 0) {
+            return -1;
+        }
+        chunk->count += found;
+        if(status == 1) {
+            low = (uint64_t) chunk->primes[chunk->count - 1] + 1;
+        }
+    } while(status == 1);
+
+    return 0;
+}
+
+/*
+    Searches a chunk with the card.
+
+    Paramaters:
+        fd      -> File descriptor of the drivers device file.
+        chunk   -> Chunk to search.
+        cycles  -> Set to the device cycles the chunk took.
+    Return:
+        0 on success and a negative value on failure.
+*/
+static int device_search_chunk(int fd, struct hybrid_chunk *chunk, uint64_t *cycles) {
+    struct range_stats range_stats;
+    uint32_t found;
+    uint64_t low = chunk->low;
+    int status;
+
+    chunk->count = 0;
+    *cycles = 0;
+    do {
+        status = find_primes_in_range(fd, low, chunk->high, chunk->primes + chunk->count,
+                                      chunk->capacity - chunk->count, &found, &range_stats);
+        if(status < 0) {
+            return -1;
+        }
+        chunk->count += found;
+        *cycles += range_stats.cycles;
+        if(status == 1) {
+            low = (uint64_t) chunk->primes[chunk->count - 1] + 1;
+        }
+    } while(status == 1);
+
+    return 0;
+}
+
+/*
+    Thread body of the CPU engine. Takes chunks until the range is used up.
+
+    Paramaters:
+        arg     -> The struct hybrid_search.
+*/
+static void *cpu_engine_main(void *arg) {
+    struct hybrid_search *search = arg;
+    struct hybrid_chunk *chunk;
+    uint64_t start_ns;
+
+    while((chunk = claim_chunk(search, ENGINE_CPU)) != NULL) {
+        start_ns = now_ns();
+        if(cpu_search_chunk(chunk) != 0) {
+            pthread_mutex_lock(&search->lock);
+            search->failed = 1;
+            pthread_mutex_unlock(&search->lock);
+        }
+        finish_chunk(search, chunk, ENGINE_CPU, now_ns() - start_ns, 0);
+    }
+
+    return NULL;
+}
+
+/*
+    Body of the device engine. Takes chunks until the range is used up. If
+    the card fails the chunk is searched on the CPU instead and the card
+    takes no further chunks.
+
+    Paramaters:
+        search  -> The range search.
+*/
+static void device_engine_main(struct hybrid_search *search) {
+    struct hybrid_chunk *chunk;
+    uint64_t start_ns, cycles;
+
+    while((chunk = claim_chunk(search, ENGINE_DEVICE)) != NULL) {
+        start_ns = now_ns();
+        if(device_search_chunk(search->fd, chunk, &cycles) == 0) {
+            finish_chunk(search, chunk, ENGINE_DEVICE, now_ns() - start_ns, cycles);
+            continue;
+        }
+
+        pthread_mutex_lock(&search->lock);
+        search->device_stopped = 1;
+        pthread_mutex_unlock(&search->lock);
+
+        start_ns = now_ns();
+        if(cpu_search_chunk(chunk) != 0) {
+            pthread_mutex_lock(&search->lock);
+            search->failed = 1;
+            pthread_mutex_unlock(&search->lock);
+        }
+        finish_chunk(search, chunk, ENGINE_CPU, now_ns() - start_ns, 0);
+        break;
+    }
+}
+
+/*
+    Finds every prime in [low, high) with the card and the CPU sieve
+    together and writes them to a file descriptor as decimal text, one per
+    line, in order.
+
+    Paramaters:
+        fd              -> File descriptor of the drivers device file, or a
+                           negative value to use the CPU only.
+        low             -> First value of the range.
+        high            -> End of the range, which is not included. At most
+                           2^32.
+        out_fd          -> File descriptor the primes are written to.
+        stats           -> Set to how the range was split. May be NULL.
+    Return:
+        On success zero is returned, on failure a negative
+        value is returned.
+*/
+int hybrid_stream_primes_in_range(int fd, uint32_t low, uint64_t high, int out_fd, struct hybrid_stats *stats) {
+    struct hybrid_search search;
+    struct hybrid_chunk *chunk;
+    pthread_t cpu_thread;
+    uint64_t start_ns = now_ns();
+    int cpu_threaded;
+
+    if(high > (1ull << 32)) {
+        return -1;
+    }
+
+    memset(&search, 0, sizeof(search));
+    pthread_mutex_init(&search.lock, NULL);
+    search.fd = fd;
+    search.out_fd = out_fd;
+    search.cursor = low;
+    search.high = high > low ? high : low;
+    search.device_stopped = fd < 0;
+
+    //The CPU engine gets its own thread and the card is driven from this
+    //one, which mostly sleeps while the card searches
+    cpu_threaded = pthread_create(&cpu_thread, NULL, cpu_engine_main, &search) == 0;
+    if(fd >= 0) {
+        device_engine_main(&search);
+    }
+    if(cpu_threaded) {
+        pthread_join(cpu_thread, NULL);
+    }
+    else {
+        cpu_engine_main(&search);
+    }
+
+    //Chunks left behind by a failure
+    while(search.finished != NULL) {
+        chunk = search.finished;
+        search.finished = chunk->next;
+        free(chunk->primes);
+        free(chunk);
+    }
+    pthread_mutex_destroy(&search.lock);
+
+    if(stats != NULL) {
+        *stats = search.stats;
+        stats->primes = search.stats.device_primes + search.stats.cpu_primes;
+        stats->elapsed_ns = now_ns() - start_ns;
+    }
+
+    return search.failed ? -1 : 0;
+}
@@ -0,0 +1,55 @@
+#ifndef HYBRID_H
+#define HYBRID_H
+
+#include <stdint.h>
+
+//Splits one range search between the card and the CPU sieve. The range is
+//handed out in chunks from its start. Each engine sizes its next chunk from
+//its measured speed, the card from its cycle count registers and the CPU
+//from the time its chunks took, and chunks get smaller towards the end of
+//the range so both engines finish at about the same time. Chunks are
+//written out in range order whichever engine finishes them first.
+
+//How a hybrid range search was split
+struct hybrid_stats {
+    //Number of primes found
+    uint64_t primes;
+    //Wall clock time of the whole range
+    uint64_t elapsed_ns;
+
+    //Numbers of the range each engine searched
+    uint64_t device_numbers;
+    uint64_t cpu_numbers;
+    //Primes each engine found
+    uint64_t device_primes;
+    uint64_t cpu_primes;
+    //Chunks each engine searched
+    uint64_t device_chunks;
+    uint64_t cpu_chunks;
+    //Time each engine spent on its chunks
+    uint64_t device_busy_ns;
+    uint64_t cpu_busy_ns;
+    //Device cycles spent on the searches, 0 when the prime index answered
+    uint64_t device_cycles;
+};
+
+/*
+    Finds every prime in [low, high) with the card and the CPU sieve
+    together and writes them to a file descriptor as decimal text, one per
+    line, in order.
+
+    Paramaters:
+        fd              -> File descriptor of the drivers device file, or a
+                           negative value to use the CPU only.
+        low             -> First value of the range.
+        high            -> End of the range, which is not included. At most
+                           2^32.
+        out_fd          -> File descriptor the primes are written to.
+        stats           -> Set to how the range was split. May be NULL.
+    Return:
+        On success zero is returned, on failure a negative
+        value is returned.
+*/
+int hybrid_stream_primes_in_range(int fd, uint32_t low, uint64_t high, int out_fd, struct hybrid_stats *stats);
+
+#endif
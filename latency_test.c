@@ -0,0 +1,211 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "device_specific.h"
+#include "prime.h"
+#include "timing.h"
+
+//Number of register accesses timed for each access path
+#define DEFAULT_ITERATIONS 100000
+
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t*) a;
+    uint64_t y = *(const uint64_t*) b;
+    return (x > y) - (x < y);
+}
+
+/*
+    Times iterations register reads of DONE_FLAG followed by the same
+    number of writes of START_NUMBER and prints the average and median
+    latency of each.
+
+    Paramaters:
+        fd          -> File descriptor of the device file.
+        label       -> Name of the access path printed with the results.
+        samples     -> Scratch buffer with room for iterations entries.
+        iterations  -> Number of accesses to time.
+    Return:
+        0 on success and a negative value otherwise.
+*/
+static int time_register_access(int fd, const char *label, uint64_t *samples, int iterations) {
+    uint64_t start, total;
+    uint32_t value;
+    int i;
+
+    total = 0;
+    for(i = 0; i < iterations; i++) {
+        start = now_ns();
+        if(read_register(fd, DONE_FLAG, &value) != 0) return -1;
+        samples[i] = now_ns() - start;
+        total += samples[i];
+    }
+    qsort(samples, iterations, sizeof(uint64_t), compare_u64);
+    printf("%-8s read:  avg %8.1f ns  p50 %8lu ns\n", label,
+           (double) total / iterations, samples[iterations / 2]);
+
+    total = 0;
+    for(i = 0; i < iterations; i++) {
+        start = now_ns();
+        if(write_register(fd, START_NUMBER, i) != 0) return -1;
+        samples[i] = now_ns() - start;
+        total += samples[i];
+    }
+    qsort(samples, iterations, sizeof(uint64_t), compare_u64);
+    printf("%-8s write: avg %8.1f ns  p50 %8lu ns\n", label,
+           (double) total / iterations, samples[iterations / 2]);
+
+    return 0;
+}
+
+/*
+    Times the two register writes needed to start a search, first as two
+    separate writes and then as a single burst write. START_FLAG is written
+    as zero so no search is actually started.
+
+    Paramaters:
+        fd          -> File descriptor of the device file.
+        samples     -> Scratch buffer with room for iterations entries.
+        iterations  -> Number of write pairs to time.
+    Return:
+        0 on success and a negative value otherwise.
+*/
+static int time_start_writes(int fd, uint64_t *samples, int iterations) {
+    uint64_t start, total;
+    uint32_t registers[2];
+    int i;
+
+    total = 0;
+    for(i = 0; i < iterations; i++) {
+        start = now_ns();
+        if(write_register(fd, START_NUMBER, i) != 0) return -1;
+        if(write_register(fd, START_FLAG, 0) != 0) return -1;
+        samples[i] = now_ns() - start;
+        total += samples[i];
+    }
+    qsort(samples, iterations, sizeof(uint64_t), compare_u64);
+    printf("%-8s start: avg %8.1f ns  p50 %8lu ns\n", "2 writes",
+           (double) total / iterations, samples[iterations / 2]);
+
+    total = 0;
+    for(i = 0; i < iterations; i++) {
+        registers[0] = 0;
+        registers[1] = i;
+        start = now_ns();
+        if(pwrite(fd, registers, sizeof(registers), START_FLAG) != sizeof(registers)) return -1;
+        samples[i] = now_ns() - start;
+        total += samples[i];
+    }
+    qsort(samples, iterations, sizeof(uint64_t), compare_u64);
+    printf("%-8s start: avg %8.1f ns  p50 %8lu ns\n", "burst",
+           (double) total / iterations, samples[iterations / 2]);
+
+    return 0;
+}
+
+/*
+    Times blocking searches that start right next to a prime, first waiting
+    on the interrupt and then with the hybrid wait, and prints the average
+    and median latency of each.
+
+    Paramaters:
+        fd          -> File descriptor of the device file.
+        samples     -> Scratch buffer with room for iterations entries.
+        iterations  -> Number of searches to time with each wait mode.
+    Return:
+        0 on success and a negative value otherwise.
+*/
+static int time_search_waits(int fd, uint64_t *samples, int iterations) {
+    const uint32_t modes[2] = {WAIT_MODE_INTERRUPT, WAIT_MODE_HYBRID};
+    const char *labels[2] = {"irq", "hybrid"};
+    uint64_t start, total;
+    uint32_t result;
+    int i, m;
+
+    for(m = 0; m < 2; m++) {
+        total = 0;
+        for(i = 0; i < iterations; i++) {
+            start = now_ns();
+            //Odd start values close to 1000 keep the gap to the next prime small
+            if(find_prime_wait(fd, 1000 + (i % 64) * 2 + 1, modes[m], &result) != 0) return -1;
+            samples[i] = now_ns() - start;
+            total += samples[i];
+        }
+        qsort(samples, iterations, sizeof(uint64_t), compare_u64);
+        printf("%-8s search: avg %8.1f ns  p50 %8lu ns\n", labels[m],
+               (double) total / iterations, samples[iterations / 2]);
+    }
+
+    return 0;
+}
+
+
+int main(int argc, char *argv[]) {
+    int iterations = DEFAULT_ITERATIONS;
+    uint64_t *samples;
+
+    //The number of iterations can be given on the command line
+    if(argc >= 2) {
+        iterations = atoi(argv[1]);
+    }
+    if(iterations <= 0) {
+        printf("Invalid iteration count\n");
+        return -1;
+    }
+
+    //Open the device file and check that it was opened correctly
+    int fd = open_device("/dev/prime_finder");
+    if(fd < 0) {
+        printf("Failed to open device file\n");
+        return -1;
+    }
+
+    samples = malloc(iterations * sizeof(uint64_t));
+    if(samples == NULL) {
+        printf("Failed to allocate sample buffer\n");
+        return -1;
+    }
+
+    //System call path first, then the same accesses through the mapping
+    if(time_register_access(fd, "syscall", samples, iterations) != 0) {
+        printf("Register access failed\n");
+        return -1;
+    }
+
+    //Cost of the start sequence through the system call path. Running this
+    //against an older build of the driver gives the before numbers.
+    if(time_start_writes(fd, samples, iterations) != 0) {
+        printf("Register access failed\n");
+        return -1;
+    }
+
+    //The emulator has no BAR0 to map
+    if(map_registers(fd) != 0) {
+        printf("Failed to map BAR0, skipping mmap timing\n");
+    }
+    else {
+        if(time_register_access(fd, "mmap", samples, iterations) != 0) {
+            printf("Register access failed\n");
+            return -1;
+        }
+
+        unmap_registers();
+    }
+    clear_registers(fd);
+
+    //Blocking searches with short gaps, waiting on the interrupt and
+    //with the hybrid spin
+    if(time_search_waits(fd, samples, iterations) != 0) {
+        printf("Search failed\n");
+        return -1;
+    }
+
+    free(samples);
+    close_device(fd);
+
+    return 0;
+}
@@ -0,0 +1,464 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "miller_rabin.h"
+
+//Odd numbers in one window of a search. The average gap between primes
+//near 2^64 is about 44, so one window almost always holds the answer.
+#define WINDOW_ODDS 128
+
+//Windows are sieved by the odd primes below this. Larger primes cross off
+//too few candidates to pay for finding their first multiple.
+#define SIEVE_PRIME_LIMIT 64
+
+//Candidates whose base 2 rounds are run together
+#define INTERLEAVE 4
+
+//Searches a thread takes from a batch at a time
+#define BATCH_BLOCK 64
+//Batches smaller than this stay on the calling thread
+#define BATCH_THREAD_MIN 256
+
+//Bases that make Miller-Rabin exact for every value below 2^64
+static const uint64_t witness_bases[] = {2, 325, 9375, 28178, 450775, 9780504, 1795265022};
+#define WITNESS_COUNT (sizeof(witness_bases) / sizeof(witness_bases[0]))
+
+//Primes a single value is trial divided by before Miller-Rabin
+static const uint32_t trial_primes[] = {3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37, 41, 43, 47, 53};
+#define TRIAL_COUNT (sizeof(trial_primes) / sizeof(trial_primes[0]))
+
+//Odd prime below SIEVE_PRIME_LIMIT with 2^64 / p rounded up, which turns
+//a 32 bit remainder into two multiplications
+struct sieve_prime {
+    uint32_t p;
+    uint64_t reciprocal;
+};
+
+//Run of sieve primes whose product fits in 32 bits. The start of a window
+//is reduced by the product with one 64 bit division and the remainders of
+//the primes are taken from that.
+struct sieve_group {
+    uint32_t product;
+    int end;
+};
+
+static struct sieve_prime sieve_primes[SIEVE_PRIME_LIMIT / 2];
+static int sieve_prime_count;
+static struct sieve_group sieve_groups[SIEVE_PRIME_LIMIT / 2];
+static int sieve_group_count;
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+static unsigned int thread_count = 0;
+
+//Modulus of a Miller-Rabin test in the form Montgomery multiplication uses
+struct montgomery {
+    uint64_t n;
+    //n^-1 mod 2^64
+    uint64_t n_inv;
+    //2^64 mod n, which is 1 in Montgomery form
+    uint64_t one;
+    //n - 1 is d * 2^shift with d odd
+    uint64_t d;
+    int shift;
+};
+
+//A batch shared by the threads searching it
+struct batch_work {
+    const uint64_t *start_vals;
+    uint64_t *search_results;
+    uint32_t count;
+    uint32_t next;
+};
+
+
+/*
+    Fills in the odd primes below SIEVE_PRIME_LIMIT. Run once.
+*/
+static void miller_rabin_init(void) {
+    bool composite[SIEVE_PRIME_LIMIT] = {false};
+    uint64_t product = 1;
+    uint32_t p, multiple;
+
+    for(p = 3; p < SIEVE_PRIME_LIMIT; p += 2) {
+        if(composite[p]) {
+            continue;
+        }
+        for(multiple = p * p; multiple < SIEVE_PRIME_LIMIT; multiple += 2 * p) {
+            composite[multiple] = true;
+        }
+
+        if(product * p > UINT32_MAX) {
+            sieve_groups[sieve_group_count].product = product;
+            sieve_groups[sieve_group_count].end = sieve_prime_count;
+            sieve_group_count++;
+            product = 1;
+        }
+        product *= p;
+
+        sieve_primes[sieve_prime_count].p = p;
+        sieve_primes[sieve_prime_count].reciprocal = UINT64_MAX / p + 1;
+        sieve_prime_count++;
+    }
+
+    sieve_groups[sieve_group_count].product = product;
+    sieve_groups[sieve_group_count].end = sieve_prime_count;
+    sieve_group_count++;
+}
+
+/*
+    Sets up Montgomery multiplication modulo an odd value.
+
+    Paramaters:
+        mont    -> Structure to fill in.
+        n       -> Odd modulus.
+*/
+static void montgomery_init(struct montgomery *mont, uint64_t n) {
+    mont->n = n;
+    mont->n_inv = odd_inverse64(n);
+    //2^64 - n is already below n from 2^63 on, which saves the division
+    mont->one = n >> 63 ? 0 - n : (0 - n) % n;
+    mont->shift = __builtin_ctzll(n - 1);
+    mont->d = (n - 1) >> mont->shift;
+}
+
+/*
+    Multiplies two values in Montgomery form.
+
+    Paramaters:
+        mont    -> Modulus.
+        a       -> First factor, below the modulus.
+        b       -> Second factor, below the modulus.
+    Return:
+        a * b / 2^64 mod n, below the modulus.
+*/
+static inline uint64_t montgomery_mul(const struct montgomery *mont, uint64_t a, uint64_t b) {
+    unsigned __int128 product = (unsigned __int128) a * b;
+    uint64_t low = (uint64_t) product;
+    uint64_t high = (uint64_t) (product >> 64);
+    //m * n has the same low half as the product so the difference is an
+    //exact multiple of 2^64
+    uint64_t m = low * mont->n_inv;
+    uint64_t mn_high = (uint64_t) (((unsigned __int128) m * mont->n) >> 64);
+
+    //Adding n back is done with a mask since the borrow is as good as
+    //random and a branch on it would mispredict half the time
+    return high - mn_high + (mont->n & (0 - (uint64_t) (high < mn_high)));
+}
+
+/*
+    Finishes a round of Miller-Rabin once base^d has been computed.
+
+    Paramaters:
+        mont    -> Modulus, the odd value being tested.
+        x       -> base^d in Montgomery form.
+    Return:
+        true if the value is a strong probable prime to the base.
+*/
+static bool miller_rabin_finish(const struct montgomery *mont, uint64_t x) {
+    uint64_t minus_one = mont->n - mont->one;
+    int shift = mont->shift;
+
+    if(x == mont->one || x == minus_one) {
+        return true;
+    }
+    while(--shift > 0) {
+        x = montgomery_mul(mont, x, x);
+        if(x == minus_one) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/*
+    Runs the base 2 round of Miller-Rabin on up to INTERLEAVE candidates
+    together.
+    Each round is a chain of multiplications that all wait on the one
+    before, so interleaving the chains of independent candidates lets the
+    CPU overlap them. Multiplying by 2 in Montgomery form is a modular
+    doubling, so base 2 needs no multiplications besides the squarings.
+    Squaring 1 gives 1, so candidates with a shorter d simply stay at 1
+    until their own top bit.
+
+    Paramaters:
+        monts   -> Moduli of the candidates.
+        count   -> Number of candidates, at most INTERLEAVE.
+        pass    -> Set to whether each candidate is a strong probable
+                   prime to base 2.
+*/
+static void base2_rounds(const struct montgomery *monts, int count, bool *pass) {
+    uint64_t x[INTERLEAVE];
+    uint64_t doubled, over;
+    int top_bit = 0;
+    int bit, l;
+
+    for(l = 0; l < count; l++) {
+        x[l] = monts[l].one;
+        top_bit = 63 - __builtin_clzll(monts[l].d) > top_bit ? 63 - __builtin_clzll(monts[l].d) : top_bit;
+    }
+
+    for(bit = top_bit; bit >= 0; bit--) {
+        for(l = 0; l < count; l++) {
+            x[l] = montgomery_mul(&monts[l], x[l], x[l]);
+            //Branch free x = 2x mod n, also when 2x carries out of 64 bits
+            doubled = x[l] << 1;
+            over = (x[l] >> 63) | (doubled >= monts[l].n);
+            doubled -= monts[l].n & (0 - over);
+            x[l] = ((monts[l].d >> bit) & 1) ? doubled : x[l];
+        }
+    }
+
+    for(l = 0; l < count; l++) {
+        pass[l] = miller_rabin_finish(&monts[l], x[l]);
+    }
+}
+
+/*
+    Runs Miller-Rabin with the bases of witness_bases after 2. The rounds
+    share d, so they are run together as one square and multiply over its
+    bits and each multiplication overlaps the ones of the other bases.
+
+    Paramaters:
+        mont    -> Modulus, the odd value above 2 being tested. It must
+                   already have passed the base 2 round.
+    Return:
+        true if the value is prime.
+*/
+static bool miller_rabin_rest(const struct montgomery *mont) {
+    uint64_t x[WITNESS_COUNT];
+    uint64_t power[WITNESS_COUNT];
+    uint64_t base;
+    //2^128 mod n, used to convert the bases into Montgomery form. Only the
+    //few candidates that pass base 2 need it, so it is not part of the
+    //struct montgomery.
+    uint64_t r2 = (unsigned __int128) mont->one * mont->one % mont->n;
+    unsigned int i, lanes = 0;
+    int bit;
+
+    for(i = 1; i < WITNESS_COUNT; i++) {
+        base = witness_bases[i] % mont->n;
+        //A base that is a multiple of n says nothing
+        if(base == 0) {
+            continue;
+        }
+        power[lanes] = montgomery_mul(mont, base, r2);
+        x[lanes] = mont->one;
+        lanes++;
+    }
+
+    //Left to right square and multiply over the bits of d
+    for(bit = 63 - __builtin_clzll(mont->d); bit >= 0; bit--) {
+        for(i = 0; i < lanes; i++) {
+            x[i] = montgomery_mul(mont, x[i], x[i]);
+        }
+        if((mont->d >> bit) & 1) {
+            for(i = 0; i < lanes; i++) {
+                x[i] = montgomery_mul(mont, x[i], power[i]);
+            }
+        }
+    }
+
+    for(i = 0; i < lanes; i++) {
+        if(!miller_rabin_finish(mont, x[i])) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*
+    Sets the number of threads batch searches use.
+
+    Paramaters:
+        threads -> Number of threads, or 0 to use one per online CPU.
+*/
+void miller_rabin_set_threads(unsigned int threads) {
+    thread_count = threads;
+}
+
+/*
+    Checks if a value is prime.
+
+    Paramaters:
+        value   -> Value to check.
+    Return:
+        true if the value is prime.
+*/
+bool cpu_is_prime64(uint64_t value) {
+    struct montgomery mont;
+    bool pass;
+    unsigned int i;
+
+    if(value < 2) {
+        return false;
+    }
+    if(value % 2 == 0) {
+        return value == 2;
+    }
+
+    //Trial division rejects most composites for less than one round
+    for(i = 0; i < TRIAL_COUNT; i++) {
+        if(value % trial_primes[i] == 0) {
+            return value == trial_primes[i];
+        }
+    }
+
+    montgomery_init(&mont, value);
+    base2_rounds(&mont, 1, &pass);
+    return pass && miller_rabin_rest(&mont);
+}
+
+/*
+    Finds the first prime at or after a value.
+
+    Paramaters:
+        start_val       -> Value to start the search from.
+        search_result   -> Where to store the prime. Set to 0 when there is
+                           no prime left below 2^64.
+    Return:
+        On success zero is returned, on failure a negative
+        value is returned.
+*/
+int cpu_find_prime64(uint64_t start_val, uint64_t *search_result) {
+    struct montgomery monts[INTERLEAVE];
+    bool pass[INTERLEAVE];
+    bool composite[WINDOW_ODDS];
+    uint64_t base, remaining;
+    uint32_t window, reduced, i, p, r;
+    int count, g, j, l;
+
+    pthread_once(&init_once, miller_rabin_init);
+
+    if(start_val <= 2) {
+        *search_result = 2;
+        return 0;
+    }
+
+    //Candidate i of a window is base + 2 * i
+    base = start_val | 1;
+    for(;;) {
+        //Odd numbers left below 2^64 after base. The last window stops there.
+        remaining = (UINT64_MAX - base) / 2;
+        window = remaining < WINDOW_ODDS ? remaining + 1 : WINDOW_ODDS;
+
+        //Cross off the multiples of the small primes. Candidate i is a
+        //multiple of p when 2 * i = -base mod p, which is half of -base
+        //mod p when that is even and half of it plus p otherwise. p itself
+        //is skipped when it is in the window.
+        memset(composite, 0, sizeof(composite));
+        j = 0;
+        for(g = 0; g < sieve_group_count; g++) {
+            reduced = base % sieve_groups[g].product;
+            for(; j < sieve_groups[g].end; j++) {
+                p = sieve_primes[j].p;
+                r = (uint32_t) (((unsigned __int128) (sieve_primes[j].reciprocal * reduced) * p) >> 64);
+                r = r == 0 ? 0 : p - r;
+                i = (r & 1) ? (r + p) / 2 : r / 2;
+                if(base + 2 * (uint64_t) i == p) {
+                    i += p;
+                }
+                for(; i < window; i += p) {
+                    composite[i] = true;
+                }
+            }
+        }
+
+        //Test what is left in order, INTERLEAVE candidates at a time. Most
+        //composites fail base 2 so only the ones that pass get the rest.
+        i = 0;
+        while(i < window) {
+            for(count = 0; count < INTERLEAVE && i < window; i++) {
+                if(!composite[i]) {
+                    montgomery_init(&monts[count++], base + 2 * (uint64_t) i);
+                }
+            }
+            base2_rounds(monts, count, pass);
+            for(l = 0; l < count; l++) {
+                if(pass[l] && miller_rabin_rest(&monts[l])) {
+                    *search_result = monts[l].n;
+                    return 0;
+                }
+            }
+        }
+
+        if(remaining < WINDOW_ODDS) {
+            *search_result = 0;
+            return 0;
+        }
+        base += 2 * WINDOW_ODDS;
+    }
+}
+
+/*
+    Thread function that takes blocks of searches from a batch until none
+    are left.
+
+    Paramaters:
+        arg -> The struct batch_work of the batch.
+    Return:
+        NULL
+*/
+static void *batch_main(void *arg) {
+    struct batch_work *work = arg;
+    uint32_t first, end, i;
+
+    for(;;) {
+        first = __atomic_fetch_add(&work->next, BATCH_BLOCK, __ATOMIC_RELAXED);
+        if(first >= work->count) {
+            return NULL;
+        }
+        end = work->count - first < BATCH_BLOCK ? work->count : first + BATCH_BLOCK;
+        for(i = first; i < end; i++) {
+            cpu_find_prime64(work->start_vals[i], &work->search_results[i]);
+        }
+    }
+}
+
+/*
+    Finds the first prime at or after each value of a batch.
+
+    Paramaters:
+        start_vals      -> Array of values to start each search from.
+        search_results  -> Array where the result of each search is stored.
+                           Must hold count entries.
+        count           -> Number of searches in the batch.
+    Return:
+        On success zero is returned, on failure a negative
+        value is returned.
+*/
+int cpu_find_primes64_batch(const uint64_t *start_vals, uint64_t *search_results, uint32_t count) {
+    struct batch_work work = {start_vals, search_results, count, 0};
+    pthread_t threads[256];
+    unsigned int workers, started, t;
+
+    pthread_once(&init_once, miller_rabin_init);
+
+    workers = thread_count;
+    if(workers == 0) {
+        workers = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if(workers < 1) workers = 1;
+    if(workers > 256) workers = 256;
+    if(count < BATCH_THREAD_MIN) workers = 1;
+
+    //This thread is one of the workers. If a thread cannot be started the
+    //ones that were take its share.
+    started = 0;
+    for(t = 1; t < workers; t++) {
+        if(pthread_create(&threads[started], NULL, batch_main, &work) == 0) {
+            started++;
+        }
+    }
+    batch_main(&work);
+
+    for(t = 0; t < started; t++) {
+        pthread_join(threads[t], NULL);
+    }
+
+    return 0;
+}
@@ -0,0 +1,82 @@
+#ifndef MILLER_RABIN_H
+#define MILLER_RABIN_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+//CPU engine for searches from values past the device's 32 bit registers.
+//Candidates are first sieved by the odd primes below 1024, which is trial
+//division done for a whole window of candidates at once, and the ones left
+//are tested with deterministic Miller-Rabin. The 7 bases of Sinclair's set
+//are enough for every value below 2^64. The modular arithmetic uses
+//Montgomery multiplication so no test needs a 128 bit division. Batches
+//are split between threads.
+
+/*
+    Finds the inverse of an odd value modulo 2^64, which Montgomery
+    multiplication needs. Its low 32 bits are the inverse modulo 2^32.
+    Newton's iteration doubles the correct low bits of the inverse each
+    step, and n is its own inverse mod 8, so 5 steps reach 96 bits.
+
+    Paramaters:
+        n       -> Odd value.
+    Return:
+        The inverse.
+*/
+static inline uint64_t odd_inverse64(uint64_t n) {
+    uint64_t inv = n;
+    int i;
+
+    for(i = 0; i < 5; i++) {
+        inv *= 2 - n * inv;
+    }
+
+    return inv;
+}
+
+/*
+    Sets the number of threads batch searches use.
+
+    Paramaters:
+        threads -> Number of threads, or 0 to use one per online CPU.
+*/
+void miller_rabin_set_threads(unsigned int threads);
+
+/*
+    Checks if a value is prime.
+
+    Paramaters:
+        value   -> Value to check.
+    Return:
+        true if the value is prime.
+*/
+bool cpu_is_prime64(uint64_t value);
+
+/*
+    Finds the first prime at or after a value.
+
+    Paramaters:
+        start_val       -> Value to start the search from.
+        search_result   -> Where to store the prime. Set to 0 when there is
+                           no prime left below 2^64.
+    Return:
+        On success zero is returned, on failure a negative
+        value is returned.
+*/
+int cpu_find_prime64(uint64_t start_val, uint64_t *search_result);
+
+/*
+    Finds the first prime at or after each value of a batch.
+
+    Paramaters:
+        start_vals      -> Array of values to start each search from.
+        search_results  -> Array where the result of each search is stored.
+                           Must hold count entries.
+        count           -> Number of searches in the batch.
+    Return:
+        On success zero is returned, on failure a negative
+        value is returned.
+*/
+int cpu_find_primes64_batch(const uint64_t *start_vals, uint64_t *search_results, uint32_t count);
+
+#endif
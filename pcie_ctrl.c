@@ -1,27 +1,753 @@
 #include "pcie_ctrl.h"
 #include "file_ops.h"
+#include "ring.h"
+#include "queue.h"
+
+#include <linux/slab.h>
+#include <linux/moduleparam.h>
+#include <linux/workqueue.h>
+#include <linux/ktime.h>
+#include <linux/version.h>
+
+//Instantiate the tracepoints declared in prime_finder_trace.h. This must
+//only be done in one file of the module.
+#define CREATE_TRACE_POINTS
+#include "prime_finder_trace.h"
 
 //Add data about supported devices to the module table so the kernel
 //knows what devices this drives should be paired with.
 MODULE_DEVICE_TABLE(pci, pci_id_array);
 
 
-//Pointer to the start of the BAR0 address space AFTER it has been 
-//mapped into the virtual address space.
-char *bar0_ptr;
-//Data related to bar 0 on the device
-unsigned long bar0_size;
-unsigned long bar0_start;
+//Every card that is currently present, indexed by minor number
+static struct prime_device *devices[MAX_DEVICES];
+//Protects the devices array
+static DEFINE_MUTEX(devices_lock);
+
+//Interrupts closer together than this on average switch the card to
+//polling, like NAPI does for network cards
+static unsigned int poll_enter_ns = 20000;
+module_param(poll_enter_ns, uint, 0644);
+MODULE_PARM_DESC(poll_enter_ns, "Average ns between interrupts below which the card is polled (0 = never poll)");
+
+//Polling stops and the interrupt is unmasked once no search has finished
+//for this long
+static unsigned int poll_idle_ns = 100000;
+module_param(poll_idle_ns, uint, 0644);
+MODULE_PARM_DESC(poll_idle_ns, "Time in ns without a finished search after which polling stops");
+
+//Searches the poller completes before it yields the CPU
+static unsigned int poll_budget = 64;
+module_param(poll_budget, uint, 0644);
+MODULE_PARM_DESC(poll_budget, "Searches completed per polling pass before the poller yields");
+
+//How often the watchdog checks that the running search makes progress. A
+//search that is neither done nor counting cycles for a whole period is
+//taken to have stalled the card.
+static unsigned int watchdog_ms = 1000;
+module_param(watchdog_ms, uint, 0644);
+MODULE_PARM_DESC(watchdog_ms, "Period of the stalled card watchdog in ms (0 = off)");
+
+
+/*
+    Reads a register of a PCI card through BAR0.
+
+    Paramaters:
+        backend_data    -> The card.
+        offset          -> Offset of the register within BAR0.
+    Return:
+        The value of the register.
+*/
+static u32 pci_read_register(void *backend_data, unsigned int offset) {
+    struct prime_device *device = backend_data;
+
+    return ioread32(device->bar0_ptr + offset);
+}
+
+/*
+    Writes a register of a PCI card through BAR0.
+
+    Paramaters:
+        backend_data    -> The card.
+        offset          -> Offset of the register within BAR0.
+        value           -> Value to write.
+*/
+static void pci_write_register(void *backend_data, unsigned int offset, u32 value) {
+    struct prime_device *device = backend_data;
+
+    iowrite32(value, device->bar0_ptr + offset);
+}
+
+/*
+    Copies registers out of BAR0. Single registers are read with one 32bit
+    access, larger transfers move the whole range with memcpy_fromio.
+
+    Paramaters:
+        backend_data    -> The card.
+        offset          -> Offset within BAR0 to start reading from.
+        buffer          -> Kernel buffer to read into.
+        count           -> Number of bytes to read.
+*/
+static void pci_read_window(void *backend_data, unsigned int offset, void *buffer, size_t count) {
+    struct prime_device *device = backend_data;
+    u32 val;
+
+    if(count <= sizeof(u32)) {
+        val = ioread32(device->bar0_ptr + offset);
+        memcpy(buffer, &val, count);
+    }
+    else {
+        memcpy_fromio(buffer, device->bar0_ptr + offset, count);
+    }
+}
+
+/*
+    Maps BAR0 of a PCI card into a process.
+
+    Paramaters:
+        backend_data    -> The card.
+        vma             -> Structure pointer describing the user space
+                           processes viritual address region to map
+                           BAR0 into.
+    Return:
+        0 on success and a negative value otherwise.
+*/
+static int pci_mmap_registers(void *backend_data, struct vm_area_struct *vma) {
+    struct prime_device *device = backend_data;
+    int status;
+
+    //Convert the page offset to an address offset
+    unsigned long off = vma->vm_pgoff << PAGE_SHIFT;
+
+    //The VM_RESERVED flag has been replaced by VM_DONTEXPAND and VM_DONTDUMP in newer kernel versions.
+    //vm_flags can only be changed through vm_flags_set since 6.3.
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+    vm_flags_set(vma, VM_IO | VM_DONTEXPAND | VM_DONTDUMP);
+#else
+    vma->vm_flags = VM_IO | VM_DONTEXPAND | VM_DONTDUMP;
+#endif
+
+    //Make sure that the memory region is not cached
+    vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
+
+    //Actually perform the mapping. NOTE that the offset paramater is in terms of pages which is why the >>PAGE_SHIFT is needed
+    //inorder to get back to pages from an address.
+    status = io_remap_pfn_range(vma, vma->vm_start, (device->bar0_start+off)>>PAGE_SHIFT, vma->vm_end - vma->vm_start, vma->vm_page_prot);
+
+    //Log the operation
+    pr_debug("MMAP STATUS: %d START ADDRESS: %lu\n", status, vma->vm_start);
+    return status;
+}
+
+/*
+    Checks that BAR0 of a PCI card is still where it was mapped after the
+    config space was restored. Open files have BAR0 mapped, so the card
+    can only come back in place if it did not move.
+
+    Paramaters:
+        device  -> The card.
+    Return:
+        0 if BAR0 did not move and -EIO otherwise.
+*/
+static int pci_check_bar0(struct prime_device *device) {
+    if(pci_resource_start(device->pdev, 0) != device->bar0_start) {
+        printk(KERN_WARNING "Card %d: BAR0 moved during the reset\n", device->minor);
+        return -EIO;
+    }
+
+    return 0;
+}
+
+/*
+    Resets a PCI card in place with a function level reset. The config
+    space is saved and restored around it, which restores BAR0 and the MSI
+    setup, and the interrupt is masked until then.
+
+    Paramaters:
+        backend_data    -> The card.
+    Return:
+        0 on success and a negative value otherwise.
+*/
+static int pci_reset(void *backend_data) {
+    struct prime_device *device = backend_data;
+    int status;
+
+    //Also waits for the interrupt thread to finish
+    disable_irq(device->interrupt_number);
+
+    //pci_remove holds the device lock while it waits for the watchdog, so
+    //the reset must not wait for the lock
+    status = pci_try_reset_function(device->pdev);
+    if(status == 0) {
+        status = pci_check_bar0(device);
+    }
+
+    //Re-arm the interrupt now that MSI is set up again
+    enable_irq(device->interrupt_number);
+
+    return status;
+}
+
+/*
+    Unmaps BAR0 once the last reference to a PCI card is dropped. BAR0
+    stays mapped until then so that files which are still open never
+    touch an unmapped address.
+
+    Paramaters:
+        backend_data    -> The card.
+*/
+static void pci_release(void *backend_data) {
+    struct prime_device *device = backend_data;
+
+    if(device->bar0_ptr != NULL) {
+        iounmap(device->bar0_ptr);
+    }
+}
+
+//Backend of cards found on the PCI bus
+static const struct prime_backend_ops pci_backend_ops = {
+    .owner = THIS_MODULE,
+    .read_register = pci_read_register,
+    .write_register = pci_write_register,
+    .read_window = pci_read_window,
+    .mmap_registers = pci_mmap_registers,
+    .reset = pci_reset,
+    .release = pci_release
+};
+
+
+/*
+    Masks the card's interrupt while it is polled. Cards without an
+    interrupt line of their own have their interrupts ignored instead by
+    prime_device_interrupt.
+
+    Paramaters:
+        device  -> Card to mask.
+*/
+static void prime_mask_interrupt(struct prime_device *device) {
+    if(device->pdev != NULL) {
+        //The interrupt thread calls this so it must not wait for itself
+        disable_irq_nosync(device->interrupt_number);
+    }
+}
+
+/*
+    Unmasks the card's interrupt once polling stops.
+
+    Paramaters:
+        device  -> Card to unmask.
+*/
+static void prime_unmask_interrupt(struct prime_device *device) {
+    if(device->pdev != NULL) {
+        enable_irq(device->interrupt_number);
+    }
+}
+
+/*
+    Completes the card's finished searches and wakes pollers and eventfds
+    once for all of them.
+
+    Paramaters:
+        device  -> Card to drain.
+        busy    -> Set to whether a search is still running afterwards.
+        signal  -> Whether the card may have signalled a finished search,
+                   from the interrupt thread or a poll pass. A search
+                   started with register writes is not tracked by the
+                   queue, so then an idle card with its done flag set
+                   wakes them too.
+
+    Return:
+        The number of searches completed.
+*/
+static unsigned int prime_device_drain(struct prime_device *device, bool *busy, bool signal) {
+    unsigned int completed = queue_drain(device, busy);
+
+    if(completed != 0 || (signal && !*busy && prime_read_register(device, DONE_FLAG) == 1)) {
+        notify_search_done(device);
+    }
+
+    return completed;
+}
+
+/*
+    Stops polling the card and unmasks its interrupt.
+
+    Paramaters:
+        device  -> Card to stop polling.
+*/
+static void prime_device_stop_polling(struct prime_device *device) {
+    unsigned long flags;
+    bool removed;
+    bool busy;
+
+    WRITE_ONCE(device->polling, false);
+    smp_mb();
+
+    //The interrupt is about to be freed once the card is removed.
+    //pci_remove sets removed under the dispatch lock, so the interrupt is
+    //never unmasked after it.
+    spin_lock_irqsave(&device->dispatch_lock, flags);
+    removed = READ_ONCE(device->removed);
+    if(!removed) {
+        prime_unmask_interrupt(device);
+    }
+    spin_unlock_irqrestore(&device->dispatch_lock, flags);
+
+    if(removed) {
+        return;
+    }
+
+    //The interrupt of a search that finished while it was masked may have
+    //been dropped
+    prime_device_drain(device, &busy, true);
+}
 
-u8 interrupt_number;
+/*
+    Work item that polls the card while searches finish faster than
+    interrupts are worth taking. It completes up to poll_budget searches
+    and queues itself again so other work gets a turn, like NAPI does. The
+    interrupt is unmasked again once the card is idle or no search has
+    finished for poll_idle_ns.
 
-//Interrupt handler function
+    Paramaters:
+        work    -> Work item embedded in the card.
+*/
+static void prime_device_poll(struct work_struct *work) {
+    struct prime_device *device = container_of(work, struct prime_device, poll_work);
+    unsigned int budget = max(READ_ONCE(poll_budget), 1u);
+    u64 idle_ns = READ_ONCE(poll_idle_ns);
+    u64 last_ns = ktime_get_ns();
+    unsigned int completed = 0;
+    unsigned int count;
+    bool busy;
+    u64 now;
+
+    //Each check is a read across the PCIe link so no extra delay is added
+    //between them, other tasks only get a chance to run
+    while(completed < budget) {
+        count = prime_device_drain(device, &busy, true);
+        now = ktime_get_ns();
+
+        if(count != 0) {
+            this_cpu_add(device->stats->polled_completions, count);
+            completed += count;
+            last_ns = now;
+        }
+        else if(!busy || now - last_ns > idle_ns || READ_ONCE(device->removed)) {
+            prime_device_stop_polling(device);
+            return;
+        }
+
+        cond_resched();
+    }
+
+    queue_work(system_unbound_wq, &device->poll_work);
+}
+
+/*
+    Interrupt thread of a card. Completes every finished search in one pass
+    and restarts the card. Switches the card to polling when interrupts
+    arrive faster than poll_enter_ns apart on average.
+
+    Paramaters:
+        device  -> Card that raised the interrupt.
+*/
+static void prime_device_irq_thread(struct prime_device *device) {
+    u64 enter_ns = READ_ONCE(poll_enter_ns);
+    u64 now = ktime_get_ns();
+    u64 gap = now - device->last_irq_ns;
+    unsigned long flags;
+    bool busy;
+
+    device->last_irq_ns = now;
+    ewma_irq_gap_add(&device->irq_gap, gap);
+
+    prime_device_drain(device, &busy, true);
+
+    //Keep taking interrupts for an isolated short gap, only a sustained
+    //rate is worth polling for
+    if(busy && gap < enter_ns && ewma_irq_gap_read(&device->irq_gap) < enter_ns) {
+        //Under the dispatch lock so the poller is not started once pci_remove
+        //has stopped it
+        spin_lock_irqsave(&device->dispatch_lock, flags);
+        if(!READ_ONCE(device->removed)) {
+            WRITE_ONCE(device->polling, true);
+            prime_mask_interrupt(device);
+            this_cpu_inc(device->stats->poll_entries);
+            queue_work(system_unbound_wq, &device->poll_work);
+        }
+        spin_unlock_irqrestore(&device->dispatch_lock, flags);
+    }
+}
+
+/*
+    Work item that stands in for the interrupt thread of cards without an
+    interrupt line of their own.
+
+    Paramaters:
+        work    -> Work item embedded in the card.
+*/
+static void prime_device_irq_work(struct work_struct *work) {
+    prime_device_irq_thread(container_of(work, struct prime_device, irq_work));
+}
+
+/*
+    Counts an interrupt and reports whether the interrupt thread has to
+    run. Runs in interrupt context so it does nothing more.
+
+    Paramaters:
+        device  -> Card that raised the interrupt.
+
+    Return:
+        IRQ_WAKE_THREAD, or IRQ_HANDLED if the card is being polled and the
+        poller picks the search up.
+*/
+static irqreturn_t prime_device_hardirq(struct prime_device *device) {
+    if(READ_ONCE(device->polling)) {
+        return IRQ_HANDLED;
+    }
+
+    this_cpu_inc(device->stats->interrupts);
+
+    return IRQ_WAKE_THREAD;
+}
+
+//Interrupt handler function. Only wakes the interrupt thread.
 static irqreturn_t interrupt_handler(int irq, void *dev) {
-    printk(KERN_INFO "INTERRUPT: %d\n", irq);
-    complete(&ioctl_completion);
+    trace_prime_irq(irq);
+
+    return prime_device_hardirq(dev);
+}
+
+//Interrupt thread function. Completes the card's finished searches.
+static irqreturn_t interrupt_thread(int irq, void *dev) {
+    prime_device_irq_thread(dev);
+
     return IRQ_HANDLED;
 }
 
+/*
+    Delivers a completion interrupt of the card. Must be called from
+    interrupt context, the way a real interrupt handler runs. The finished
+    searches are completed later from a work item, the way the interrupt
+    thread of a PCI card completes them. Interrupts delivered while the
+    card is polled are ignored, as if they were masked.
+
+    Paramaters:
+        device  -> Card whose search finished.
+*/
+void prime_device_interrupt(struct prime_device *device) {
+    if(prime_device_hardirq(device) == IRQ_WAKE_THREAD) {
+        queue_work(system_highpri_wq, &device->irq_work);
+    }
+}
+EXPORT_SYMBOL(prime_device_interrupt);
+
+/*
+    Resets the card in place. The search it was running and every queued
+    search are kept and started again afterwards, and open files stay
+    usable.
+
+    Paramaters:
+        device  -> Card to reset.
+    Return:
+        0 on success, -EBUSY if the card is recovering from a PCI error,
+        -ENODEV if it has been removed, -EIO if it failed to recover and
+        another negative value if the backend's reset failed.
+*/
+int prime_device_reset(struct prime_device *device) {
+    int status = 0;
+
+    mutex_lock(&device->reset_lock);
+
+    if(READ_ONCE(device->removed)) {
+        mutex_unlock(&device->reset_lock);
+        return -ENODEV;
+    }
+    if(READ_ONCE(device->dead)) {
+        mutex_unlock(&device->reset_lock);
+        return -EIO;
+    }
+    if(device->recovering) {
+        mutex_unlock(&device->reset_lock);
+        return -EBUSY;
+    }
+
+    queue_reset_begin(device);
+    if(device->ops->reset != NULL) {
+        status = device->ops->reset(device->backend_data);
+    }
+    queue_reset_end(device);
+
+    mutex_unlock(&device->reset_lock);
+
+    this_cpu_inc(device->stats->resets);
+
+    return status;
+}
+
+/*
+    Watchdog of a card. A finished search whose interrupt got lost is
+    completed. A search that has not finished and whose cycle count has not
+    moved since the previous check has stalled the card, which is reset and
+    given its work again.
+
+    Paramaters:
+        work    -> Delayed work item embedded in the card.
+*/
+static void prime_device_watchdog(struct work_struct *work) {
+    struct prime_device *device = container_of(to_delayed_work(work), struct prime_device, watchdog_work);
+    unsigned int period = READ_ONCE(watchdog_ms);
+    unsigned long flags;
+    u64 start_ns;
+    u64 cycles;
+    bool busy;
+    int status;
+
+    if(READ_ONCE(device->removed)) {
+        return;
+    }
+
+    //Look again later in case the watchdog is turned on
+    if(period == 0) {
+        queue_delayed_work(system_wq, &device->watchdog_work, HZ);
+        return;
+    }
+
+    //A reset in progress holds the card still
+    if(prime_device_drain(device, &busy, false) != 0 || !busy || READ_ONCE(device->queue.resetting)) {
+        device->watchdog_start_ns = 0;
+        goto rearm;
+    }
+
+    spin_lock_irqsave(&device->dispatch_lock, flags);
+    start_ns = device->search_start_ns;
+    spin_unlock_irqrestore(&device->dispatch_lock, flags);
+    cycles = prime_read_cycles(device);
+
+    if(start_ns == device->watchdog_start_ns && cycles == device->watchdog_cycles) {
+        //A card recovering from a PCI error is left to the recovery
+        status = prime_device_reset(device);
+        if(status != -EBUSY) {
+            this_cpu_inc(device->stats->watchdog_resets);
+            printk(KERN_WARNING "Card %d stalled and was reset, status %d\n", device->minor, status);
+        }
+        device->watchdog_start_ns = 0;
+        goto rearm;
+    }
+
+    device->watchdog_start_ns = start_ns;
+    device->watchdog_cycles = cycles;
+
+rearm:
+    queue_delayed_work(system_wq, &device->watchdog_work, msecs_to_jiffies(period));
+}
+
+/*
+    Frees the state of a card once the last reference to it is dropped.
+    The backend's state is released first.
+
+    Paramaters:
+        ref     -> Reference counter embedded in the card's state.
+*/
+static void prime_device_release(struct kref *ref) {
+    struct prime_device *device = container_of(ref, struct prime_device, ref);
+
+    if(device->ops->release != NULL) {
+        device->ops->release(device->backend_data);
+    }
+    stats_free(device->stats);
+    kfree(device);
+}
+
+/*
+    Allocates the state of a card driven by a backend. The card is not
+    visible to user space until it is registered.
+
+    Paramaters:
+        ops             -> Register access callbacks of the backend.
+        backend_data    -> Handed to every callback.
+    Return:
+        The card, or NULL if it could not be allocated.
+*/
+struct prime_device *prime_device_alloc(const struct prime_backend_ops *ops, void *backend_data) {
+    struct prime_device *device;
+
+    device = kzalloc(sizeof(struct prime_device), GFP_KERNEL);
+    if(device == NULL) {
+        return NULL;
+    }
+
+    device->stats = stats_alloc();
+    if(device->stats == NULL) {
+        kfree(device);
+        return NULL;
+    }
+
+    device->ops = ops;
+    device->backend_data = backend_data;
+    device->minor = -1;
+    spin_lock_init(&device->dispatch_lock);
+    queue_init(&device->queue);
+    ewma_search_cycles_init(&device->search_cycles);
+    ewma_ns_per_kcycle_init(&device->ns_per_kcycle);
+    ewma_irq_gap_init(&device->irq_gap);
+    INIT_WORK(&device->poll_work, prime_device_poll);
+    INIT_WORK(&device->irq_work, prime_device_irq_work);
+    INIT_DELAYED_WORK(&device->watchdog_work, prime_device_watchdog);
+    mutex_init(&device->reset_lock);
+    ring_init_device_state(&device->ring_state);
+    init_waitqueue_head(&device->poll_wait);
+    INIT_LIST_HEAD(&device->event_files);
+    spin_lock_init(&device->event_lock);
+    kref_init(&device->ref);
+
+    return device;
+}
+EXPORT_SYMBOL(prime_device_alloc);
+
+/*
+    Undoes the steps of prime_device_register in the reverse order that
+    they were done in.
+
+    Paramaters:
+        device  -> Card to unregister.
+*/
+static void back_out_registration(struct prime_device *device) {
+
+    //Runs through the steps in reverse order that they were done during setup
+    switch(device->register_status) {
+        case 3:
+            stats_remove_device(device);
+        case 2:
+            cdev_del(device->char_device);
+        case 1:
+            mutex_lock(&devices_lock);
+            devices[device->minor] = NULL;
+            mutex_unlock(&devices_lock);
+    }
+
+    device->register_status = 0;
+}
+
+/*
+    Gives the card a minor number and creates its character device.
+
+    Paramaters:
+        device  -> Card returned by prime_device_alloc.
+    Return:
+        0 on success and a negative value on failure.
+*/
+int prime_device_register(struct prime_device *device) {
+    int status;
+    int minor;
+
+    //Give the card the first free minor number
+    mutex_lock(&devices_lock);
+    for(minor = 0; minor < MAX_DEVICES; minor++) {
+        if(devices[minor] == NULL) {
+            devices[minor] = device;
+            break;
+        }
+    }
+    mutex_unlock(&devices_lock);
+
+    if(minor == MAX_DEVICES) {
+        printk(KERN_WARNING "No free minor number for the card\n");
+        return -EBUSY;
+    }
+    device->minor = minor;
+    device->register_status++;
+
+    //Register the character device of the card. Once it is added it is
+    //considered to be live.
+    device->char_device = cdev_alloc();
+    if(device->char_device == NULL) {
+        back_out_registration(device);
+        return -ENOMEM;
+    }
+    device->char_device->ops = &file_ops;
+    device->char_device->owner = THIS_MODULE;
+
+    status = cdev_add(device->char_device, MKDEV(MAJOR(char_device_numbers), minor), 1);
+    if(status < 0) {
+        kobject_put(&device->char_device->kobj);
+        back_out_registration(device);
+        return status;
+    }
+    device->register_status++;
+
+    //Counters of the card in debugfs
+    stats_add_device(device);
+    device->register_status++;
+
+    //Watch for a stalled card from now on
+    queue_delayed_work(system_wq, &device->watchdog_work, msecs_to_jiffies(READ_ONCE(watchdog_ms)));
+
+    printk(KERN_INFO "Card added with minor number %d\n", minor);
+
+    return 0;
+}
+EXPORT_SYMBOL(prime_device_register);
+
+/*
+    Removes the card's character device, fails every search still waiting
+    on it and drops the reference taken by prime_device_alloc. The backend
+    must have stopped raising interrupts for the card before calling this.
+    Also used to free a card whose registration failed.
+
+    Paramaters:
+        device  -> Card to remove.
+*/
+void prime_device_unregister(struct prime_device *device) {
+    //Fail every search from now on
+    WRITE_ONCE(device->removed, true);
+
+    //Free up the character device and the minor number
+    back_out_registration(device);
+
+    //No interrupt arrives any more, so neither work item is queued again.
+    //The watchdog stops rearming itself once the card is removed.
+    cancel_work_sync(&device->irq_work);
+    cancel_work_sync(&device->poll_work);
+    cancel_delayed_work_sync(&device->watchdog_work);
+
+    //Fail every queued search and wake any poller so that they see the
+    //card is gone
+    queue_fail_all(device, -ENODEV);
+    notify_search_done(device);
+
+    kref_put(&device->ref, prime_device_release);
+}
+EXPORT_SYMBOL(prime_device_unregister);
+
+/*
+    Undoes the PCI probe steps of a card in the reverse order that they
+    were done in.
+
+    Paramaters:
+        device  -> Card to tear down.
+*/
+static void back_out_device(struct prime_device *device) {
+
+    //Runs through the steps in reverse order that they were done during setup
+    switch(device->setup_status) {
+        case 4:
+            //Waits for the interrupt thread. pci_remove has already
+            //stopped the poller, this covers a failed probe.
+            free_irq(device->interrupt_number, device);
+            cancel_work_sync(&device->poll_work);
+        case 3:
+            pci_free_irq_vectors(device->pdev);
+        case 2:
+            pci_clear_master(device->pdev);
+        case 1:
+            pci_disable_device(device->pdev);
+    }
+
+    device->setup_status = 0;
+}
+
 /*
     This function is called when the kernel finds a device that can be
     paired with the driver.
@@ -29,14 +755,16 @@ static irqreturn_t interrupt_handler(int irq, void *dev) {
     Parameters:
         dev     -> Device structure pointer of the device the driver is
                    being paired with.
-        id      -> Pointer to the ID information of the device being 
+        id      -> Pointer to the ID information of the device being
                    paired.
 
     Return:
         0 on success and a negative value on failure.
 */
 int pci_probe (struct pci_dev *dev, const struct pci_device_id *id) {
+    struct prime_device *device;
     int status;
+    int vector_count;
     u16 vendor_id;
 
     //Store the addres of both the start and end of the PCIe memory region
@@ -44,17 +772,25 @@ int pci_probe (struct pci_dev *dev, const struct pci_device_id *id) {
     unsigned long bar0_ptr_int_end;
 
     printk(KERN_INFO "PCI PROBE\n");
-    status = pci_enable_device(dev);
 
+    device = prime_device_alloc(&pci_backend_ops, NULL);
+    if(device == NULL) {
+        return -ENOMEM;
+    }
+    //The PCI backend works on the card's own state
+    device->backend_data = device;
+    device->pdev = dev;
+
+    status = pci_enable_device(dev);
     if(status != 0) {
-        return status;
+        goto fail;
     }
+    device->setup_status++;
 
     //Read the vendor ID from the configuration space of the device.
     status = pci_read_config_word(dev, PCI_VENDOR_ID, &vendor_id);
-
     if(status != 0) {
-        return status;
+        goto fail;
     }
 
     //All PCI values are big endian so the conversion to the cpu byte ordering
@@ -65,27 +801,61 @@ int pci_probe (struct pci_dev *dev, const struct pci_device_id *id) {
     bar0_ptr_int_start = pci_resource_start(dev, 0);
     bar0_ptr_int_end = pci_resource_end(dev, 0);
 
-    bar0_size = bar0_ptr_int_end - bar0_ptr_int_start;
-    bar0_start = bar0_ptr_int_start;
+    device->bar0_size = bar0_ptr_int_end - bar0_ptr_int_start;
+    device->bar0_start = bar0_ptr_int_start;
 
     //Map the BAR0 memory region of the device into the virtual address space.
-    bar0_ptr = (char*) ioremap(bar0_ptr_int_start, bar0_size);
+    //It is unmapped by pci_release.
+    device->bar0_ptr = (char*) ioremap(bar0_ptr_int_start, device->bar0_size);
+    if(device->bar0_ptr == NULL) {
+        status = -ENOMEM;
+        goto fail;
+    }
 
     //Make the device a bus master so that it can raise interrupts
     pci_set_master(dev);
+    device->setup_status++;
 
     //Allocate a single interrupt vector
-    int vector_count = pci_alloc_irq_vectors(dev, 1, 1, PCI_IRQ_MSI);
+    vector_count = pci_alloc_irq_vectors(dev, 1, 1, PCI_IRQ_MSI);
     printk(KERN_INFO "Allocated Vector Count: %d\n", vector_count);
+    if(vector_count < 0) {
+        status = vector_count;
+        goto fail;
+    }
+    device->setup_status++;
 
     //Get the IRQ number for the vector
-    interrupt_number = pci_irq_vector(dev, 0);
-    printk(KERN_INFO "Assigned IRO: %d\n", interrupt_number);
+    device->interrupt_number = pci_irq_vector(dev, 0);
+    printk(KERN_INFO "Assigned IRO: %d\n", device->interrupt_number);
 
-    //Attach a handler to the IRQ number
-    int irq_request_status = request_irq(interrupt_number, interrupt_handler, IRQF_SHARED, DEVICE_NAME, dev);
-    printk(KERN_INFO "IRQ Request Status: %d\n", irq_request_status);
+    //Attach a handler to the IRQ number. The card's state is handed to the
+    //handler so it knows which card raised the interrupt. The handler only
+    //wakes the thread, which completes every finished search at once.
+    status = request_threaded_irq(device->interrupt_number, interrupt_handler, interrupt_thread,
+                                  IRQF_SHARED, DEVICE_NAME, device);
+    printk(KERN_INFO "IRQ Request Status: %d\n", status);
+    if(status != 0) {
+        goto fail;
+    }
+    device->setup_status++;
+
+    //Kept for restoring the config space after a reset
+    pci_save_state(dev);
+
+    //Give the card a minor number and its character device
+    status = prime_device_register(device);
+    if(status != 0) {
+        goto fail;
+    }
 
+    pci_set_drvdata(dev, device);
+
+    return 0;
+
+fail:
+    back_out_device(device);
+    prime_device_unregister(device);
     return status;
 }
 
@@ -97,14 +867,212 @@ int pci_probe (struct pci_dev *dev, const struct pci_device_id *id) {
         Nothing.
 */
 void pci_remove (struct pci_dev *dev) {
+    struct prime_device *device = pci_get_drvdata(dev);
+    unsigned long flags;
+
+    //Fail every search from now on. Under the dispatch lock so the
+    //interrupt thread starts no poller and the poller unmasks no interrupt
+    //after this.
+    spin_lock_irqsave(&device->dispatch_lock, flags);
+    WRITE_ONCE(device->removed, true);
+    spin_unlock_irqrestore(&device->dispatch_lock, flags);
+
+    //The poller must be done with BAR0 and the interrupt before they are
+    //freed
+    cancel_work_sync(&device->poll_work);
+
+    //The watchdog must not reset the card while it is torn down
+    cancel_delayed_work_sync(&device->watchdog_work);
+
+    //Free up the interrupt and the interrupt vectors and disable the
+    //device so that no further interrupt arrives
+    back_out_device(device);
 
-    //Free up the interrupt
-    free_irq(interrupt_number, dev);
-    //Free up the interrupt vectors
-    pci_free_irq_vectors(dev);
-    //Un-map BAR0 from kernel space
-    iounmap(bar0_ptr);
-    //Disable the device
-    pci_disable_device(dev);
+    pci_set_drvdata(dev, NULL);
+
+    //Remove the character device and fail the searches still waiting
+    prime_device_unregister(device);
     printk(KERN_INFO "PCI REMOVE\n");
-}
\ No newline at end of file
+}
+
+/*
+    Gives up on a card that did not come back from a PCI error. Ends the
+    reset held since the error so nothing waits on it, and fails every
+    search with -EIO, now and until the card is removed.
+
+    Paramaters:
+        device  -> Card that is gone.
+*/
+static void pci_recovery_failed(struct prime_device *device) {
+    mutex_lock(&device->reset_lock);
+
+    //Set before the queue is failed so no new search gets in after it
+    WRITE_ONCE(device->dead, true);
+
+    if(device->recovering) {
+        enable_irq(device->interrupt_number);
+        queue_reset_end(device);
+        device->recovering = false;
+    }
+    mutex_unlock(&device->reset_lock);
+
+    queue_fail_all(device, -EIO);
+    //Pollers and eventfds see the searches fail
+    notify_search_done(device);
+
+    printk(KERN_ERR "Card %d did not recover from a PCI error\n", device->minor);
+}
+
+/*
+    Called when a PCI error was detected on the card. Holds back the
+    card's work until the slot has been reset.
+
+    Paramaters:
+        dev     -> Pointer to the device the driver is paired with
+        state   -> State of the PCI channel.
+    Return:
+        PCI_ERS_RESULT_NEED_RESET, or PCI_ERS_RESULT_DISCONNECT if the
+        card is gone for good.
+*/
+pci_ers_result_t pci_error_detected(struct pci_dev *dev, pci_channel_state_t state) {
+    struct prime_device *device = pci_get_drvdata(dev);
+
+    printk(KERN_WARNING "PCI ERROR DETECTED: %d\n", state);
+
+    //pci_remove runs next and fails the searches
+    if(state == pci_channel_io_perm_failure) {
+        return PCI_ERS_RESULT_DISCONNECT;
+    }
+
+    mutex_lock(&device->reset_lock);
+    if(!device->recovering) {
+        device->recovering = true;
+        //The running search goes back to the front of the queue and
+        //nothing is started until the card has recovered
+        queue_reset_begin(device);
+        disable_irq(device->interrupt_number);
+    }
+    mutex_unlock(&device->reset_lock);
+
+    return PCI_ERS_RESULT_NEED_RESET;
+}
+
+/*
+    Called once the slot of the card has been reset after an error.
+    Restores the config space, which brings back BAR0 and MSI.
+
+    Paramaters:
+        dev     -> Pointer to the device the driver is paired with
+    Return:
+        PCI_ERS_RESULT_RECOVERED, or PCI_ERS_RESULT_DISCONNECT if BAR0
+        moved.
+*/
+pci_ers_result_t pci_slot_reset(struct pci_dev *dev) {
+    struct prime_device *device = pci_get_drvdata(dev);
+
+    printk(KERN_INFO "PCI SLOT RESET\n");
+
+    pci_restore_state(dev);
+    pci_set_master(dev);
+    //The state is consumed by the restore, keep it for the next reset
+    pci_save_state(dev);
+
+    //pci_resume does not run after a disconnect
+    if(pci_check_bar0(device) != 0) {
+        pci_recovery_failed(device);
+        return PCI_ERS_RESULT_DISCONNECT;
+    }
+
+    return PCI_ERS_RESULT_RECOVERED;
+}
+
+/*
+    Called once the card has recovered from an error. Unmasks its
+    interrupt and starts the work held back since the error.
+
+    Paramaters:
+        dev     -> Pointer to the device the driver is paired with
+*/
+void pci_resume(struct pci_dev *dev) {
+    struct prime_device *device = pci_get_drvdata(dev);
+
+    mutex_lock(&device->reset_lock);
+    if(device->recovering) {
+        enable_irq(device->interrupt_number);
+        queue_reset_end(device);
+        device->recovering = false;
+        this_cpu_inc(device->stats->resets);
+    }
+    mutex_unlock(&device->reset_lock);
+
+    printk(KERN_INFO "PCI RESUME\n");
+}
+
+/*
+    Looks up the card with the given minor number and takes a reference
+    to it.
+
+    Paramaters:
+        minor   -> Minor number of the card.
+    Return:
+        The card, or NULL if no card uses that minor number. The reference
+        must be dropped with prime_device_put.
+*/
+struct prime_device *prime_device_get(int minor) {
+    struct prime_device *device = NULL;
+
+    if(minor < 0 || minor >= MAX_DEVICES) {
+        return NULL;
+    }
+
+    //Pin the backend module so its callbacks stay loaded while the card
+    //is in use
+    mutex_lock(&devices_lock);
+    if(devices[minor] != NULL && try_module_get(devices[minor]->ops->owner)) {
+        device = devices[minor];
+        kref_get(&device->ref);
+    }
+    mutex_unlock(&devices_lock);
+
+    return device;
+}
+
+/*
+    Drops a reference taken with prime_device_get or prime_device_get_all.
+    The card's state is freed when the last reference goes away.
+
+    Paramaters:
+        device  -> Card to release.
+*/
+void prime_device_put(struct prime_device *device) {
+    struct module *owner = device->ops->owner;
+
+    kref_put(&device->ref, prime_device_release);
+    module_put(owner);
+}
+
+/*
+    Takes a reference to every card that is currently present.
+
+    Paramaters:
+        device_list -> Array with room for MAX_DEVICES entries that is
+                       filled with the cards.
+    Return:
+        The number of cards stored in devices. Each one must be released
+        with prime_device_put.
+*/
+int prime_device_get_all(struct prime_device **device_list) {
+    int count = 0;
+    int minor;
+
+    mutex_lock(&devices_lock);
+    for(minor = 0; minor < MAX_DEVICES; minor++) {
+        if(devices[minor] != NULL && try_module_get(devices[minor]->ops->owner)) {
+            kref_get(&devices[minor]->ref);
+            device_list[count++] = devices[minor];
+        }
+    }
+    mutex_unlock(&devices_lock);
+
+    return count;
+}
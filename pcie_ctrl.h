@@ -2,14 +2,227 @@
 #define PCIE_CTRL_H
 
 #include "device_specific.h"
+#include "ring.h"
+#include "queue.h"
+#include "backend.h"
+#include "stats.h"
 
 #include <linux/pci.h>
 #include <linux/interrupt.h>
 #include <linux/module.h>
+#include <linux/cdev.h>
+#include <linux/kref.h>
+#include <linux/wait.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/average.h>
+#include <linux/workqueue.h>
 
-//Interrupt handler function
+//Running averages used to size the spin of hybrid waits. The weight of
+//each new sample is 1/8.
+DECLARE_EWMA(search_cycles, 0, 8)
+DECLARE_EWMA(ns_per_kcycle, 0, 8)
+//Running average of the time between interrupts of a card, which decides
+//when it is polled instead
+DECLARE_EWMA(irq_gap, 0, 8)
+
+//State of a single prime finder card. One of these is allocated per card
+//in pci_probe and can be reached through pci_get_drvdata and through the
+//private data of every file opened on the card's minor number. It stays
+//allocated until the card is removed and every file using it is closed.
+struct prime_device {
+    //Backend that reaches the card's registers and the data handed to it
+    const struct prime_backend_ops *ops;
+    void *backend_data;
+
+    //PCI device of the card, NULL for cards of other backends
+    struct pci_dev *pdev;
+
+    //Pointer to the start of the BAR0 address space AFTER it has been
+    //mapped into the virtual address space.
+    char *bar0_ptr;
+    //Data related to bar 0 on the device
+    unsigned long bar0_size;
+    unsigned long bar0_start;
+
+    int interrupt_number;
+
+    //Minor number and character device of the card
+    int minor;
+    struct cdev *char_device;
+
+    //Serializes starting searches on the card and completing them. It
+    //protects the request queue and the ring state below and is taken
+    //from interrupt context.
+    spinlock_t dispatch_lock;
+
+    //Blocking searches waiting for or running on the card
+    struct search_queue queue;
+
+    //State of the submission rings that drive the card
+    struct ring_device_state ring_state;
+
+    //Cycle counts of recent hybrid searches and the time each thousand
+    //cycles took, from which the expected length of the next search is
+    //predicted. Protected by dispatch_lock.
+    struct ewma_search_cycles search_cycles;
+    struct ewma_ns_per_kcycle ns_per_kcycle;
+
+    //Time the search running on the card was started. Protected by
+    //dispatch_lock.
+    u64 search_start_ns;
+
+    //Set while the card is polled for finished searches by poll_work. Its
+    //interrupt is masked in the meantime.
+    bool polling;
+    struct work_struct poll_work;
+    //Average time between interrupts and the time of the latest one. Only
+    //touched by the interrupt thread.
+    struct ewma_irq_gap irq_gap;
+    u64 last_irq_ns;
+    //Runs the interrupt thread's work for cards of other backends, which
+    //have no interrupt line of their own
+    struct work_struct irq_work;
+
+    //Checks every watchdog_ms that a running search makes progress. The
+    //start time and cycle count of the search seen at the previous check
+    //are kept to compare against. Only touched by the watchdog.
+    struct delayed_work watchdog_work;
+    u64 watchdog_start_ns;
+    u64 watchdog_cycles;
+
+    //Serializes resets of the card. recovering is set from the moment a
+    //PCI error is reported until the card has recovered, and no other
+    //reset is started in the meantime.
+    struct mutex reset_lock;
+    bool recovering;
+
+    //Per-CPU counters and histograms of the card and its debugfs directory
+    struct prime_stats __percpu *stats;
+    struct dentry *debugfs_dir;
+
+    //Woken on every interrupt of the card so poll() and epoll see new
+    //results straight away
+    wait_queue_head_t poll_wait;
+    //Files that registered an eventfd with IOCTL_SET_EVENTFD. The lock is
+    //taken from interrupt context.
+    struct list_head event_files;
+    spinlock_t event_lock;
+
+    //Set once the card has been removed. Searches fail from then on.
+    bool removed;
+    //Set once the card failed to recover from a PCI error. Searches fail
+    //with -EIO from then on, until the card is removed.
+    bool dead;
+
+    //Tracks which probe steps have been completed so pci_remove and a
+    //failed probe can undo them in reverse order.
+    unsigned int setup_status;
+    //Same for the steps of prime_device_register
+    unsigned int register_status;
+
+    struct kref ref;
+};
+
+/*
+    Reads a register of the card through its backend.
+
+    Paramaters:
+        device  -> Card to read from.
+        offset  -> Offset of the register.
+    Return:
+        The value of the register.
+*/
+static inline u32 prime_read_register(struct prime_device *device, unsigned int offset) {
+    return device->ops->read_register(device->backend_data, offset);
+}
+
+/*
+    Writes a register of the card through its backend.
+
+    Paramaters:
+        device  -> Card to write to.
+        offset  -> Offset of the register.
+        value   -> Value to write.
+*/
+static inline void prime_write_register(struct prime_device *device, unsigned int offset, u32 value) {
+    device->ops->write_register(device->backend_data, offset, value);
+}
+
+/*
+    Reads the cycle count of the card's latest search. The two halves are
+    separate registers, so the high half is read again after the low half
+    and the low half is read again if the high half changed in between.
+
+    Paramaters:
+        device  -> Card to read from.
+    Return:
+        The cycle count.
+*/
+static inline u64 prime_read_cycles(struct prime_device *device) {
+    u32 high = prime_read_register(device, CYCLE_COUNT_HIGH);
+    u32 low = prime_read_register(device, CYCLE_COUNT_LOW);
+    u32 high_again = prime_read_register(device, CYCLE_COUNT_HIGH);
+
+    if(high_again != high) {
+        low = prime_read_register(device, CYCLE_COUNT_LOW);
+        high = high_again;
+    }
+
+    return ((u64) high << 32) | low;
+}
+
+/*
+    Starts a search on the card and counts it. Must be called with the
+    card's dispatch lock held while the card is idle.
+
+    Paramaters:
+        device      -> Card to start the search on.
+        start_val   -> Value to start the search from.
+        now_ns      -> Current time from ktime_get_ns.
+*/
+static inline void prime_start_search(struct prime_device *device, u32 start_val, u64 now_ns) {
+    device->search_start_ns = now_ns;
+    this_cpu_inc(device->stats->searches_started);
+
+    prime_write_register(device, START_NUMBER, start_val);
+    prime_write_register(device, START_FLAG, 1);
+}
+
+/*
+    Counts a finished search of the card. Must be called with the card's
+    dispatch lock held.
+
+    Paramaters:
+        device  -> Card the search ran on.
+        cycles  -> Cycle count of the search.
+*/
+static inline void prime_count_completion(struct prime_device *device, u64 cycles) {
+    this_cpu_inc(device->stats->searches_completed);
+    stats_histogram_add(device->stats, cycles_hist, cycles);
+}
+
+/*
+    Resets the card in place. The search it was running and every queued
+    search are kept and started again afterwards, and open files stay
+    usable.
+
+    Paramaters:
+        device  -> Card to reset.
+    Return:
+        0 on success, -EBUSY if the card is recovering from a PCI error,
+        -ENODEV if it has been removed, -EIO if it failed to recover and
+        another negative value if the backend's reset failed.
+*/
+int prime_device_reset(struct prime_device *device);
+
+//Interrupt handler function. Only wakes the interrupt thread.
 static irqreturn_t interrupt_handler(int irq, void *dev);
 
+//Interrupt thread function. Completes the card's finished searches.
+static irqreturn_t interrupt_thread(int irq, void *dev);
+
 /*
     This function is called when the kernel finds a device that can be
     paired with the driver.
@@ -34,6 +247,74 @@ int pci_probe (struct pci_dev *dev, const struct pci_device_id *id);
 */
 void pci_remove (struct pci_dev *dev);
 
+/*
+    Called when a PCI error was detected on the card. Holds back the
+    card's work until the slot has been reset.
+
+    Paramaters:
+        dev     -> Pointer to the device the driver is paired with
+        state   -> State of the PCI channel.
+    Return:
+        PCI_ERS_RESULT_NEED_RESET, or PCI_ERS_RESULT_DISCONNECT if the
+        card is gone for good.
+*/
+pci_ers_result_t pci_error_detected(struct pci_dev *dev, pci_channel_state_t state);
+
+/*
+    Called once the slot of the card has been reset after an error.
+    Restores the config space, which brings back BAR0 and MSI.
+
+    Paramaters:
+        dev     -> Pointer to the device the driver is paired with
+    Return:
+        PCI_ERS_RESULT_RECOVERED, or PCI_ERS_RESULT_DISCONNECT if BAR0
+        moved.
+*/
+pci_ers_result_t pci_slot_reset(struct pci_dev *dev);
+
+/*
+    Called once the card has recovered from an error. Unmasks its
+    interrupt and starts the work held back since the error.
+
+    Paramaters:
+        dev     -> Pointer to the device the driver is paired with
+*/
+void pci_resume(struct pci_dev *dev);
+
+/*
+    Looks up the card with the given minor number and takes a reference
+    to it.
+
+    Paramaters:
+        minor   -> Minor number of the card.
+    Return:
+        The card, or NULL if no card uses that minor number or its backend
+        module is being unloaded. The reference must be dropped with
+        prime_device_put.
+*/
+struct prime_device *prime_device_get(int minor);
+
+/*
+    Drops a reference taken with prime_device_get or prime_device_get_all.
+    The card's state is freed when the last reference goes away.
+
+    Paramaters:
+        device  -> Card to release.
+*/
+void prime_device_put(struct prime_device *device);
+
+/*
+    Takes a reference to every card that is currently present.
+
+    Paramaters:
+        device_list -> Array with room for MAX_DEVICES entries that is
+                       filled with the cards.
+    Return:
+        The number of cards stored in devices. Each one must be released
+        with prime_device_put.
+*/
+int prime_device_get_all(struct prime_device **device_list);
+
 //This array contains the several PCI device id structures. These structures
 //have several feilds but in this case only the vendor id and device id are used.
 //PCI_DEVICE is a helper macro for initializing a structure instance.
@@ -45,6 +326,14 @@ static struct pci_device_id pci_id_array[] = {
 };
 
 
+//Recovery from errors reported by AER and the like without removing the
+//card
+static const struct pci_error_handlers pci_error_handlers_struct = {
+    .error_detected = pci_error_detected,
+    .slot_reset = pci_slot_reset,
+    .resume = pci_resume
+};
+
 //Maps various PCI related functions and values into the struct.
 //This is then used to register the driver with the PCI subsystem.
 //There are additional feilds in the sturcture but this are the 
@@ -53,18 +342,12 @@ static struct pci_driver pci_driver_struct = {
     .name = DEVICE_NAME,
     .id_table = pci_id_array,
     .probe = pci_probe,
-    .remove = pci_remove
+    .remove = pci_remove,
+    .err_handler = &pci_error_handlers_struct
 };
 
 
+//Major and first minor number of the driver. Allocated in prime_finder_main.c
+extern dev_t char_device_numbers;
 
-//Pointer to the start of the BAR0 address space AFTER it has been 
-//mapped into the virtual address space.
-extern char *bar0_ptr;
-//Data related to bar 0 on the device
-extern unsigned long bar0_size;
-extern unsigned long bar0_start;
-
-extern u8 interrupt_number;
-
-#endif
\ No newline at end of file
+#endif
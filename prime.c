@@ -2,13 +2,171 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
 
 #include "device_specific.h"
+#include "prime.h"
+#include "emulator.h"
+#include "prime_index.h"
+#include "miller_rabin.h"
+#include "verify.h"
+#include "timing.h"
 
 ////////////////////////////////////////////////////
 //Low-level API
 ////////////////////////////////////////////////////
 
+//When BAR0 has been mapped with map_registers() the low-level API accesses
+//the registers of that file descriptor directly instead of going through
+//the read() and write() system calls.
+static volatile uint32_t *mapped_registers = NULL;
+static int mapped_fd = -1;
+static size_t mapped_size = 0;
+
+//Device system calls made by each thread, reported by device_call_count()
+static __thread uint64_t device_calls = 0;
+
+/*
+    Opens a prime finder. The software emulator in emulator.c is used
+    instead of the device file when path is PRIME_EMULATED_PATH or the
+    PRIME_FINDER_EMULATE environment variable is set to 1.
+
+    Paramaters:
+        path    -> Path of the device file, e.g. /dev/prime_finder.
+
+    Return:
+        A file descriptor on success and a negative value otherwise.
+*/
+int open_device(const char *path) {
+    const char *emulate = getenv("PRIME_FINDER_EMULATE");
+    struct emulator_config config;
+
+    if(strcmp(path, PRIME_EMULATED_PATH) == 0 ||
+       (emulate != NULL && strcmp(emulate, "1") == 0)) {
+        emulator_default_config(&config);
+        return emulator_open(&config);
+    }
+
+    return open(path, O_RDWR);
+}
+
+/*
+    Closes a file descriptor returned by open_device().
+
+    Paramaters:
+        fd  -> File descriptor to close.
+
+    Return:
+        0 on success and a negative value otherwise.
+*/
+int close_device(int fd) {
+    //Samples of this thread are checked before the device goes away
+    verify_flush();
+
+    if(fd == mapped_fd) {
+        unmap_registers();
+    }
+
+    if(emulator_is_emulated(fd)) {
+        return emulator_close(fd);
+    }
+
+    return close(fd);
+}
+
+/*
+    Reads registers with a single positional read, from the device file or
+    from the emulator.
+*/
+static ssize_t registers_pread(int fd, void *buffer, size_t count, int offset) {
+    device_calls++;
+    if(emulator_is_emulated(fd)) {
+        return emulator_read(fd, offset, buffer, count);
+    }
+
+    return pread(fd, buffer, count, offset);
+}
+
+/*
+    Writes registers with a single positional write, to the device file or
+    to the emulator.
+*/
+static ssize_t registers_pwrite(int fd, const void *buffer, size_t count, int offset) {
+    device_calls++;
+    if(emulator_is_emulated(fd)) {
+        return emulator_write(fd, offset, buffer, count);
+    }
+
+    return pwrite(fd, buffer, count, offset);
+}
+
+/*
+    Returns the number of device system calls the calling thread has made
+    through the library. Calls on an emulated device count as the system
+    call they stand in for.
+
+    Return:
+        The number of calls.
+*/
+uint64_t device_call_count(void) {
+    return device_calls;
+}
+
+/*
+    Maps BAR0 of the device into the process so that all further register
+    accesses on fd are plain loads and stores. Every other file descriptor
+    keeps using the system call path. Emulated devices have no BAR0 to map.
+
+    Parameters:
+        fd  -> File descriptor of the device file.
+
+    Return:
+        0 on success and a negative value otherwise.
+*/
+int map_registers(int fd) {
+    long page_size = sysconf(_SC_PAGESIZE);
+    void *map;
+
+    if(emulator_is_emulated(fd)) {
+        return -1;
+    }
+
+    if(mapped_registers != NULL) {
+        unmap_registers();
+    }
+
+    //All of the registers sit in the first page of BAR0
+    map = mmap(NULL, page_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(map == MAP_FAILED) {
+        return -1;
+    }
+
+    mapped_registers = (volatile uint32_t*) map;
+    mapped_size = page_size;
+    mapped_fd = fd;
+
+    return 0;
+}
+
+/*
+    Unmaps BAR0 and returns to the system call path.
+*/
+void unmap_registers(void) {
+    if(mapped_registers == NULL) {
+        return;
+    }
+
+    munmap((void*) mapped_registers, mapped_size);
+    mapped_registers = NULL;
+    mapped_size = 0;
+    mapped_fd = -1;
+}
+
 /*
     Write zero to each of the user writable registers on the device.
 
@@ -19,19 +177,19 @@
         0 on success and a negative value otherwise.
 */
 int clear_registers(int fd) {
-    uint32_t data = 0;
+    uint32_t zeros[2] = {0, 0};
     int status;
 
-    //Move the file pointer to the start flag register then write zero to it
-    //and check for errors.
-    lseek(fd, START_FLAG, SEEK_SET);
-    status = write(fd, &data, sizeof(data));
-    if(status == -1) return -1;
+    if(fd == mapped_fd) {
+        mapped_registers[START_FLAG / 4] = 0;
+        mapped_registers[START_NUMBER / 4] = 0;
+        return 0;
+    }
 
-    //There is no need to seek to the next register value since the previous write
-    //operation will already have moved the file pointer
-    status = write(fd, &data, sizeof(data));
-    if(status == -1) return -1;
+    //START_FLAG and START_NUMBER are next to each other so both can be
+    //cleared with a single positional write.
+    status = registers_pwrite(fd, zeros, sizeof(zeros), START_FLAG);
+    if(status != sizeof(zeros)) return -1;
 
     return 0;
 }
@@ -49,11 +207,15 @@ int clear_registers(int fd) {
 int read_register(int fd, int reg_offset, uint32_t *value) {
     int read_count;
 
-    //Move to the offset of the register
-    lseek(fd, reg_offset, SEEK_SET);
+    //Fast path, read the register straight from the mapping
+    if(fd == mapped_fd) {
+        *value = mapped_registers[reg_offset / 4];
+        return 0;
+    }
 
-    //Read the value
-    read_count = read(fd, value, sizeof(uint32_t));
+    //Read the value at the offset of the register. pread does not need
+    //the file position so no lseek is required.
+    read_count = registers_pread(fd, value, sizeof(uint32_t), reg_offset);
     //Check that the correct amount of data was read. (32 bit == 4 bytes)
     if(read_count != 4) return -1;
 
@@ -73,10 +235,14 @@ int write_register(int fd, int reg_offset, uint32_t value) {
     
     int write_count;
 
-    //Move to the correct register offset
-    lseek(fd, reg_offset, SEEK_SET);
-    //Write the value
-    write_count = write(fd, &value, sizeof(uint32_t));
+    //Fast path, write the register straight through the mapping
+    if(fd == mapped_fd) {
+        mapped_registers[reg_offset / 4] = value;
+        return 0;
+    }
+
+    //Write the value at the correct register offset
+    write_count = registers_pwrite(fd, &value, sizeof(uint32_t), reg_offset);
 
     //Check that the correct amount of data was written. (32 bit == 4 bytes)
     if(write_count != 4) return -1;
@@ -88,6 +254,58 @@ int write_register(int fd, int reg_offset, uint32_t value) {
 //High-level API
 ////////////////////////////////////////////////////
 
+//Prime index that answers the blocking searches while it is loaded
+static struct prime_index loaded_index;
+static int index_loaded = 0;
+
+/*
+    Loads a prime index built with build_prime_index. While it is loaded
+    find_prime(), find_prime_wait() and find_primes_batch() answer from it
+    and only go to the device when no index is loaded.
+
+    Paramaters:
+        path    -> Path of the index file.
+    Return:
+        On success zero is returned, on failure a negative
+        value is returned and the device keeps being used.
+*/
+int load_prime_index(const char *path) {
+    unload_prime_index();
+
+    if(prime_index_open(&loaded_index, path) != 0) {
+        return -1;
+    }
+    index_loaded = 1;
+
+    return 0;
+}
+
+/*
+    Unloads the prime index so that searches go to the device again.
+*/
+void unload_prime_index(void) {
+    if(!index_loaded) {
+        return;
+    }
+
+    prime_index_close(&loaded_index);
+    index_loaded = 0;
+}
+
+/*
+    Answers a search from the loaded index. Like the device it reports 0
+    when there is no prime left below 2^32.
+
+    Paramaters:
+        start_val       -> Value to start the prime search from.
+        search_result   -> Pointer to where the result should be stored.
+*/
+static void index_search(uint32_t start_val, uint32_t *search_result) {
+    if(prime_index_next(&loaded_index, start_val, search_result) == 0) {
+        *search_result = 0;
+    }
+}
+
 
 /*
     Starts a search by writting to the start search register
@@ -102,12 +320,22 @@ int write_register(int fd, int reg_offset, uint32_t value) {
 */
 int start_search(int fd, uint32_t start_val) {
     const uint32_t start_flag = 1;
+    uint32_t registers[2] = {start_flag, start_val};
     int status;
 
-    status = write_register(fd, START_NUMBER, start_val);
-    if(status == -1) return -1;
-    status = write_register(fd, START_FLAG, start_flag);
-    if(status == -1) return -1;
+    if(fd == mapped_fd) {
+        status = write_register(fd, START_NUMBER, start_val);
+        if(status == -1) return -1;
+        status = write_register(fd, START_FLAG, start_flag);
+        if(status == -1) return -1;
+
+        return 0;
+    }
+
+    //The driver writes a burst from the highest register down, so the
+    //start value lands before the start flag with a single system call.
+    status = registers_pwrite(fd, registers, sizeof(registers), START_FLAG);
+    if(status != sizeof(registers)) return -1;
 
     return 0;
 }
@@ -160,6 +388,85 @@ int read_result(int fd, uint32_t *result) {
 }
 
 
+//Argument of the status command. Mirrored in file_ops.c.
+struct ioctl_status_struct {
+    uint32_t done_flag;
+    uint32_t search_result;
+    uint64_t cycles;
+};
+
+/*
+    Reads the cycle count from the register mapping. The high half is
+    read again after the low half and the low half is read again if the
+    high half changed in between, so the two halves always match.
+
+    Return:
+        The cycle count.
+*/
+static uint64_t mapped_cycle_count(void) {
+    uint32_t upper_bits = mapped_registers[CYCLE_COUNT_HIGH / 4];
+    uint32_t lower_bits = mapped_registers[CYCLE_COUNT_LOW / 4];
+    uint32_t upper_again = mapped_registers[CYCLE_COUNT_HIGH / 4];
+
+    if(upper_again != upper_bits) {
+        lower_bits = mapped_registers[CYCLE_COUNT_LOW / 4];
+        upper_bits = upper_again;
+    }
+
+    return ((uint64_t)upper_bits << 32) | lower_bits;
+}
+
+/*
+    Reads a consistent snapshot of the status registers of the previous
+    search. Without a register mapping this is a single ioctl() system
+    call, which makes it the cheapest way to poll.
+
+    Paramaters:
+        fd              -> File descriptor of the drivers device file.
+        status          -> Set to the done flag, the search result and the
+                           cycle count.
+
+    Return:
+        On success zero is returned, on failure a negative
+        value is returned.
+*/
+int read_status(int fd, struct prime_status *status) {
+    struct ioctl_status_struct user_space_struct;
+    uint32_t registers[4];
+
+    if(fd == mapped_fd) {
+        //The done flag is read first since the result and cycle count do
+        //not change once it is set
+        status->done = (mapped_registers[DONE_FLAG / 4] == 1) ? 1 : 0;
+        status->result = mapped_registers[PRIME_NUMBER / 4];
+        status->cycles = mapped_cycle_count();
+        return 0;
+    }
+
+    device_calls++;
+    if(emulator_is_emulated(fd)) {
+        //The emulator copies its registers under a lock so they never tear
+        if(emulator_read(fd, DONE_FLAG, registers, sizeof(registers)) != sizeof(registers)) {
+            return -1;
+        }
+
+        status->done = (registers[0] == 1) ? 1 : 0;
+        status->result = registers[1];
+        status->cycles = ((uint64_t)registers[2] << 32) | registers[3];
+        return 0;
+    }
+
+    if(ioctl(fd, IOCTL_READ_STATUS, &user_space_struct) != 0) {
+        return -1;
+    }
+
+    status->done = (user_space_struct.done_flag == 1) ? 1 : 0;
+    status->result = user_space_struct.search_result;
+    status->cycles = user_space_struct.cycles;
+
+    return 0;
+}
+
 /*
     Reads the number of cycles taken to complete the previous prime
     number search.
@@ -174,21 +481,43 @@ int read_result(int fd, uint32_t *result) {
         value is returned.
 */
 int read_cycle_count(int fd, uint64_t *cycles) {
-    uint32_t upper_bits = 0, lower_bits = 0;
-    int status = 0;
+    struct prime_status status;
 
-    status = read_register(fd, CYCLE_COUNT_HIGH, &upper_bits);
-    if(status != 0) {
+    //Both halves come from the same snapshot so they cannot tear
+    if(read_status(fd, &status) != 0) {
         return -1;
     }
 
-    status = read_register(fd, CYCLE_COUNT_LOW, &lower_bits);
-    if(status != 0) {
+    *cycles = status.cycles;
+
+    return 0;
+}
+
+/*
+    Reads the done flag, the search result and the cycle count of the
+    previous search together. The same as read_status() with the fields
+    returned separately.
+
+    Paramaters:
+        fd              -> File descriptor of the drivers device file.
+        search_status   -> Set to 1 if the search has completed.
+        result          -> Result register value.
+        cycles          -> Cycle count of the search.
+
+    Return:
+        On success zero is returned, on failure a negative
+        value is returned.
+*/
+int read_search_registers(int fd, uint32_t *search_status, uint32_t *result, uint64_t *cycles) {
+    struct prime_status status;
+
+    if(read_status(fd, &status) != 0) {
         return -1;
     }
 
-    //Combine the upper and lower register values
-    *cycles = ( ((uint64_t)upper_bits << 32) | lower_bits );
+    *search_status = status.done;
+    *result = status.result;
+    *cycles = status.cycles;
 
     return 0;
 }
@@ -201,9 +530,29 @@ struct ioctl_struct {
     uint32_t search_result;
 };
 
+//Argument of the search command with a wait mode and a timeout in ms.
+//Mirrored in file_ops.c.
+struct ioctl_wait_struct {
+    uint32_t start_val;
+    uint32_t search_result;
+    uint32_t wait_mode;
+    uint32_t timeout_ms;
+};
+
+//Argument of the batch search command. Mirrored in file_ops.c. The
+//array pointers are passed as 64 bit integers so that the layout does
+//not depend on the pointer size of the process.
+struct ioctl_batch_struct {
+    uint64_t start_vals;
+    uint64_t search_results;
+    uint32_t count;
+    uint32_t completed;
+};
+
 /*
     Starts a blocking prime search where the search completion will be
-    signaled by an interrupt.
+    signaled by an interrupt. Answered from the prime index instead when
+    one has been loaded with load_prime_index().
 
     Paramaters:
         fd              -> File descriptor of the drivers device file.
@@ -220,16 +569,830 @@ int find_prime(int fd, uint32_t start_val, uint32_t *search_result) {
     struct ioctl_struct user_space_struct;
     user_space_struct.start_val = start_val;
 
+    //A loaded index answers without a round trip to the device
+    if(index_loaded) {
+        index_search(start_val, search_result);
+        return 0;
+    }
+
+    device_calls++;
+    if(emulator_is_emulated(fd)) {
+        status = emulator_find_prime(fd, start_val, search_result);
+        if(status == 0) {
+            verify_result(start_val, *search_result);
+        }
+        return status;
+    }
+
     //This function will block until the device raises an
     //interrupt to indicate the search is complete.
-    status = ioctl(fd, 0, &user_space_struct);
+    status = ioctl(fd, IOCTL_FIND_PRIME, &user_space_struct);
 
     if(status == 0) {
         //Retreive the search result from the structure.
         *search_result = user_space_struct.search_result;
+        verify_result(start_val, *search_result);
         return 0;
     }
     else {
         return -1;
     }
+}
+
+/*
+    Runs a blocking prime search with IOCTL_FIND_PRIME_WAIT, or on the
+    emulator, which has no interrupt so every wait mode behaves the same
+    and never times out.
+
+    Paramaters:
+        fd              -> File descriptor of the drivers device file.
+        start_val       -> Value to start the prime search from.
+        wait_mode       -> One of the WAIT_MODE_* values.
+        timeout_ms      -> Longest time to wait for the result, or 0 for
+                           the driver's default.
+        search_result   -> Pointer to where the result of the search
+                           should be stored.
+    Return:
+        On success zero is returned, on failure a negative
+        value is returned.
+*/
+static int run_wait_search(int fd, uint32_t start_val, uint32_t wait_mode, uint32_t timeout_ms,
+                           uint32_t *search_result) {
+    struct ioctl_wait_struct user_space_struct;
+    int status;
+
+    if(index_loaded) {
+        index_search(start_val, search_result);
+        return 0;
+    }
+
+    device_calls++;
+    if(emulator_is_emulated(fd)) {
+        status = emulator_find_prime(fd, start_val, search_result);
+        if(status == 0) {
+            verify_result(start_val, *search_result);
+        }
+        return status;
+    }
+
+    user_space_struct.start_val = start_val;
+    user_space_struct.search_result = 0;
+    user_space_struct.wait_mode = wait_mode;
+    user_space_struct.timeout_ms = timeout_ms;
+
+    status = ioctl(fd, IOCTL_FIND_PRIME_WAIT, &user_space_struct);
+    if(status != 0) {
+        return -1;
+    }
+
+    *search_result = user_space_struct.search_result;
+    verify_result(start_val, *search_result);
+    return 0;
+}
+
+/*
+    Starts a blocking prime search and picks how the driver waits for it.
+    WAIT_MODE_HYBRID spins on the done flag for searches the driver expects
+    to be short, which saves the interrupt and wakeup latency, and sleeps
+    on the interrupt for long ones. WAIT_MODE_DEFAULT uses the driver's
+    wait_mode module parameter.
+
+    Paramaters:
+        fd              -> File descriptor of the drivers device file.
+        start_val       -> Value to start the prime search from.
+        wait_mode       -> One of the WAIT_MODE_* values.
+        search_result   -> Pointer to where the result of the search
+                           should be stored.
+    Return:
+        On success zero is returned, on failure a negative
+        value is returned.
+*/
+int find_prime_wait(int fd, uint32_t start_val, uint32_t wait_mode, uint32_t *search_result) {
+    return run_wait_search(fd, start_val, wait_mode, 0, search_result);
+}
+
+/*
+    Starts a blocking prime search that gives up after a timeout. Without
+    a timeout the driver waits for its search_timeout_ms module parameter.
+    A search that times out is taken off the device's queue, or abandoned
+    if it is already running.
+
+    Paramaters:
+        fd              -> File descriptor of the drivers device file.
+        start_val       -> Value to start the prime search from.
+        timeout_ms      -> Longest time to wait for the result, or 0 for
+                           the driver's default.
+        search_result   -> Pointer to where the result of the search
+                           should be stored.
+    Return:
+        On success zero is returned, on failure a negative value is
+        returned. errno is ETIMEDOUT when the search timed out and
+        ECANCELED when it was cancelled with cancel_searches().
+*/
+int find_prime_timeout(int fd, uint32_t start_val, uint32_t timeout_ms, uint32_t *search_result) {
+    return run_wait_search(fd, start_val, WAIT_MODE_DEFAULT, timeout_ms, search_result);
+}
+
+/*
+    Cancels every blocking search that was started through a file
+    descriptor and has not finished yet. Called from another thread than
+    the ones blocked in the searches, which fail with errno ECANCELED.
+
+    Paramaters:
+        fd  -> File descriptor of the drivers device file.
+    Return:
+        The number of searches cancelled, or a negative value on failure.
+*/
+int cancel_searches(int fd) {
+    int status;
+
+    //Emulated searches finish within the call that started them
+    device_calls++;
+    if(emulator_is_emulated(fd)) {
+        return 0;
+    }
+
+    status = ioctl(fd, IOCTL_CANCEL, 0);
+    if(status < 0) {
+        return -1;
+    }
+
+    return status;
+}
+
+/*
+    Resets the device in place, which takes milliseconds instead of the
+    seconds of removing it and rescanning the bus. Searches that are
+    waiting or running are kept and finish after the reset, and open file
+    descriptors stay valid. Needs CAP_SYS_ADMIN.
+
+    Paramaters:
+        fd  -> File descriptor of the drivers device file.
+    Return:
+        On success zero is returned, on failure a negative
+        value is returned.
+*/
+int reset_device(int fd) {
+    //The emulator never stalls, clearing its registers is all a reset does
+    if(emulator_is_emulated(fd)) {
+        return clear_registers(fd);
+    }
+
+    device_calls++;
+    if(ioctl(fd, IOCTL_RESET, 0) != 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+    Runs a batch of blocking prime searches with a single system call.
+    The driver runs the searches back-to-back and only returns once all
+    of them have finished.
+
+    Paramaters:
+        fd              -> File descriptor of the drivers device file.
+        start_vals      -> Array of values to start each search from.
+        search_results  -> Array where the result of each search should
+                           be stored. Must hold count entries.
+        count           -> Number of searches in the batch.
+    Return:
+        On success zero is returned, on failure a negative
+        value is returned.
+*/
+int find_primes_batch(int fd, const uint32_t *start_vals, uint32_t *search_results, uint32_t count) {
+    int status;
+    uint32_t i;
+
+    struct ioctl_batch_struct user_space_struct;
+
+    if(index_loaded) {
+        for(i = 0; i < count; i++) {
+            index_search(start_vals[i], &search_results[i]);
+        }
+        return 0;
+    }
+
+    device_calls++;
+    if(emulator_is_emulated(fd)) {
+        for(i = 0; i < count; i++) {
+            if(emulator_find_prime(fd, start_vals[i], &search_results[i]) != 0) {
+                return -1;
+            }
+        }
+        verify_results(start_vals, search_results, count);
+        return 0;
+    }
+
+    user_space_struct.start_vals = (uint64_t) (uintptr_t) start_vals;
+    user_space_struct.search_results = (uint64_t) (uintptr_t) search_results;
+    user_space_struct.count = count;
+    user_space_struct.completed = 0;
+
+    //Blocks until every search in the batch has completed
+    status = ioctl(fd, IOCTL_FIND_PRIMES_BATCH, &user_space_struct);
+
+    if(status == 0 && user_space_struct.completed == count) {
+        verify_results(start_vals, search_results, count);
+        return 0;
+    }
+    else {
+        return -1;
+    }
+}
+
+/*
+    Starts a blocking prime search from a 64 bit value. Values up to
+    MAX_DEVICE_PRIME are searched by find_prime() and larger ones on the CPU.
+
+    Paramaters:
+        fd              -> File descriptor of the drivers device file.
+        start_val       -> Value to start the prime search from.
+        search_result   -> Pointer to where the result of the search
+                           should be stored. Set to 0 when there is no
+                           prime left below 2^64.
+    Return:
+        On success zero is returned, on failure a negative
+        value is returned.
+*/
+int find_prime64(int fd, uint64_t start_val, uint64_t *search_result) {
+    uint32_t device_result;
+
+    //Past MAX_DEVICE_PRIME the answer does not fit in PRIME_NUMBER
+    if(start_val > MAX_DEVICE_PRIME) {
+        return cpu_find_prime64(start_val, search_result);
+    }
+
+    if(find_prime(fd, (uint32_t) start_val, &device_result) != 0) {
+        return -1;
+    }
+
+    *search_result = device_result;
+    return 0;
+}
+
+/*
+    Runs a batch of prime searches from 64 bit values. The values up to
+    MAX_DEVICE_PRIME go to the device as one find_primes_batch() call and
+    the rest are split between the CPU's threads.
+
+    Paramaters:
+        fd              -> File descriptor of the drivers device file.
+        start_vals      -> Array of values to start each search from.
+        search_results  -> Array where the result of each search should
+                           be stored. Must hold count entries.
+        count           -> Number of searches in the batch.
+    Return:
+        On success zero is returned, on failure a negative
+        value is returned.
+*/
+int find_primes_batch64(int fd, const uint64_t *start_vals, uint64_t *search_results, uint32_t count) {
+    uint32_t *device_vals, *device_results, *slots;
+    uint64_t *cpu_vals, *cpu_results;
+    uint32_t device_count = 0, cpu_count = 0, i;
+    int status = 0;
+
+    if(count == 0) {
+        return 0;
+    }
+
+    //One allocation holds both halves of the batch. slots maps the device
+    //searches from the front and the CPU searches from the back to their
+    //place in the batch.
+    cpu_vals = malloc((size_t) count * (2 * sizeof(uint64_t) + 3 * sizeof(uint32_t)));
+    if(cpu_vals == NULL) {
+        return -1;
+    }
+    cpu_results = cpu_vals + count;
+    device_vals = (uint32_t*) (cpu_results + count);
+    device_results = device_vals + count;
+    slots = device_results + count;
+
+    for(i = 0; i < count; i++) {
+        if(start_vals[i] > MAX_DEVICE_PRIME) {
+            cpu_vals[cpu_count] = start_vals[i];
+            slots[count - 1 - cpu_count] = i;
+            cpu_count++;
+        }
+        else {
+            device_vals[device_count] = (uint32_t) start_vals[i];
+            slots[device_count] = i;
+            device_count++;
+        }
+    }
+
+    if(device_count > 0 && find_primes_batch(fd, device_vals, device_results, device_count) != 0) {
+        status = -1;
+    }
+    if(status == 0 && cpu_count > 0 && cpu_find_primes64_batch(cpu_vals, cpu_results, cpu_count) != 0) {
+        status = -1;
+    }
+
+    if(status == 0) {
+        for(i = 0; i < device_count; i++) {
+            search_results[slots[i]] = device_results[i];
+        }
+        for(i = 0; i < cpu_count; i++) {
+            search_results[slots[count - 1 - i]] = cpu_results[i];
+        }
+    }
+
+    free(cpu_vals);
+    return status;
+}
+
+//Argument of the range search command. Mirrored in file_ops.c.
+struct ioctl_range_struct {
+    uint64_t results;
+    uint64_t high;
+    uint64_t next;
+    uint64_t cycles;
+    uint32_t low;
+    uint32_t capacity;
+    uint32_t count;
+    uint32_t reserved;
+};
+
+//Number of primes stream_primes_in_range() collects before writing them out
+#define STREAM_CHUNK_SIZE 4096
+
+/*
+    Finds every prime in [low, high). The driver starts each search from the
+    previous result straight from its interrupt handler, so the device stays
+    busy without a round trip to the process per prime.
+
+    Paramaters:
+        fd              -> File descriptor of the drivers device file.
+        low             -> First value of the range.
+        high            -> End of the range, which is not included. At most
+                           2^32.
+        primes          -> Array the primes are stored in.
+        capacity        -> Number of entries in primes.
+        count           -> Set to the number of primes stored.
+        stats           -> Set to the throughput of the search. May be NULL.
+    Return:
+        0 once the whole range has been searched, 1 if primes filled up
+        first, in which case the range continues after the last prime, and a
+        negative value on failure.
+*/
+int find_primes_in_range(int fd, uint32_t low, uint64_t high, uint32_t *primes, uint32_t capacity,
+                         uint32_t *count, struct range_stats *stats) {
+    struct ioctl_range_struct user_space_struct;
+    uint64_t start_ns = now_ns();
+    uint64_t next = low;
+    uint64_t cycles = 0;
+    uint64_t search_cycles;
+    uint32_t prime;
+    int status = 0;
+
+    *count = 0;
+    if(high > (1ull << 32)) {
+        return -1;
+    }
+
+    if(index_loaded || emulator_is_emulated(fd)) {
+        //One search at a time, each from the previous result
+        while(next < high && *count < capacity) {
+            if(index_loaded) {
+                if(prime_index_next(&loaded_index, (uint32_t) next, &prime) == 0) break;
+            }
+            else {
+                device_calls++;
+                if(emulator_find_prime(fd, (uint32_t) next, &prime) != 0 ||
+                   read_cycle_count(fd, &search_cycles) != 0) {
+                    status = -1;
+                    break;
+                }
+                cycles += search_cycles;
+            }
+
+            //The device wraps around to 0 once no prime is left
+            if(prime < next || prime >= high) break;
+
+            primes[(*count)++] = prime;
+            next = (uint64_t) prime + 1;
+        }
+        if(status == 0 && *count < capacity) {
+            next = high;
+        }
+    }
+    else {
+        user_space_struct.results = (uint64_t) (uintptr_t) primes;
+        user_space_struct.high = high;
+        user_space_struct.next = low;
+        user_space_struct.cycles = 0;
+        user_space_struct.low = low;
+        user_space_struct.capacity = capacity;
+        user_space_struct.count = 0;
+        user_space_struct.reserved = 0;
+
+        device_calls++;
+        if(ioctl(fd, IOCTL_FIND_PRIMES_RANGE, &user_space_struct) != 0) {
+            status = -1;
+        }
+        *count = user_space_struct.count;
+        next = user_space_struct.next;
+        cycles = user_space_struct.cycles;
+    }
+
+    //Primes from the index are not the device's
+    if(!index_loaded) {
+        verify_range(low, primes, *count);
+    }
+
+    if(stats != NULL) {
+        stats->primes = *count;
+        stats->cycles = cycles;
+        stats->elapsed_ns = now_ns() - start_ns;
+    }
+
+    if(status != 0) {
+        return -1;
+    }
+
+    return next < high ? 1 : 0;
+}
+
+/*
+    Writes a whole buffer to a file descriptor.
+
+    Paramaters:
+        out_fd  -> File descriptor to write to.
+        buffer  -> Data to write.
+        length  -> Number of bytes to write.
+    Return:
+        0 on success and a negative value on failure.
+*/
+static int write_all(int out_fd, const char *buffer, size_t length) {
+    ssize_t written;
+
+    while(length > 0) {
+        written = write(out_fd, buffer, length);
+        if(written < 0) {
+            return -1;
+        }
+        buffer += written;
+        length -= written;
+    }
+
+    return 0;
+}
+
+/*
+    Finds every prime in [low, high) and writes them to a file descriptor as
+    decimal text, one per line.
+
+    Paramaters:
+        fd              -> File descriptor of the drivers device file.
+        low             -> First value of the range.
+        high            -> End of the range, which is not included. At most
+                           2^32.
+        out_fd          -> File descriptor the primes are written to.
+        stats           -> Set to the throughput of the search. May be NULL.
+    Return:
+        On success zero is returned, on failure a negative
+        value is returned.
+*/
+int stream_primes_in_range(int fd, uint32_t low, uint64_t high, int out_fd, struct range_stats *stats) {
+    uint32_t primes[STREAM_CHUNK_SIZE];
+    char *text;
+    struct range_stats chunk_stats;
+    uint64_t start_ns = now_ns();
+    uint64_t total_primes = 0;
+    uint64_t total_cycles = 0;
+    uint32_t count;
+    uint32_t i;
+    size_t length;
+    int status;
+
+    //Every prime takes at most 11 characters with its newline. The buffer
+    //belongs to the call so threads can stream at the same time.
+    text = malloc(STREAM_CHUNK_SIZE * 11);
+    if(text == NULL) {
+        return -1;
+    }
+
+    do {
+        status = find_primes_in_range(fd, low, high, primes, STREAM_CHUNK_SIZE, &count, &chunk_stats);
+        if(status < 0) {
+            free(text);
+            return -1;
+        }
+        total_primes += chunk_stats.primes;
+        total_cycles += chunk_stats.cycles;
+
+        length = 0;
+        for(i = 0; i < count; i++) {
+            length += sprintf(text + length, "%u\n", primes[i]);
+        }
+        if(write_all(out_fd, text, length) != 0) {
+            free(text);
+            return -1;
+        }
+
+        //A full buffer means the range continues after its last prime
+        if(status == 1) {
+            low = primes[count - 1] + 1;
+        }
+    } while(status == 1);
+
+    free(text);
+
+    if(stats != NULL) {
+        stats->primes = total_primes;
+        stats->cycles = total_cycles;
+        stats->elapsed_ns = now_ns() - start_ns;
+    }
+
+    return 0;
+}
+
+////////////////////////////////////////////////////
+//Event API
+////////////////////////////////////////////////////
+
+/*
+    Takes the result of a search started with start_search() without
+    blocking. Together with start_search() this is the non-blocking submit
+    path for callers that wait on the device from an event loop.
+
+    Paramaters:
+        fd              -> File descriptor of the drivers device file.
+        result          -> Pointer to where the result should be stored.
+    Return:
+        1 if the search has finished and result was set, 0 if it is still
+        running and a negative value on failure.
+*/
+int reap_search(int fd, uint32_t *result) {
+    uint32_t search_status;
+    int status;
+
+    status = check_complete(fd, &search_status);
+    if(status != 0) {
+        return -1;
+    }
+
+    if(search_status != 1) {
+        return 0;
+    }
+
+    status = read_result(fd, result);
+    if(status != 0) {
+        return -1;
+    }
+
+    return 1;
+}
+
+/*
+    Waits for the device file to become readable.
+
+    Paramaters:
+        fd              -> File descriptor of the drivers device file.
+        timeout_ms      -> Longest time to wait in milliseconds, or -1 to
+                           wait forever.
+    Return:
+        1 if the file is readable, 0 on timeout and a negative value on
+        failure.
+*/
+static int wait_readable(int fd, int timeout_ms) {
+    struct pollfd pfd;
+    int status;
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+
+    device_calls++;
+    status = poll(&pfd, 1, timeout_ms);
+    if(status < 0 || (pfd.revents & (POLLERR | POLLHUP))) {
+        return -1;
+    }
+
+    return status > 0 ? 1 : 0;
+}
+
+/*
+    Waits until the search started with start_search() finishes. The
+    caller sleeps until the device's interrupt fires instead of polling
+    the registers.
+
+    Paramaters:
+        fd              -> File descriptor of the drivers device file.
+        timeout_ms      -> Longest time to wait in milliseconds, or -1 to
+                           wait forever.
+    Return:
+        1 if the search has finished, 0 on timeout and a negative value
+        on failure.
+*/
+int wait_search(int fd, int timeout_ms) {
+    if(emulator_is_emulated(fd)) {
+        device_calls++;
+        return emulator_wait_done(fd, timeout_ms);
+    }
+
+    //The driver reports the file as readable once DONE_FLAG is set
+    return wait_readable(fd, timeout_ms);
+}
+
+/*
+    Registers an eventfd that the driver signals every time the device
+    raises its interrupt, so an event loop can watch it next to its other
+    file descriptors. The device file itself can also be watched with
+    poll() or epoll.
+
+    Paramaters:
+        fd              -> File descriptor of the drivers device file.
+        event_fd        -> File descriptor from eventfd(), or -1 to
+                           unregister the current one.
+    Return:
+        On success zero is returned, on failure a negative
+        value is returned.
+*/
+int set_search_eventfd(int fd, int event_fd) {
+    device_calls++;
+    if(emulator_is_emulated(fd)) {
+        return emulator_set_eventfd(fd, event_fd);
+    }
+
+    if(ioctl(fd, IOCTL_SET_EVENTFD, event_fd) != 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+////////////////////////////////////////////////////
+//Ring API
+////////////////////////////////////////////////////
+
+//Submission queue entry. Mirrored in ring.h.
+struct ring_sqe {
+    uint64_t user_data;
+    uint32_t start_val;
+    uint32_t reserved;
+};
+
+//Layout of the pages shared with the driver. This structure is mirrored in
+//ring.h but uses the kernels internal integer definitions. The completion
+//entries use struct ring_completion from prime.h which has the same layout
+//as the driver's completion entries.
+struct ring_shared {
+    uint32_t sq_head;
+    uint32_t sq_tail;
+    uint32_t cq_head;
+    uint32_t cq_tail;
+    uint32_t flags;
+    uint32_t reserved[3];
+    struct ring_sqe sq[RING_ENTRIES];
+    struct ring_completion cq[RING_ENTRIES];
+};
+
+/*
+    Maps the submission and completion rings of the device file.
+
+    Paramaters:
+        fd              -> File descriptor of the drivers device file.
+        ring            -> Handle to initialize.
+    Return:
+        On success zero is returned, on failure a negative
+        value is returned.
+*/
+int ring_setup(int fd, struct prime_ring *ring) {
+    long page_size = sysconf(_SC_PAGESIZE);
+    void *map;
+
+    //The rings live in the driver
+    if(emulator_is_emulated(fd)) {
+        return -1;
+    }
+
+    //Round the mapping up to whole pages
+    ring->map_size = (sizeof(struct ring_shared) + page_size - 1) & ~(page_size - 1);
+
+    map = mmap(NULL, ring->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+               (off_t) RING_MMAP_PAGE_OFFSET * page_size);
+    if(map == MAP_FAILED) {
+        return -1;
+    }
+
+    ring->fd = fd;
+    ring->shared = (struct ring_shared*) map;
+
+    return 0;
+}
+
+/*
+    Queues a search. The driver is only entered when the device has run
+    out of work, otherwise the search is picked up by the interrupt handler
+    as soon as the device finishes the one before it.
+
+    Paramaters:
+        ring            -> Ring handle.
+        start_val       -> Value to start the prime search from.
+        user_data       -> Value handed back with the completion.
+    Return:
+        On success zero is returned, on failure or when the submission
+        ring is full a negative value is returned.
+*/
+int ring_submit(struct prime_ring *ring, uint32_t start_val, uint64_t user_data) {
+    struct ring_shared *shared = ring->shared;
+    uint32_t tail = shared->sq_tail;
+    uint32_t head = __atomic_load_n(&shared->sq_head, __ATOMIC_ACQUIRE);
+    struct ring_sqe *sqe;
+
+    if(tail - head >= RING_ENTRIES) {
+        return -1;
+    }
+
+    sqe = &shared->sq[tail & (RING_ENTRIES - 1)];
+    sqe->user_data = user_data;
+    sqe->start_val = start_val;
+    __atomic_store_n(&shared->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    //The tail has to be visible before the flag is read. The driver does
+    //the same in the opposite order so that a submission is never missed.
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if(__atomic_load_n(&shared->flags, __ATOMIC_RELAXED) & RING_FLAG_NEED_WAKEUP) {
+        device_calls++;
+        if(ioctl(ring->fd, IOCTL_RING_ENTER, 0) != 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+    Takes the next completion off the completion ring without blocking.
+
+    Paramaters:
+        ring            -> Ring handle.
+        completion      -> Pointer to where the completion should be stored.
+    Return:
+        1 if a completion was returned, 0 if the ring was empty and a
+        negative value on failure.
+*/
+int ring_reap(struct prime_ring *ring, struct ring_completion *completion) {
+    struct ring_shared *shared = ring->shared;
+    uint32_t head = shared->cq_head;
+    uint32_t tail = __atomic_load_n(&shared->cq_tail, __ATOMIC_ACQUIRE);
+
+    if(head == tail) {
+        return 0;
+    }
+
+    *completion = shared->cq[head & (RING_ENTRIES - 1)];
+    __atomic_store_n(&shared->cq_head, head + 1, __ATOMIC_RELEASE);
+
+    //The driver stops when the completion ring fills up. Restart it now
+    //that there is room again.
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if((__atomic_load_n(&shared->flags, __ATOMIC_RELAXED) & RING_FLAG_NEED_WAKEUP) &&
+       __atomic_load_n(&shared->sq_head, __ATOMIC_RELAXED) != shared->sq_tail) {
+        device_calls++;
+        if(ioctl(ring->fd, IOCTL_RING_ENTER, 0) != 0) {
+            return -1;
+        }
+    }
+
+    return 1;
+}
+
+/*
+    Waits until the completion ring holds at least one completion.
+
+    Paramaters:
+        ring            -> Ring handle.
+        timeout_ms      -> Longest time to wait in milliseconds, or -1 to
+                           wait forever.
+    Return:
+        1 if a completion is ready, 0 on timeout and a negative value on
+        failure.
+*/
+int ring_wait(struct prime_ring *ring, int timeout_ms) {
+    struct ring_shared *shared = ring->shared;
+
+    //Skip the system call when a completion is already waiting
+    if(shared->cq_head != __atomic_load_n(&shared->cq_tail, __ATOMIC_ACQUIRE)) {
+        return 1;
+    }
+
+    //The driver reports a file with rings as readable while the
+    //completion ring is not empty
+    return wait_readable(ring->fd, timeout_ms);
+}
+
+/*
+    Unmaps the rings. Searches that are still queued are dropped when the
+    device file is closed.
+
+    Paramaters:
+        ring            -> Ring handle.
+*/
+void ring_teardown(struct prime_ring *ring) {
+    munmap(ring->shared, ring->map_size);
+    ring->shared = NULL;
 }
\ No newline at end of file
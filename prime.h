@@ -5,10 +5,86 @@ int clear_registers(int fd);
 int read_register(int fd, int reg_offset, uint32_t *value);
 int write_register(int fd, int reg_offset, uint32_t value);
 
+/*
+    Maps BAR0 of the device into the process so that all further register
+    accesses on fd, including the high-level API, are plain loads and
+    stores. Other file descriptors keep using the system call path.
+
+    Parameters:
+        fd  -> File descriptor of the device file.
+
+    Return:
+        0 on success and a negative value otherwise.
+*/
+int map_registers(int fd);
+
+/*
+    Unmaps BAR0 and returns to the system call path.
+*/
+void unmap_registers(void);
+
+//Path that open_device() treats as a request for the software emulator
+#define PRIME_EMULATED_PATH "emulated"
+
+/*
+    Opens a prime finder. The software emulator in emulator.c is used
+    instead of the device file when path is PRIME_EMULATED_PATH or the
+    PRIME_FINDER_EMULATE environment variable is set to 1. The returned
+    file descriptor works with the whole API either way, except for the
+    ring API which needs the driver.
+
+    Paramaters:
+        path    -> Path of the device file, e.g. /dev/prime_finder.
+
+    Return:
+        A file descriptor on success and a negative value otherwise.
+*/
+int open_device(const char *path);
+
+/*
+    Closes a file descriptor returned by open_device().
+
+    Paramaters:
+        fd  -> File descriptor to close.
+
+    Return:
+        0 on success and a negative value otherwise.
+*/
+int close_device(int fd);
+
+/*
+    Returns the number of device system calls the calling thread has made
+    through the library. Calls on an emulated device count as the system
+    call they stand in for. Benchmarks use it to report system calls per
+    search.
+
+    Return:
+        The number of calls.
+*/
+uint64_t device_call_count(void);
+
 ////////////////////////////////////////////////////
 //High-level API
 ////////////////////////////////////////////////////
 
+/*
+    Loads a prime index built with build_prime_index. While it is loaded
+    find_prime(), find_prime_wait() and find_primes_batch() answer from it
+    and only go to the device when no index is loaded.
+
+    Paramaters:
+        path    -> Path of the index file.
+    Return:
+        On success zero is returned, on failure a negative
+        value is returned and the device keeps being used.
+*/
+int load_prime_index(const char *path);
+
+/*
+    Unloads the prime index so that searches go to the device again.
+*/
+void unload_prime_index(void);
+
 /*
     Starts a search by writting to the start search register
     on the device.
@@ -51,6 +127,32 @@ int check_complete(int fd, uint32_t *search_status);
 */
 int read_result(int fd, uint32_t *result);
 
+//Snapshot of the status registers of the previous search
+struct prime_status {
+    //1 if the search has completed
+    uint32_t done;
+    //Result register value
+    uint32_t result;
+    //Cycle count of the search
+    uint64_t cycles;
+};
+
+/*
+    Reads a consistent snapshot of the status registers of the previous
+    search. Without a register mapping this is a single ioctl() system
+    call, which makes it the cheapest way to poll.
+
+    Paramaters:
+        fd              -> File descriptor of the drivers device file.
+        status          -> Set to the done flag, the search result and the
+                           cycle count.
+
+    Return:
+        On success zero is returned, on failure a negative
+        value is returned.
+*/
+int read_status(int fd, struct prime_status *status);
+
 /*
     Reads the number of cycles taken to complete the previous prime
     number search.
@@ -66,16 +168,365 @@ int read_result(int fd, uint32_t *result);
 */
 int read_cycle_count(int fd, uint64_t *cycles);
 
+/*
+    Reads the done flag, the search result and the cycle count of the
+    previous search together. The same as read_status() with the fields
+    returned separately.
+
+    Paramaters:
+        fd              -> File descriptor of the drivers device file.
+        search_status   -> Set to 1 if the search has completed.
+        result          -> Result register value.
+        cycles          -> Cycle count of the search.
+
+    Return:
+        On success zero is returned, on failure a negative
+        value is returned.
+*/
+int read_search_registers(int fd, uint32_t *search_status, uint32_t *result, uint64_t *cycles);
+
 /*
     Starts a blocking prime search where the search completion will be
-    signaled by an interrupt.
+    signaled by an interrupt. Answered from the prime index instead when
+    one has been loaded with load_prime_index().
+
+    Paramaters:
+        fd              -> File descriptor of the drivers device file.
+        search_result   -> Pointer to where the result of the search
+                           should be stored.
+    Return:
+        On success zero is returned, on failure a negative
+        value is returned.
+*/
+int find_prime(int fd, uint32_t start_val, uint32_t *search_result);
+
+/*
+    Starts a blocking prime search and picks how the driver waits for it.
+    WAIT_MODE_HYBRID spins on the done flag for searches the driver expects
+    to be short, which saves the interrupt and wakeup latency, and sleeps
+    on the interrupt for long ones. WAIT_MODE_DEFAULT uses the driver's
+    wait_mode module parameter.
+
+    Paramaters:
+        fd              -> File descriptor of the drivers device file.
+        start_val       -> Value to start the prime search from.
+        wait_mode       -> One of the WAIT_MODE_* values.
+        search_result   -> Pointer to where the result of the search
+                           should be stored.
+    Return:
+        On success zero is returned, on failure a negative
+        value is returned.
+*/
+int find_prime_wait(int fd, uint32_t start_val, uint32_t wait_mode, uint32_t *search_result);
+
+/*
+    Starts a blocking prime search that gives up after a timeout. Without
+    a timeout the driver waits for its search_timeout_ms module parameter.
+    A search that times out is taken off the device's queue, or abandoned
+    if it is already running.
 
     Paramaters:
         fd              -> File descriptor of the drivers device file.
+        start_val       -> Value to start the prime search from.
+        timeout_ms      -> Longest time to wait for the result, or 0 for
+                           the driver's default.
         search_result   -> Pointer to where the result of the search
                            should be stored.
+    Return:
+        On success zero is returned, on failure a negative value is
+        returned. errno is ETIMEDOUT when the search timed out and
+        ECANCELED when it was cancelled with cancel_searches().
+*/
+int find_prime_timeout(int fd, uint32_t start_val, uint32_t timeout_ms, uint32_t *search_result);
+
+/*
+    Cancels every blocking search that was started through a file
+    descriptor and has not finished yet. Called from another thread than
+    the ones blocked in the searches, which fail with errno ECANCELED.
+
+    Paramaters:
+        fd  -> File descriptor of the drivers device file.
+    Return:
+        The number of searches cancelled, or a negative value on failure.
+*/
+int cancel_searches(int fd);
+
+/*
+    Resets the device in place, which takes milliseconds instead of the
+    seconds of removing it and rescanning the bus. Searches that are
+    waiting or running are kept and finish after the reset, and open file
+    descriptors stay valid. Needs CAP_SYS_ADMIN.
+
+    Paramaters:
+        fd  -> File descriptor of the drivers device file.
+    Return:
+        On success zero is returned, on failure a negative
+        value is returned.
+*/
+int reset_device(int fd);
+
+/*
+    Runs a batch of blocking prime searches with a single system call.
+
+    Paramaters:
+        fd              -> File descriptor of the drivers device file.
+        start_vals      -> Array of values to start each search from.
+        search_results  -> Array where the result of each search should
+                           be stored. Must hold count entries.
+        count           -> Number of searches in the batch.
+    Return:
+        On success zero is returned, on failure a negative
+        value is returned.
+*/
+int find_primes_batch(int fd, const uint32_t *start_vals, uint32_t *search_results, uint32_t count);
+
+//Largest prime below 2^32. The device's registers are 32 bits wide, so
+//64 bit searches from values up to this one run on the device and searches
+//from larger values run on the CPU Miller-Rabin engine in miller_rabin.c.
+#define MAX_DEVICE_PRIME 4294967291u
+
+/*
+    Starts a blocking prime search from a 64 bit value. Values up to
+    MAX_DEVICE_PRIME are searched by find_prime() and larger ones on the CPU.
+
+    Paramaters:
+        fd              -> File descriptor of the drivers device file.
+        start_val       -> Value to start the prime search from.
+        search_result   -> Pointer to where the result of the search
+                           should be stored. Set to 0 when there is no
+                           prime left below 2^64.
+    Return:
+        On success zero is returned, on failure a negative
+        value is returned.
+*/
+int find_prime64(int fd, uint64_t start_val, uint64_t *search_result);
+
+/*
+    Runs a batch of prime searches from 64 bit values. The values up to
+    MAX_DEVICE_PRIME go to the device as one find_primes_batch() call and
+    the rest are split between the CPU's threads.
+
+    Paramaters:
+        fd              -> File descriptor of the drivers device file.
+        start_vals      -> Array of values to start each search from.
+        search_results  -> Array where the result of each search should
+                           be stored. Must hold count entries.
+        count           -> Number of searches in the batch.
     Return:
         On success zero is returned, on failure a negative
         value is returned.
 */
-int find_prime(int fd, uint32_t start_val, uint32_t *search_result);
\ No newline at end of file
+int find_primes_batch64(int fd, const uint64_t *start_vals, uint64_t *search_results, uint32_t count);
+
+//Totals of the CPU checks of device results. See verify.c.
+struct verify_stats {
+    //Results that were checked
+    uint64_t checked;
+    //Checked results that were wrong
+    uint64_t mismatches;
+    //Start value and result of the latest wrong result
+    uint32_t last_mismatch_start;
+    uint32_t last_mismatch_result;
+};
+
+/*
+    Sets how often device results are checked on the CPU. A checked result
+    must be prime with no prime between the start value and it. Results
+    from a loaded prime index or the CPU engines are not checked. The rate
+    starts at 64, or at the PRIME_FINDER_VERIFY_RATE environment variable
+    when it is set.
+
+    Paramaters:
+        rate    -> One in every rate results is checked. 0 turns checking
+                   off and 1 checks every result.
+*/
+void set_verify_rate(uint32_t rate);
+
+/*
+    Reads the totals of the checks of every thread. The samples of the
+    calling thread are checked first. Other threads check theirs in
+    batches, so their latest samples may not be counted yet.
+
+    Paramaters:
+        stats   -> Set to the totals.
+*/
+void get_verify_stats(struct verify_stats *stats);
+
+//Throughput of a range search
+struct range_stats {
+    //Number of primes found
+    uint64_t primes;
+    //Device cycles spent on the searches, 0 when the prime index answered
+    uint64_t cycles;
+    //Wall clock time of the whole range
+    uint64_t elapsed_ns;
+};
+
+/*
+    Finds every prime in [low, high). The driver starts each search from the
+    previous result straight from its interrupt handler, so the device stays
+    busy without a round trip to the process per prime.
+
+    Paramaters:
+        fd              -> File descriptor of the drivers device file.
+        low             -> First value of the range.
+        high            -> End of the range, which is not included. At most
+                           2^32.
+        primes          -> Array the primes are stored in.
+        capacity        -> Number of entries in primes.
+        count           -> Set to the number of primes stored.
+        stats           -> Set to the throughput of the search. May be NULL.
+    Return:
+        0 once the whole range has been searched, 1 if primes filled up
+        first, in which case the range continues after the last prime, and a
+        negative value on failure.
+*/
+int find_primes_in_range(int fd, uint32_t low, uint64_t high, uint32_t *primes, uint32_t capacity,
+                         uint32_t *count, struct range_stats *stats);
+
+/*
+    Finds every prime in [low, high) and writes them to a file descriptor as
+    decimal text, one per line.
+
+    Paramaters:
+        fd              -> File descriptor of the drivers device file.
+        low             -> First value of the range.
+        high            -> End of the range, which is not included. At most
+                           2^32.
+        out_fd          -> File descriptor the primes are written to.
+        stats           -> Set to the throughput of the search. May be NULL.
+    Return:
+        On success zero is returned, on failure a negative
+        value is returned.
+*/
+int stream_primes_in_range(int fd, uint32_t low, uint64_t high, int out_fd, struct range_stats *stats);
+
+////////////////////////////////////////////////////
+//Event API
+////////////////////////////////////////////////////
+
+/*
+    Takes the result of a search started with start_search() without
+    blocking. Together with start_search() this is the non-blocking submit
+    path for callers that wait on the device from an event loop.
+
+    Paramaters:
+        fd              -> File descriptor of the drivers device file.
+        result          -> Pointer to where the result should be stored.
+    Return:
+        1 if the search has finished and result was set, 0 if it is still
+        running and a negative value on failure.
+*/
+int reap_search(int fd, uint32_t *result);
+
+/*
+    Waits until the search started with start_search() finishes. The
+    caller sleeps until the device's interrupt fires instead of polling
+    the registers.
+
+    Paramaters:
+        fd              -> File descriptor of the drivers device file.
+        timeout_ms      -> Longest time to wait in milliseconds, or -1 to
+                           wait forever.
+    Return:
+        1 if the search has finished, 0 on timeout and a negative value
+        on failure.
+*/
+int wait_search(int fd, int timeout_ms);
+
+/*
+    Registers an eventfd that the driver signals every time the device
+    raises its interrupt, so an event loop can watch it next to its other
+    file descriptors. The device file itself can also be watched with
+    poll() or epoll.
+
+    Paramaters:
+        fd              -> File descriptor of the drivers device file.
+        event_fd        -> File descriptor from eventfd(), or -1 to
+                           unregister the current one.
+    Return:
+        On success zero is returned, on failure a negative
+        value is returned.
+*/
+int set_search_eventfd(int fd, int event_fd);
+
+////////////////////////////////////////////////////
+//Ring API
+////////////////////////////////////////////////////
+
+//Completion of a search submitted through the rings. Matches the layout
+//of the driver's completion queue entries.
+struct ring_completion {
+    uint64_t user_data;
+    uint32_t start_val;
+    uint32_t search_result;
+};
+
+//Userspace handle to the submission and completion rings of one open
+//device file. Should be treated as opaque.
+struct prime_ring {
+    int fd;
+    struct ring_shared *shared;
+    size_t map_size;
+};
+
+/*
+    Maps the submission and completion rings of the device file.
+
+    Paramaters:
+        fd              -> File descriptor of the drivers device file.
+        ring            -> Handle to initialize.
+    Return:
+        On success zero is returned, on failure a negative
+        value is returned.
+*/
+int ring_setup(int fd, struct prime_ring *ring);
+
+/*
+    Queues a search. The driver is only entered when the device has run
+    out of work, otherwise the search is picked up by the interrupt handler
+    as soon as the device finishes the one before it.
+
+    Paramaters:
+        ring            -> Ring handle.
+        start_val       -> Value to start the prime search from.
+        user_data       -> Value handed back with the completion.
+    Return:
+        On success zero is returned, on failure or when the submission
+        ring is full a negative value is returned.
+*/
+int ring_submit(struct prime_ring *ring, uint32_t start_val, uint64_t user_data);
+
+/*
+    Takes the next completion off the completion ring without blocking.
+
+    Paramaters:
+        ring            -> Ring handle.
+        completion      -> Pointer to where the completion should be stored.
+    Return:
+        1 if a completion was returned, 0 if the ring was empty and a
+        negative value on failure.
+*/
+int ring_reap(struct prime_ring *ring, struct ring_completion *completion);
+
+/*
+    Waits until the completion ring holds at least one completion.
+
+    Paramaters:
+        ring            -> Ring handle.
+        timeout_ms      -> Longest time to wait in milliseconds, or -1 to
+                           wait forever.
+    Return:
+        1 if a completion is ready, 0 on timeout and a negative value on
+        failure.
+*/
+int ring_wait(struct prime_ring *ring, int timeout_ms);
+
+/*
+    Unmaps the rings. Searches that are still queued are dropped when the
+    device file is closed.
+
+    Paramaters:
+        ring            -> Ring handle.
+*/
+void ring_teardown(struct prime_ring *ring);
\ No newline at end of file
@@ -14,7 +14,9 @@
 //Device major and minor numbers
 dev_t char_device_numbers;
 
-//Character device representation within the kernel.
+//Character device of the aggregate node that spreads searches across
+//every card. The cards register their own character devices when they
+//are probed.
 struct cdev char_device;
 
 //This variable tracks what setup steps have been completed so that these
@@ -25,12 +27,14 @@ void back_out_char_device(void) {
 
     //Runs through the steps in reverse order that they were done during setup
     switch(setup_status) {
-        case 3:
+        case 4:
             pci_unregister_driver(&pci_driver_struct);
+        case 3:
+            stats_exit();
         case 2:
             cdev_del(&char_device);
         case 1:
-            unregister_chrdev_region(char_device_numbers, 1);
+            unregister_chrdev_region(char_device_numbers, MAX_DEVICES + 1);
     }
 
 }
@@ -45,8 +49,9 @@ static int __init startup(void) {
 
     printk(KERN_INFO "Startup\n");
 
-    //Get major and minor numbers for the charater device
-    err = alloc_chrdev_region(&char_device_numbers, 0, 1, DEVICE_NAME);
+    //Get major and minor numbers for the charater devices. There is one
+    //minor number per card plus one for the aggregate node.
+    err = alloc_chrdev_region(&char_device_numbers, 0, MAX_DEVICES + 1, DEVICE_NAME);
     if(err < 0) {
         printk(KERN_WARNING "Falid to allocate defice numbers\n");
         back_out_char_device();
@@ -58,7 +63,7 @@ static int __init startup(void) {
     cdev_init(&char_device, &file_ops);
 
     //Once the character device is added it is considered to be live
-    err = cdev_add(&char_device, char_device_numbers, 1);
+    err = cdev_add(&char_device, MKDEV(MAJOR(char_device_numbers), AGGREGATE_MINOR), 1);
     if(err < 0) {
         printk(KERN_WARNING "Falid to add the character device\n");
         back_out_char_device();
@@ -66,6 +71,15 @@ static int __init startup(void) {
     }
     setup_status++;
 
+    //Counters of the driver and the debugfs directory the cards add theirs to
+    err = stats_init();
+    if(err < 0) {
+        printk(KERN_WARNING "Failed to set up the statistics\n");
+        back_out_char_device();
+        return -1;
+    }
+    setup_status++;
+
     //Register this driver with the PCI subsystem.
     err = pci_register_driver(&pci_driver_struct);
     if(err < 0) {
@@ -90,4 +104,4 @@ static void __exit shutdown(void) {
 module_init(startup);
 module_exit(shutdown);
 
-MODULE_LICENSE("MIT");
\ No newline at end of file
+MODULE_LICENSE("Dual MIT/GPL");
\ No newline at end of file
@@ -0,0 +1,434 @@
+#include <linux/module.h>
+#include <linux/version.h>
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/gfp.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/sched.h>
+
+//Companion module that adds virtual prime finder cards to the prime_finder
+//driver. Each card keeps its registers in a kernel page and a work item
+//plays the part of the FPGA. It computes the next prime and then fires the
+//completion from an hrtimer, which runs in interrupt context like the MSI
+//handler of a real card. This lets the character device, the request queue
+//and the wakeup path be measured on a machine without the hardware.
+#include "device_specific.h"
+#include "backend.h"
+
+//Number of virtual cards to add
+static unsigned int cards = 1;
+module_param(cards, uint, 0444);
+MODULE_PARM_DESC(cards, "Number of virtual cards to add");
+
+//Every search takes at least this long, like the card does
+static unsigned long latency_ns = 0;
+module_param(latency_ns, ulong, 0644);
+MODULE_PARM_DESC(latency_ns, "Shortest time a search takes in ns");
+
+//Clock the cycle count registers are derived from
+static unsigned int clock_hz = 125000000;
+module_param(clock_hz, uint, 0644);
+MODULE_PARM_DESC(clock_hz, "Clock frequency used for the cycle count registers");
+
+//Every search whose number is a multiple of this never finishes and stops
+//its cycle count, like a wedged card, so the driver's watchdog can be
+//exercised
+static unsigned int stall_one_in = 0;
+module_param(stall_one_in, uint, 0644);
+MODULE_PARM_DESC(stall_one_in, "Stall one in this many searches (0 = never)");
+
+//State of a virtual card
+struct mock_card {
+    struct prime_device *device;
+
+    //Register window of the card, one kernel page
+    u32 *registers;
+
+    //Protects everything below and the registers. Taken from the timer
+    //and from the driver with its dispatch lock held.
+    spinlock_t lock;
+    //Bumped every time a search is started
+    u64 generation;
+    //Generation whose result is in result and waits for the timer
+    u64 done_generation;
+    u32 result;
+    //Time the running search was started
+    u64 start_ns;
+    //Set while the card is stalled. Only a reset clears it.
+    bool stalled;
+    //Set while the module is unloaded, no further search is started
+    bool stopping;
+
+    //Computes the next prime
+    struct work_struct work;
+    //Fires the completion once the search has taken latency_ns
+    struct hrtimer timer;
+};
+
+static struct mock_card *mock_cards[MAX_DEVICES];
+
+
+/*
+    Checks whether a number is prime by trial division with 6k +/- 1.
+
+    Paramaters:
+        n   -> Number to test.
+    Return:
+        true if n is prime.
+*/
+static bool is_prime(u32 n) {
+    u32 i;
+
+    if(n < 2) return false;
+    if(n < 4) return true;
+    if(n % 2 == 0 || n % 3 == 0) return false;
+
+    for(i = 5; (u64) i * i <= n; i += 6) {
+        if(n % i == 0 || n % (i + 2) == 0) return false;
+    }
+
+    return true;
+}
+
+/*
+    Works out the cycle count of a card's running search from the time it
+    has been running.
+
+    Paramaters:
+        card    -> Card to look at.
+    Return:
+        The cycle count.
+*/
+static u64 mock_cycles(struct mock_card *card) {
+    return mul_u64_u32_div(ktime_get_ns() - READ_ONCE(card->start_ns), READ_ONCE(clock_hz), NSEC_PER_SEC);
+}
+
+/*
+    Work item of a card. Finds the first prime at or after START_NUMBER and
+    arms the timer that completes the search.
+
+    Paramaters:
+        work    -> Work item embedded in the card.
+*/
+static void mock_search(struct work_struct *work) {
+    struct mock_card *card = container_of(work, struct mock_card, work);
+    unsigned long flags;
+    u64 generation, start_ns, elapsed_ns, delay_ns;
+    u64 n;
+    u32 result = 0;
+
+    spin_lock_irqsave(&card->lock, flags);
+    generation = card->generation;
+    n = card->registers[START_NUMBER / 4];
+    start_ns = card->start_ns;
+    spin_unlock_irqrestore(&card->lock, flags);
+
+    for(; n <= U32_MAX; n++) {
+        if(is_prime((u32) n)) {
+            result = (u32) n;
+            break;
+        }
+
+        //Give up early when the search was replaced
+        if((n & 0xff) == 0) {
+            if(READ_ONCE(card->generation) != generation) {
+                return;
+            }
+            cond_resched();
+        }
+    }
+
+    spin_lock_irqsave(&card->lock, flags);
+    if(card->generation != generation || card->stopping) {
+        spin_unlock_irqrestore(&card->lock, flags);
+        return;
+    }
+    if(READ_ONCE(stall_one_in) != 0 && generation % READ_ONCE(stall_one_in) == 0) {
+        card->stalled = true;
+        spin_unlock_irqrestore(&card->lock, flags);
+        return;
+    }
+    card->result = result;
+    card->done_generation = generation;
+    spin_unlock_irqrestore(&card->lock, flags);
+
+    elapsed_ns = ktime_get_ns() - start_ns;
+    delay_ns = READ_ONCE(latency_ns);
+    delay_ns = delay_ns > elapsed_ns ? delay_ns - elapsed_ns : 0;
+
+    hrtimer_start(&card->timer, ns_to_ktime(delay_ns), HRTIMER_MODE_REL);
+}
+
+/*
+    Timer of a card. Publishes the result of the search and raises the
+    card's completion interrupt.
+
+    Paramaters:
+        timer   -> Timer embedded in the card.
+    Return:
+        HRTIMER_NORESTART
+*/
+static enum hrtimer_restart mock_timer_done(struct hrtimer *timer) {
+    struct mock_card *card = container_of(timer, struct mock_card, timer);
+    u64 cycles;
+
+    spin_lock(&card->lock);
+    //Only the newest search completes
+    if(card->done_generation != card->generation || card->stopping ||
+       card->registers[DONE_FLAG / 4] == 1) {
+        spin_unlock(&card->lock);
+        return HRTIMER_NORESTART;
+    }
+
+    cycles = mock_cycles(card);
+    card->registers[PRIME_NUMBER / 4] = card->result;
+    card->registers[CYCLE_COUNT_HIGH / 4] = upper_32_bits(cycles);
+    card->registers[CYCLE_COUNT_LOW / 4] = lower_32_bits(cycles);
+    card->registers[DONE_FLAG / 4] = 1;
+    spin_unlock(&card->lock);
+
+    prime_device_interrupt(card->device);
+
+    return HRTIMER_NORESTART;
+}
+
+/*
+    Reads a register of a virtual card.
+
+    Paramaters:
+        backend_data    -> The card.
+        offset          -> Offset of the register.
+    Return:
+        The value of the register.
+*/
+static u32 mock_read_register(void *backend_data, unsigned int offset) {
+    struct mock_card *card = backend_data;
+    u64 cycles;
+
+    if(offset >= REGISTER_WINDOW_SIZE) {
+        return 0;
+    }
+
+    //The cycle count runs while a search is in progress, the way the
+    //card's counter does
+    if((offset == CYCLE_COUNT_HIGH || offset == CYCLE_COUNT_LOW) && READ_ONCE(card->generation) != 0 &&
+       READ_ONCE(card->registers[DONE_FLAG / 4]) == 0 && !READ_ONCE(card->stalled)) {
+        cycles = mock_cycles(card);
+        return offset == CYCLE_COUNT_HIGH ? upper_32_bits(cycles) : lower_32_bits(cycles);
+    }
+
+    return READ_ONCE(card->registers[offset / 4]);
+}
+
+/*
+    Writes a register of a virtual card. Writing 1 to START_FLAG starts a
+    search. Writes to the read only registers are ignored.
+
+    Paramaters:
+        backend_data    -> The card.
+        offset          -> Offset of the register.
+        value           -> Value to write.
+*/
+static void mock_write_register(void *backend_data, unsigned int offset, u32 value) {
+    struct mock_card *card = backend_data;
+    unsigned long flags;
+
+    spin_lock_irqsave(&card->lock, flags);
+    switch(offset) {
+        case START_NUMBER:
+            card->registers[START_NUMBER / 4] = value;
+            break;
+        case START_FLAG:
+            card->registers[START_FLAG / 4] = value;
+            //A stalled card ignores everything until it is reset
+            if(value == 1 && !card->stopping && !card->stalled) {
+                card->registers[DONE_FLAG / 4] = 0;
+                card->generation++;
+                card->start_ns = ktime_get_ns();
+                schedule_work(&card->work);
+            }
+            break;
+    }
+    spin_unlock_irqrestore(&card->lock, flags);
+}
+
+/*
+    Copies registers out of a virtual card.
+
+    Paramaters:
+        backend_data    -> The card.
+        offset          -> Offset to start reading from.
+        buffer          -> Kernel buffer to read into.
+        count           -> Number of bytes to read.
+*/
+static void mock_read_window(void *backend_data, unsigned int offset, void *buffer, size_t count) {
+    struct mock_card *card = backend_data;
+    unsigned long flags;
+
+    spin_lock_irqsave(&card->lock, flags);
+    memcpy(buffer, (u8*) card->registers + offset, count);
+    spin_unlock_irqrestore(&card->lock, flags);
+}
+
+/*
+    Resets a virtual card. The running search is dropped and the registers
+    go back to zero, like they do after a function level reset.
+
+    Paramaters:
+        backend_data    -> The card.
+    Return:
+        0
+*/
+static int mock_reset(void *backend_data) {
+    struct mock_card *card = backend_data;
+    unsigned long flags;
+
+    spin_lock_irqsave(&card->lock, flags);
+    //Makes the work item and the timer drop the running search
+    card->generation++;
+    card->stalled = false;
+    memset(card->registers, 0, REGISTER_WINDOW_SIZE);
+    spin_unlock_irqrestore(&card->lock, flags);
+
+    cancel_work_sync(&card->work);
+    hrtimer_cancel(&card->timer);
+
+    return 0;
+}
+
+/*
+    Frees a virtual card once the driver drops its last reference.
+
+    Paramaters:
+        backend_data    -> The card.
+*/
+static void mock_release(void *backend_data) {
+    struct mock_card *card = backend_data;
+
+    free_page((unsigned long) card->registers);
+    kfree(card);
+}
+
+//Writes through a mapping of the register page would never start a
+//search, so mmap of the registers is not offered
+static const struct prime_backend_ops mock_backend_ops = {
+    .owner = THIS_MODULE,
+    .read_register = mock_read_register,
+    .write_register = mock_write_register,
+    .read_window = mock_read_window,
+    .reset = mock_reset,
+    .release = mock_release
+};
+
+/*
+    Stops a virtual card and removes it from the driver.
+
+    Paramaters:
+        card    -> Card to remove.
+*/
+static void mock_card_remove(struct mock_card *card) {
+    unsigned long flags;
+
+    spin_lock_irqsave(&card->lock, flags);
+    card->stopping = true;
+    spin_unlock_irqrestore(&card->lock, flags);
+
+    //No interrupt may be raised once the card is unregistered
+    cancel_work_sync(&card->work);
+    hrtimer_cancel(&card->timer);
+
+    //Frees the card through mock_release
+    prime_device_unregister(card->device);
+}
+
+/*
+    Allocates a virtual card and registers it with the driver.
+
+    Return:
+        The card, or NULL on failure.
+*/
+static struct mock_card *mock_card_add(void) {
+    struct mock_card *card;
+
+    card = kzalloc(sizeof(struct mock_card), GFP_KERNEL);
+    if(card == NULL) {
+        return NULL;
+    }
+
+    card->registers = (u32*) get_zeroed_page(GFP_KERNEL);
+    if(card->registers == NULL) {
+        kfree(card);
+        return NULL;
+    }
+
+    spin_lock_init(&card->lock);
+    INIT_WORK(&card->work, mock_search);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+    hrtimer_setup(&card->timer, mock_timer_done, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+#else
+    hrtimer_init(&card->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    card->timer.function = mock_timer_done;
+#endif
+
+    card->device = prime_device_alloc(&mock_backend_ops, card);
+    if(card->device == NULL) {
+        free_page((unsigned long) card->registers);
+        kfree(card);
+        return NULL;
+    }
+
+    if(prime_device_register(card->device) != 0) {
+        //Frees the card through mock_release
+        prime_device_unregister(card->device);
+        return NULL;
+    }
+
+    return card;
+}
+
+static int __init mock_startup(void) {
+    unsigned int i;
+
+    printk(KERN_INFO "Mock Startup\n");
+
+    if(cards > MAX_DEVICES) {
+        cards = MAX_DEVICES;
+    }
+
+    for(i = 0; i < cards; i++) {
+        mock_cards[i] = mock_card_add();
+        if(mock_cards[i] == NULL) {
+            printk(KERN_WARNING "Failed to add virtual card %u\n", i);
+            while(i-- > 0) {
+                mock_card_remove(mock_cards[i]);
+                mock_cards[i] = NULL;
+            }
+            return -ENOMEM;
+        }
+    }
+
+    printk(KERN_INFO "Mock Startup Complete\n");
+
+    return 0;
+}
+
+static void __exit mock_shutdown(void) {
+    unsigned int i;
+
+    printk(KERN_INFO "Mock Shutdown\n");
+    for(i = 0; i < cards; i++) {
+        mock_card_remove(mock_cards[i]);
+        mock_cards[i] = NULL;
+    }
+    printk(KERN_INFO "Mock Shutdown Complete\n");
+}
+
+module_init(mock_startup);
+module_exit(mock_shutdown);
+
+//hrtimers are only exported to GPL compatible modules
+MODULE_LICENSE("Dual MIT/GPL");
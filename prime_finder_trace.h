@@ -0,0 +1,88 @@
+//Tracepoints for the driver's I/O paths. They cost nothing unless enabled
+//and can be turned on at runtime through ftrace or perf, for example:
+//    echo 1 > /sys/kernel/tracing/events/prime_finder/enable
+//    perf record -e 'prime_finder:*'
+//CREATE_TRACE_POINTS is defined in pcie_ctrl.c only.
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM prime_finder
+
+#if !defined(PRIME_FINDER_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define PRIME_FINDER_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <linux/types.h>
+
+//A search was started on the device
+TRACE_EVENT(prime_submit,
+    TP_PROTO(u32 start_val),
+    TP_ARGS(start_val),
+    TP_STRUCT__entry(
+        __field(u32, start_val)
+    ),
+    TP_fast_assign(
+        __entry->start_val = start_val;
+    ),
+    TP_printk("start_val=%u", __entry->start_val)
+);
+
+//The result of a search was handed back to its caller
+TRACE_EVENT(prime_complete,
+    TP_PROTO(u32 start_val, u32 search_result),
+    TP_ARGS(start_val, search_result),
+    TP_STRUCT__entry(
+        __field(u32, start_val)
+        __field(u32, search_result)
+    ),
+    TP_fast_assign(
+        __entry->start_val = start_val;
+        __entry->search_result = search_result;
+    ),
+    TP_printk("start_val=%u search_result=%u", __entry->start_val, __entry->search_result)
+);
+
+//Register window access through read() and write()
+DECLARE_EVENT_CLASS(prime_register_access,
+    TP_PROTO(loff_t offset, size_t count),
+    TP_ARGS(offset, count),
+    TP_STRUCT__entry(
+        __field(loff_t, offset)
+        __field(size_t, count)
+    ),
+    TP_fast_assign(
+        __entry->offset = offset;
+        __entry->count = count;
+    ),
+    TP_printk("offset=%lld count=%zu", __entry->offset, __entry->count)
+);
+
+DEFINE_EVENT(prime_register_access, prime_read,
+    TP_PROTO(loff_t offset, size_t count),
+    TP_ARGS(offset, count)
+);
+
+DEFINE_EVENT(prime_register_access, prime_write,
+    TP_PROTO(loff_t offset, size_t count),
+    TP_ARGS(offset, count)
+);
+
+//The device raised its interrupt
+TRACE_EVENT(prime_irq,
+    TP_PROTO(int irq),
+    TP_ARGS(irq),
+    TP_STRUCT__entry(
+        __field(int, irq)
+    ),
+    TP_fast_assign(
+        __entry->irq = irq;
+    ),
+    TP_printk("irq=%d", __entry->irq)
+);
+
+#endif
+
+//This part must be outside the include guard
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE prime_finder_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,404 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "prime_index.h"
+
+#define INDEX_MAGIC "PRIMEIDX"
+#define INDEX_VERSION 1
+#define INDEX_WHEEL 30
+//Every 32 bit number is covered
+#define INDEX_LIMIT (1ull << 32)
+//Bitmap bytes needed for the limit, rounded up to whole 64 bit words
+#define INDEX_BITMAP_BYTES (((INDEX_LIMIT + INDEX_WHEEL - 1) / INDEX_WHEEL + 7) & ~7ull)
+//The bitmap starts on its own page so it can be mapped on its own
+#define INDEX_BITMAP_OFFSET 4096
+
+//Bitmap bytes sieved at a time. Sized so a segment stays in the L2 cache.
+#define SEGMENT_BYTES (256 * 1024)
+//Every composite below 2^32 has a factor below this
+#define SIEVE_PRIME_LIMIT 65536
+
+//Numbers below 30 that are not divisible by 2, 3 or 5. Bit j of a bitmap
+//byte b stands for 30 * b + wheel[j].
+static const uint8_t wheel[8] = {1, 7, 11, 13, 17, 19, 23, 29};
+
+//A sieving prime and where it crosses off next. Multiples p * k with k in
+//one of the 8 wheel classes all land on the same bit and are p bytes apart.
+struct sieve_prime {
+    uint32_t prime;
+    uint64_t next_byte[8];
+    uint8_t clear_mask[8];
+};
+
+
+/*
+    Returns the bit of a wheel residue.
+
+    Paramaters:
+        residue -> Number modulo 30.
+    Return:
+        The bit index, or -1 if the residue is divisible by 2, 3 or 5.
+*/
+static int wheel_bit(unsigned int residue) {
+    int j;
+
+    for(j = 0; j < 8; j++) {
+        if(wheel[j] == residue) return j;
+    }
+
+    return -1;
+}
+
+/*
+    Returns the bits of a byte that stand for numbers at or above a
+    residue.
+
+    Paramaters:
+        residue -> Number modulo 30.
+*/
+static uint8_t bits_from(unsigned int residue) {
+    uint8_t bits = 0;
+    int j;
+
+    for(j = 0; j < 8; j++) {
+        if(wheel[j] >= residue) bits |= 1 << j;
+    }
+
+    return bits;
+}
+
+/*
+    Loads a 64 bit word of the bitmap. Byte b of the bitmap ends up in bits
+    8 * (b % 8) and up on every host.
+
+    Paramaters:
+        bitmap  -> The bitmap.
+        word    -> Index of the word.
+*/
+static inline uint64_t load_word(const uint8_t *bitmap, uint64_t word) {
+    uint64_t value;
+
+    memcpy(&value, bitmap + word * 8, sizeof(value));
+    return le64toh(value);
+}
+
+/*
+    Finds the sieving primes from 7 up to SIEVE_PRIME_LIMIT and where each
+    starts crossing off.
+
+    Paramaters:
+        count   -> Set to the number of primes returned.
+    Return:
+        The sieving primes, or NULL if they could not be allocated.
+*/
+static struct sieve_prime *find_sieve_primes(int *count) {
+    struct sieve_prime *primes;
+    uint8_t *composite;
+    uint64_t n, k;
+    uint32_t p;
+    int i, found = 0;
+
+    composite = calloc(SIEVE_PRIME_LIMIT, 1);
+    //Fewer than SIEVE_PRIME_LIMIT / 8 numbers below the limit are prime
+    primes = malloc(sizeof(struct sieve_prime) * (SIEVE_PRIME_LIMIT / 8));
+    if(composite == NULL || primes == NULL) {
+        free(composite);
+        free(primes);
+        return NULL;
+    }
+
+    for(p = 2; p < SIEVE_PRIME_LIMIT; p++) {
+        if(composite[p]) continue;
+        for(n = (uint64_t) p * p; n < SIEVE_PRIME_LIMIT; n += p) {
+            composite[n] = 1;
+        }
+        if(p < 7) continue;
+
+        //Cross off from p * p, the first multiple with no smaller factor
+        primes[found].prime = p;
+        for(i = 0; i < 8; i++) {
+            k = p + (wheel[i] + INDEX_WHEEL - p % INDEX_WHEEL) % INDEX_WHEEL;
+            n = (uint64_t) p * k;
+            primes[found].next_byte[i] = n / INDEX_WHEEL;
+            primes[found].clear_mask[i] = ~(1 << wheel_bit(n % INDEX_WHEEL));
+        }
+        found++;
+    }
+
+    free(composite);
+    *count = found;
+    return primes;
+}
+
+/*
+    Sieves one segment of the bitmap.
+
+    Paramaters:
+        segment     -> Bitmap bytes of the segment.
+        first_byte  -> Bitmap index of the first byte of the segment.
+        length      -> Number of bytes in the segment.
+        primes      -> Sieving primes, advanced past the segment.
+        prime_count -> Number of sieving primes.
+*/
+static void sieve_segment(uint8_t *segment, uint64_t first_byte, uint64_t length,
+                          struct sieve_prime *primes, int prime_count) {
+    uint64_t end_byte = first_byte + length;
+    uint64_t b, number;
+    int i, j, bit;
+
+    memset(segment, 0xff, length);
+
+    for(i = 0; i < prime_count; i++) {
+        for(j = 0; j < 8; j++) {
+            for(b = primes[i].next_byte[j]; b < end_byte; b += primes[i].prime) {
+                segment[b - first_byte] &= primes[i].clear_mask[j];
+            }
+            primes[i].next_byte[j] = b;
+        }
+    }
+
+    //1 is not prime
+    if(first_byte == 0) {
+        segment[0] &= ~1;
+    }
+
+    //Clear the bits past the limit in the last bytes
+    for(b = first_byte; b < end_byte; b++) {
+        if(b * INDEX_WHEEL + 29 < INDEX_LIMIT) continue;
+        for(bit = 0; bit < 8; bit++) {
+            number = b * INDEX_WHEEL + wheel[bit];
+            if(number >= INDEX_LIMIT) segment[b - first_byte] &= ~(1 << bit);
+        }
+    }
+}
+
+/*
+    Builds an index file with a segmented sieve of Eratosthenes.
+
+    Paramaters:
+        path    -> Path of the index file to create.
+    Return:
+        0 on success and a negative value on failure.
+*/
+int prime_index_build(const char *path) {
+    struct prime_index_header header;
+    struct sieve_prime *primes;
+    uint8_t *segment;
+    uint64_t first_byte, length;
+    int prime_count;
+    FILE *file;
+    int status = 0;
+
+    primes = find_sieve_primes(&prime_count);
+    if(primes == NULL) {
+        return -1;
+    }
+
+    segment = calloc(INDEX_BITMAP_OFFSET > SEGMENT_BYTES ? INDEX_BITMAP_OFFSET : SEGMENT_BYTES, 1);
+    file = fopen(path, "wb");
+    if(segment == NULL || file == NULL) {
+        free(primes);
+        free(segment);
+        if(file != NULL) fclose(file);
+        return -1;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+    header.version = INDEX_VERSION;
+    header.wheel = INDEX_WHEEL;
+    header.limit = INDEX_LIMIT;
+    header.bitmap_offset = INDEX_BITMAP_OFFSET;
+    header.bitmap_bytes = INDEX_BITMAP_BYTES;
+
+    //The header is padded out to the start of the bitmap with zeros
+    memcpy(segment, &header, sizeof(header));
+    if(fwrite(segment, 1, INDEX_BITMAP_OFFSET, file) != INDEX_BITMAP_OFFSET) {
+        status = -1;
+    }
+
+    for(first_byte = 0; status == 0 && first_byte < INDEX_BITMAP_BYTES; first_byte += length) {
+        length = INDEX_BITMAP_BYTES - first_byte;
+        if(length > SEGMENT_BYTES) length = SEGMENT_BYTES;
+
+        sieve_segment(segment, first_byte, length, primes, prime_count);
+        if(fwrite(segment, 1, length, file) != length) {
+            status = -1;
+        }
+    }
+
+    if(fclose(file) != 0) {
+        status = -1;
+    }
+    free(segment);
+    free(primes);
+
+    return status;
+}
+
+/*
+    Maps an index file.
+
+    Paramaters:
+        index   -> Index to initialize.
+        path    -> Path of the index file.
+    Return:
+        0 on success and a negative value if the file is missing or is not
+        a valid index.
+*/
+int prime_index_open(struct prime_index *index, const char *path) {
+    struct prime_index_header header;
+    struct stat file_stat;
+    void *map;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if(fd < 0) {
+        return -1;
+    }
+
+    if(fstat(fd, &file_stat) != 0 || file_stat.st_size < INDEX_BITMAP_OFFSET) {
+        close(fd);
+        return -1;
+    }
+
+    map = mmap(NULL, file_stat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    //The mapping stays valid after the file is closed
+    close(fd);
+    if(map == MAP_FAILED) {
+        return -1;
+    }
+
+    memcpy(&header, map, sizeof(header));
+    if(memcmp(header.magic, INDEX_MAGIC, sizeof(header.magic)) != 0 ||
+       header.version != INDEX_VERSION || header.wheel != INDEX_WHEEL ||
+       header.limit != INDEX_LIMIT || header.bitmap_bytes != INDEX_BITMAP_BYTES ||
+       header.bitmap_offset + header.bitmap_bytes > (uint64_t) file_stat.st_size) {
+        munmap(map, file_stat.st_size);
+        return -1;
+    }
+
+    index->map = map;
+    index->map_size = file_stat.st_size;
+    index->bitmap = (const uint8_t*) map + header.bitmap_offset;
+    index->bitmap_bytes = header.bitmap_bytes;
+
+    return 0;
+}
+
+/*
+    Unmaps an index file.
+
+    Paramaters:
+        index   -> Index to close.
+*/
+void prime_index_close(struct prime_index *index) {
+    if(index->map != NULL) {
+        munmap(index->map, index->map_size);
+    }
+    index->map = NULL;
+    index->bitmap = NULL;
+}
+
+/*
+    Finds the first prime at or after a value. The bitmap is scanned a 64
+    bit word at a time and the first set bit is found with ctz.
+
+    Paramaters:
+        index       -> Open index.
+        start_val   -> Value to start the search from.
+        prime       -> Where to store the prime.
+    Return:
+        1 if a prime was found and 0 if there is none below 2^32.
+*/
+int prime_index_next(const struct prime_index *index, uint32_t start_val, uint32_t *prime) {
+    uint64_t byte = start_val / INDEX_WHEEL;
+    uint64_t word = byte / 8;
+    unsigned int shift = (byte % 8) * 8;
+    uint64_t bits;
+    int position;
+
+    //2, 3 and 5 are not part of the wheel
+    if(start_val <= 5) {
+        *prime = start_val <= 2 ? 2 : (start_val <= 3 ? 3 : 5);
+        return 1;
+    }
+
+    //Drop the bytes before the start and the numbers below it in its byte
+    bits = load_word(index->bitmap, word);
+    bits &= ~0ull << shift;
+    bits &= ~((uint64_t) (uint8_t) ~bits_from(start_val % INDEX_WHEEL) << shift);
+
+    while(bits == 0) {
+        word++;
+        if(word * 8 >= index->bitmap_bytes) {
+            return 0;
+        }
+        bits = load_word(index->bitmap, word);
+    }
+
+    position = __builtin_ctzll(bits);
+    *prime = (uint32_t) ((word * 8 + position / 8) * INDEX_WHEEL + wheel[position % 8]);
+
+    return 1;
+}
+
+/*
+    Counts the primes of the bitmap below a value.
+
+    Paramaters:
+        index   -> Open index.
+        value   -> End of the range, which is not included.
+*/
+static uint64_t count_below(const struct prime_index *index, uint64_t value) {
+    uint64_t byte = value / INDEX_WHEEL;
+    uint64_t count = 0;
+    uint64_t b;
+
+    //Whole words first, then the bytes before the partial one
+    for(b = 0; b + 8 <= byte; b += 8) {
+        count += __builtin_popcountll(load_word(index->bitmap, b / 8));
+    }
+    for(; b < byte; b++) {
+        count += __builtin_popcount(index->bitmap[b]);
+    }
+
+    //Numbers of the last byte that are below value
+    if(byte < index->bitmap_bytes) {
+        count += __builtin_popcount(index->bitmap[byte] & (uint8_t) ~bits_from(value % INDEX_WHEEL));
+    }
+
+    return count;
+}
+
+/*
+    Counts the primes in a range with popcount.
+
+    Paramaters:
+        index   -> Open index.
+        low     -> First value of the range.
+        high    -> End of the range, which is not included. At most 2^32.
+    Return:
+        The number of primes in [low, high).
+*/
+uint64_t prime_index_count(const struct prime_index *index, uint64_t low, uint64_t high) {
+    static const uint64_t small_primes[3] = {2, 3, 5};
+    uint64_t count = 0;
+    int i;
+
+    if(high > INDEX_LIMIT) high = INDEX_LIMIT;
+    if(low >= high) return 0;
+
+    for(i = 0; i < 3; i++) {
+        if(small_primes[i] >= low && small_primes[i] < high) count++;
+    }
+
+    return count + count_below(index, high) - count_below(index, low);
+}
@@ -0,0 +1,89 @@
+#ifndef PRIME_INDEX_H
+#define PRIME_INDEX_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+//Precomputed bitmap of every prime below 2^32. The bitmap uses a mod 30
+//wheel. Each byte stands for 30 consecutive numbers and its 8 bits for the
+//ones among them that are not divisible by 2, 3 or 5, so the whole 32 bit
+//space fits in about 136MB. The file is mapped and not read, so only the
+//pages that queries touch are loaded.
+
+//Layout of the start of an index file. The bitmap starts at
+//bitmap_offset, which is page aligned.
+struct prime_index_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t wheel;
+    //The bitmap covers every number below limit
+    uint64_t limit;
+    uint64_t bitmap_offset;
+    uint64_t bitmap_bytes;
+    uint64_t reserved[3];
+};
+
+//An index file mapped into the process
+struct prime_index {
+    const uint8_t *bitmap;
+    uint64_t bitmap_bytes;
+    void *map;
+    size_t map_size;
+};
+
+/*
+    Builds an index file with a segmented sieve of Eratosthenes.
+
+    Paramaters:
+        path    -> Path of the index file to create.
+    Return:
+        0 on success and a negative value on failure.
+*/
+int prime_index_build(const char *path);
+
+/*
+    Maps an index file.
+
+    Paramaters:
+        index   -> Index to initialize.
+        path    -> Path of the index file.
+    Return:
+        0 on success and a negative value if the file is missing or is not
+        a valid index.
+*/
+int prime_index_open(struct prime_index *index, const char *path);
+
+/*
+    Unmaps an index file.
+
+    Paramaters:
+        index   -> Index to close.
+*/
+void prime_index_close(struct prime_index *index);
+
+/*
+    Finds the first prime at or after a value. The bitmap is scanned a 64
+    bit word at a time and the first set bit is found with ctz.
+
+    Paramaters:
+        index       -> Open index.
+        start_val   -> Value to start the search from.
+        prime       -> Where to store the prime.
+    Return:
+        1 if a prime was found and 0 if there is none below 2^32.
+*/
+int prime_index_next(const struct prime_index *index, uint32_t start_val, uint32_t *prime);
+
+/*
+    Counts the primes in a range with popcount.
+
+    Paramaters:
+        index   -> Open index.
+        low     -> First value of the range.
+        high    -> End of the range, which is not included. At most 2^32.
+    Return:
+        The number of primes in [low, high).
+*/
+uint64_t prime_index_count(const struct prime_index *index, uint64_t low, uint64_t high);
+
+#endif
@@ -0,0 +1,797 @@
+#include "queue.h"
+#include "ring.h"
+#include "pcie_ctrl.h"
+#include "prime_finder_trace.h"
+
+#include <linux/spinlock.h>
+#include <linux/moduleparam.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/io.h>
+#include <linux/sched.h>
+#include <linux/jiffies.h>
+
+
+//Searches queue_drain completes before it drops the dispatch lock for a
+//moment
+#define DRAIN_BATCH 16
+
+//How blocking searches wait when the caller does not pick a mode
+static unsigned int default_wait_mode = WAIT_MODE_INTERRUPT;
+module_param_named(wait_mode, default_wait_mode, uint, 0644);
+MODULE_PARM_DESC(wait_mode, "Default wait of blocking searches (1 = interrupt, 2 = hybrid)");
+
+//Searches predicted to take longer than this sleep on the interrupt
+//straight away in hybrid mode. It is also the longest spin.
+static unsigned int hybrid_spin_max_ns = 50000;
+module_param(hybrid_spin_max_ns, uint, 0644);
+MODULE_PARM_DESC(hybrid_spin_max_ns, "Longest search in ns that hybrid waits spin for");
+
+//Requests a card accepts before submitters have to wait for room
+static unsigned int max_queue_depth = 64;
+module_param(max_queue_depth, uint, 0644);
+MODULE_PARM_DESC(max_queue_depth, "Requests waiting or running per card before submitters block");
+
+//Longest a blocking search is waited for when the caller does not give a
+//timeout of its own
+static unsigned int search_timeout_ms = 10000;
+module_param(search_timeout_ms, uint, 0644);
+MODULE_PARM_DESC(search_timeout_ms, "Default deadline of blocking searches in ms (0 = wait forever)");
+
+
+/*
+    Works out how long a hybrid wait should spin on DONE_FLAG before it
+    sleeps. The length of the search is predicted from the cycle counts of
+    recent searches. Searches predicted to be long do not spin at all.
+
+    Paramaters:
+        device  -> Card the search is running on.
+
+    Return:
+        The spin budget in nanoseconds.
+*/
+static u64 hybrid_spin_budget(struct prime_device *device) {
+    u64 spin_max = READ_ONCE(hybrid_spin_max_ns);
+    u64 predicted;
+
+    //Spin as long as allowed until there is history to learn from
+    if(ewma_ns_per_kcycle_read(&device->ns_per_kcycle) == 0) {
+        return spin_max;
+    }
+
+    predicted = (u64) ewma_search_cycles_read(&device->search_cycles) *
+                ewma_ns_per_kcycle_read(&device->ns_per_kcycle) / 1000;
+    if(predicted > spin_max) {
+        return 0;
+    }
+
+    //Leave room for searches that run a little longer than average
+    return min(predicted * 2, spin_max);
+}
+
+/*
+    Feeds the cycle count and duration of a finished search into the
+    averages that size the next hybrid spin. Must be called with the card's
+    dispatch lock held before the next search is started.
+
+    Paramaters:
+        device  -> Card the search ran on.
+        request -> The finished search.
+        cycles  -> Cycle count of the search.
+*/
+static void hybrid_learn(struct prime_device *device, struct search_request *request, u64 cycles) {
+    u64 elapsed_ns = ktime_get_ns() - request->start_ns;
+
+    if(cycles == 0) {
+        return;
+    }
+
+    ewma_search_cycles_add(&device->search_cycles, cycles);
+    ewma_ns_per_kcycle_add(&device->ns_per_kcycle, max_t(u64, div64_u64(elapsed_ns * 1000, cycles), 1));
+}
+
+/*
+    Starts the oldest request of the client at the front of the round robin
+    and moves that client to the back. Must be called with the card's
+    dispatch lock held while the card is idle.
+
+    Paramaters:
+        device  -> Card to start the search on.
+
+    Return:
+        true if a search was started.
+*/
+static bool queue_start_next(struct prime_device *device) {
+    struct search_queue *queue = &device->queue;
+    struct queue_client *client;
+    struct search_request *request;
+
+    if(list_empty(&queue->clients)) {
+        return false;
+    }
+
+    client = list_first_entry(&queue->clients, struct queue_client, node);
+    request = list_first_entry(&client->pending, struct search_request, node);
+    list_del_init(&request->node);
+
+    //Every client with waiting requests gets one search per turn
+    list_del(&client->node);
+    if(!list_empty(&client->pending)) {
+        list_add_tail(&client->node, &queue->clients);
+    }
+
+    request->start_ns = ktime_get_ns();
+    queue->running = request;
+
+    trace_prime_submit(request->start_val);
+    prime_start_search(device, request->start_val, request->start_ns);
+
+    return true;
+}
+
+/*
+    Stores the result of a range search's latest search and starts the
+    next one from the result plus one. Must be called with the card's
+    dispatch lock held.
+
+    Paramaters:
+        device  -> Card the search ran on.
+        request -> The running range search.
+        cycles  -> Cycle count of the latest search.
+
+    Return:
+        true if the card was restarted and the request is still running.
+*/
+static bool range_continue(struct prime_device *device, struct search_request *request, u64 cycles) {
+    u32 result = request->search_result;
+
+    request->range_cycles += cycles;
+
+    //The card wraps around to 0 once there is no prime left below 2^32
+    if(result < request->start_val || result >= request->range_end) {
+        request->range_next = request->range_end;
+        return false;
+    }
+
+    request->range_results[request->range_count++] = result;
+    request->range_next = (u64) result + 1;
+
+    if(request->range_count == request->range_capacity ||
+       request->range_next >= request->range_end || READ_ONCE(device->removed)) {
+        return false;
+    }
+
+    request->start_val = result + 1;
+
+    trace_prime_submit(request->start_val);
+    prime_start_search(device, request->start_val, ktime_get_ns());
+
+    return true;
+}
+
+/*
+    Hands the result of the running request to its caller. A range search
+    is restarted instead until it is finished. Must be called with the
+    card's dispatch lock held.
+
+    Paramaters:
+        device  -> Card the search ran on.
+*/
+static void queue_complete_running(struct prime_device *device) {
+    struct search_queue *queue = &device->queue;
+    struct search_request *request = queue->running;
+    u64 cycles;
+
+    request->search_result = prime_read_register(device, PRIME_NUMBER);
+    cycles = prime_read_cycles(device);
+    prime_count_completion(device, cycles);
+    trace_prime_complete(request->start_val, request->search_result);
+
+    if(request->range_results != NULL && range_continue(device, request, cycles)) {
+        return;
+    }
+
+    queue->running = NULL;
+    request->status = 0;
+
+    if(request->wait_mode == WAIT_MODE_HYBRID) {
+        hybrid_learn(device, request, cycles);
+    }
+
+    queue->depth--;
+    request->complete_ns = ktime_get_ns();
+    //The caller may free the request as soon as it is completed
+    complete(&request->done);
+    wake_up(&queue->space_wait);
+}
+
+/*
+    Starts the next search on an idle card. Must be called with the card's
+    dispatch lock held.
+
+    Paramaters:
+        device          -> Card to start the search on.
+        prefer_queue    -> Try the request queue before the rings.
+*/
+static void start_next(struct prime_device *device, bool prefer_queue) {
+    if(prefer_queue) {
+        if(!queue_start_next(device)) {
+            ring_start_active(device);
+        }
+    }
+    else if(!ring_start_active(device)) {
+        queue_start_next(device);
+    }
+}
+
+/*
+    Spins on DONE_FLAG while the request is running until it finishes or
+    the budget runs out. A search seen done is completed right here and
+    the next one started, without waiting for the interrupt.
+
+    Paramaters:
+        request -> Request to spin on.
+*/
+static void hybrid_wait(struct search_request *request) {
+    struct prime_device *device = request->device;
+    struct search_queue *queue = &device->queue;
+    unsigned long flags;
+    u64 budget;
+    u64 deadline;
+
+    //Only a search that is already running is worth spinning on
+    if(READ_ONCE(queue->running) != request) {
+        return;
+    }
+
+    budget = hybrid_spin_budget(device);
+    if(budget == 0) {
+        return;
+    }
+    deadline = request->start_ns + budget;
+
+    //Each check is a read across the PCIe link so no extra delay is added
+    //between them
+    do {
+        if(completion_done(&request->done)) {
+            return;
+        }
+
+        if(prime_read_register(device, DONE_FLAG) == 1) {
+            spin_lock_irqsave(&device->dispatch_lock, flags);
+            //The interrupt may have completed it in the meantime
+            if(queue->running == request) {
+                queue_complete_running(device);
+                if(!queue_device_busy(device)) {
+                    start_next(device, false);
+                }
+            }
+            spin_unlock_irqrestore(&device->dispatch_lock, flags);
+            return;
+        }
+
+        cpu_relax();
+    } while(ktime_get_ns() < deadline);
+}
+
+/*
+    Initializes the request queue of a card.
+
+    Paramaters:
+        queue   -> Queue to initialize.
+*/
+void queue_init(struct search_queue *queue) {
+    INIT_LIST_HEAD(&queue->clients);
+    queue->depth = 0;
+    queue->running = NULL;
+    queue->orphan_running = false;
+    queue->resetting = false;
+    init_waitqueue_head(&queue->space_wait);
+}
+
+/*
+    Initializes the per card state of an open file.
+
+    Paramaters:
+        client  -> Client to initialize.
+*/
+void queue_client_init(struct queue_client *client) {
+    INIT_LIST_HEAD(&client->node);
+    INIT_LIST_HEAD(&client->pending);
+}
+
+/*
+    Fills in the fields every request starts with.
+
+    Paramaters:
+        device      -> Card to run the search on.
+        client      -> The submitting file's state for the card.
+        request     -> Request to fill in.
+        start_val   -> Value to start the prime search from.
+        wait_mode   -> One of the WAIT_MODE_* values.
+        timeout_ms  -> Time the caller waits for the search at most, or 0
+                       for the search_timeout_ms module parameter.
+*/
+static void request_init(struct prime_device *device, struct queue_client *client,
+                         struct search_request *request, u32 start_val, unsigned int wait_mode,
+                         unsigned int timeout_ms) {
+    if(wait_mode == WAIT_MODE_DEFAULT) {
+        wait_mode = READ_ONCE(default_wait_mode);
+    }
+    if(timeout_ms == 0) {
+        timeout_ms = READ_ONCE(search_timeout_ms);
+    }
+
+    request->device = device;
+    request->client = client;
+    request->start_val = start_val;
+    request->search_result = 0;
+    request->wait_mode = wait_mode;
+    request->status = 0;
+    request->deadline_ns = timeout_ms != 0 ? ktime_get_ns() + (u64) timeout_ms * NSEC_PER_MSEC : 0;
+    request->range_results = NULL;
+    init_completion(&request->done);
+}
+
+/*
+    Queues a filled in request and starts it straight away if the card is
+    idle. When the queue is full the caller waits for room, or gets -EAGAIN
+    if nonblock is set.
+
+    Paramaters:
+        device      -> Card to run the search on.
+        client      -> The submitting file's state for the card.
+        request     -> Request to queue.
+        nonblock    -> Fail instead of waiting for room in the queue.
+
+    Return:
+        0 on success, -3 if the wait for room was interrupted, -EAGAIN if
+        the queue is full, -ENODEV if the card has been removed and -EIO
+        if it failed to recover from a PCI error.
+*/
+static int queue_add(struct prime_device *device, struct queue_client *client,
+                     struct search_request *request, bool nonblock) {
+    struct search_queue *queue = &device->queue;
+    unsigned long flags;
+    unsigned int limit;
+
+    spin_lock_irqsave(&device->dispatch_lock, flags);
+
+    //Backpressure. Wait for a request to finish when the queue is full.
+    limit = max(READ_ONCE(max_queue_depth), 1u);
+    while(queue->depth >= limit && !READ_ONCE(device->removed)) {
+        spin_unlock_irqrestore(&device->dispatch_lock, flags);
+
+        if(nonblock) {
+            return -EAGAIN;
+        }
+        if(wait_event_interruptible(queue->space_wait,
+                                    READ_ONCE(queue->depth) < limit || READ_ONCE(device->removed)) != 0) {
+            return -3;
+        }
+
+        spin_lock_irqsave(&device->dispatch_lock, flags);
+    }
+
+    if(READ_ONCE(device->removed)) {
+        spin_unlock_irqrestore(&device->dispatch_lock, flags);
+        return -ENODEV;
+    }
+    if(READ_ONCE(device->dead)) {
+        spin_unlock_irqrestore(&device->dispatch_lock, flags);
+        return -EIO;
+    }
+
+    //A client joins the round robin with its first waiting request
+    if(list_empty(&client->pending)) {
+        list_add_tail(&client->node, &queue->clients);
+    }
+    list_add_tail(&request->node, &client->pending);
+    queue->depth++;
+
+    if(!queue_device_busy(device)) {
+        queue_start_next(device);
+    }
+
+    spin_unlock_irqrestore(&device->dispatch_lock, flags);
+
+    return 0;
+}
+
+/*
+    Adds a search to a card's request queue and starts it straight away if
+    the card is idle. When the queue is full the caller waits for room, or
+    gets -EAGAIN if nonblock is set.
+
+    Paramaters:
+        device      -> Card to run the search on.
+        client      -> The submitting file's state for the card.
+        request     -> Request to fill in and queue.
+        start_val   -> Value to start the prime search from.
+        wait_mode   -> One of the WAIT_MODE_* values.
+        timeout_ms  -> Time the caller waits for the search at most, from
+                       now. 0 uses the search_timeout_ms module parameter.
+        nonblock    -> Fail instead of waiting for room in the queue.
+
+    Return:
+        0 on success, -3 if the wait for room was interrupted, -EAGAIN if
+        the queue is full, -ENODEV if the card has been removed and -EIO
+        if it failed to recover from a PCI error.
+*/
+int queue_submit(struct prime_device *device, struct queue_client *client,
+                 struct search_request *request, u32 start_val,
+                 unsigned int wait_mode, unsigned int timeout_ms, bool nonblock) {
+    request_init(device, client, request, start_val, wait_mode, timeout_ms);
+
+    return queue_add(device, client, request, nonblock);
+}
+
+/*
+    Adds a range search to a card's request queue. It stores every prime in
+    [start_val, range_end) into results until capacity of them have been
+    found, with no round trip to the caller between searches. It is waited
+    on with queue_wait like any other request.
+
+    Paramaters:
+        device      -> Card to run the searches on.
+        client      -> The submitting file's state for the card.
+        request     -> Request to fill in and queue.
+        start_val   -> First value of the range.
+        range_end   -> End of the range, which is not included. At most
+                       2^32.
+        results     -> Kernel buffer the primes are stored in.
+        capacity    -> Number of entries in results. Must not be zero.
+        nonblock    -> Fail instead of waiting for room in the queue.
+
+    Return:
+        The same as queue_submit.
+*/
+int queue_submit_range(struct prime_device *device, struct queue_client *client,
+                       struct search_request *request, u32 start_val, u64 range_end,
+                       u32 *results, u32 capacity, bool nonblock) {
+    //The chain is driven by the interrupt so there is nothing to spin on
+    request_init(device, client, request, start_val, WAIT_MODE_INTERRUPT, 0);
+    request->range_results = results;
+    request->range_capacity = capacity;
+    request->range_count = 0;
+    request->range_end = range_end;
+    request->range_next = start_val;
+    request->range_cycles = 0;
+
+    return queue_add(device, client, request, nonblock);
+}
+
+/*
+    Counts how a completed request ended and how long its caller took to
+    run again.
+
+    Paramaters:
+        request     -> Request that has completed.
+
+    Return:
+        The status of the request.
+*/
+static int queue_wait_done(struct search_request *request) {
+    struct prime_device *device = request->device;
+
+    if(request->status != 0) {
+        this_cpu_inc(device->stats->errors);
+    }
+    else {
+        stats_histogram_add(device->stats, irq_to_wakeup_hist, ktime_get_ns() - request->complete_ns);
+    }
+
+    return request->status;
+}
+
+/*
+    Waits for a submitted search to finish. If the wait is interrupted or
+    the request's deadline passes the request is taken off the queue, or
+    abandoned if it is already running.
+
+    Paramaters:
+        request     -> Request to wait for.
+
+    Return:
+        0 on success with the result in request->search_result, -3 if the
+        wait was interrupted, -ETIMEDOUT if the deadline passed,
+        -ECANCELED if the search was cancelled and -ENODEV if the card was
+        removed.
+*/
+int queue_wait(struct search_request *request) {
+    struct prime_device *device = request->device;
+    struct search_queue *queue = &device->queue;
+    unsigned long flags;
+    long timeout = MAX_SCHEDULE_TIMEOUT;
+    long remaining;
+    u64 now;
+    int status;
+
+    if(request->wait_mode == WAIT_MODE_HYBRID) {
+        hybrid_wait(request);
+    }
+
+    if(request->deadline_ns != 0) {
+        now = ktime_get_ns();
+        timeout = now < request->deadline_ns ? nsecs_to_jiffies(request->deadline_ns - now) : 0;
+    }
+
+    remaining = wait_for_completion_interruptible_timeout(&request->done, timeout);
+    if(remaining > 0) {
+        return queue_wait_done(request);
+    }
+    status = remaining == 0 ? -ETIMEDOUT : -3;
+
+    spin_lock_irqsave(&device->dispatch_lock, flags);
+
+    //It may have finished while the wait was being given up
+    if(completion_done(&request->done)) {
+        spin_unlock_irqrestore(&device->dispatch_lock, flags);
+        return queue_wait_done(request);
+    }
+
+    if(queue->running == request) {
+        //The card stays busy with the search until its interrupt arrives,
+        //or until the watchdog resets the card if it never does
+        queue->running = NULL;
+        queue->orphan_running = true;
+    }
+    else {
+        list_del(&request->node);
+        if(list_empty(&request->client->pending)) {
+            list_del(&request->client->node);
+        }
+    }
+    queue->depth--;
+    wake_up(&queue->space_wait);
+
+    spin_unlock_irqrestore(&device->dispatch_lock, flags);
+
+    this_cpu_inc(device->stats->errors);
+    if(status == -ETIMEDOUT) {
+        this_cpu_inc(device->stats->timeouts);
+    }
+
+    return status;
+}
+
+/*
+    Returns the number of requests waiting or running on a card.
+
+    Paramaters:
+        device  -> Card to look at.
+*/
+unsigned int queue_depth(struct prime_device *device) {
+    return READ_ONCE(device->queue.depth);
+}
+
+/*
+    Reports whether a search is running on the card. Must be called with
+    the card's dispatch lock held.
+
+    Paramaters:
+        device  -> Card to look at.
+*/
+bool queue_device_busy(struct prime_device *device) {
+    return device->queue.running != NULL || device->queue.orphan_running ||
+           device->ring_state.search_running || device->queue.resetting;
+}
+
+/*
+    Completes every search the card has finished and restarts it straight
+    away, until the card is idle or busy with a search that is not done
+    yet. When both rings and queued requests are waiting they take turns.
+    Called from the interrupt thread and the poller, which may sleep.
+
+    Paramaters:
+        device  -> Card to drain.
+        busy    -> Set to whether a search is still running afterwards.
+
+    Return:
+        The number of searches completed.
+*/
+unsigned int queue_drain(struct prime_device *device, bool *busy) {
+    struct search_queue *queue = &device->queue;
+    unsigned int completed = 0;
+    unsigned int batch = 0;
+    unsigned long flags;
+    bool prefer_queue;
+    u64 done_ns;
+    u64 start_ns;
+
+    spin_lock_irqsave(&device->dispatch_lock, flags);
+
+    //DONE_FLAG is checked before every completion, so an interrupt of a
+    //search a spinning waiter already completed finds the next search not
+    //done yet and is ignored
+    while(!queue->resetting && queue_device_busy(device) &&
+          prime_read_register(device, DONE_FLAG) == 1) {
+        done_ns = ktime_get_ns();
+        //Read before a range search restarts the card from its result
+        start_ns = device->search_start_ns;
+        prefer_queue = false;
+
+        if(ring_complete_search(device)) {
+            prefer_queue = true;
+        }
+        else if(queue->running != NULL) {
+            queue_complete_running(device);
+        }
+        else {
+            queue->orphan_running = false;
+            prime_count_completion(device, prime_read_cycles(device));
+        }
+
+        stats_histogram_add(device->stats, submit_to_irq_hist, done_ns - start_ns);
+        completed++;
+
+        //A range search keeps the card busy with its next search
+        if(!queue_device_busy(device)) {
+            start_next(device, prefer_queue);
+        }
+
+        //Short searches can finish as fast as they are restarted. Let
+        //interrupts and other tasks in every so often.
+        if(++batch == DRAIN_BATCH) {
+            spin_unlock_irqrestore(&device->dispatch_lock, flags);
+            cond_resched();
+            spin_lock_irqsave(&device->dispatch_lock, flags);
+            batch = 0;
+        }
+    }
+
+    *busy = queue_device_busy(device);
+
+    spin_unlock_irqrestore(&device->dispatch_lock, flags);
+
+    return completed;
+}
+
+/*
+    Cancels every waiting and running request of a client with
+    -ECANCELED. A running search is abandoned and the card stays busy
+    until it finishes.
+
+    Paramaters:
+        device  -> Card the requests were submitted to.
+        client  -> The submitting file's state for the card.
+
+    Return:
+        The number of requests cancelled.
+*/
+unsigned int queue_cancel(struct prime_device *device, struct queue_client *client) {
+    struct search_queue *queue = &device->queue;
+    struct search_request *request, *next_request;
+    unsigned int cancelled = 0;
+    unsigned long flags;
+
+    spin_lock_irqsave(&device->dispatch_lock, flags);
+
+    //A client is in the round robin while it has waiting requests
+    if(!list_empty(&client->pending)) {
+        list_del(&client->node);
+    }
+    list_for_each_entry_safe(request, next_request, &client->pending, node) {
+        list_del_init(&request->node);
+        request->status = -ECANCELED;
+        complete(&request->done);
+        cancelled++;
+    }
+
+    if(queue->running != NULL && queue->running->client == client) {
+        //The card stays busy with the search until its interrupt arrives
+        request = queue->running;
+        queue->running = NULL;
+        queue->orphan_running = true;
+        request->status = -ECANCELED;
+        complete(&request->done);
+        cancelled++;
+    }
+
+    queue->depth -= cancelled;
+
+    spin_unlock_irqrestore(&device->dispatch_lock, flags);
+
+    if(cancelled != 0) {
+        this_cpu_add(device->stats->cancels, cancelled);
+        wake_up(&queue->space_wait);
+    }
+
+    return cancelled;
+}
+
+/*
+    Takes the running search off the card before it is reset and stops
+    anything else from being started. A queued request goes back to the
+    front of the queue and a ring search is started again once the reset
+    is over. An abandoned search is dropped.
+
+    Paramaters:
+        device  -> Card that is about to be reset.
+*/
+void queue_reset_begin(struct prime_device *device) {
+    struct search_queue *queue = &device->queue;
+    struct search_request *request;
+    struct queue_client *client;
+    unsigned long flags;
+
+    spin_lock_irqsave(&device->dispatch_lock, flags);
+
+    queue->resetting = true;
+    queue->orphan_running = false;
+    ring_requeue_search(device);
+
+    request = queue->running;
+    if(request != NULL) {
+        queue->running = NULL;
+
+        //Its client gets the next turn so the request keeps its place
+        client = request->client;
+        if(list_empty(&client->pending)) {
+            list_add(&client->node, &queue->clients);
+        }
+        else {
+            list_move(&client->node, &queue->clients);
+        }
+        list_add(&request->node, &client->pending);
+    }
+
+    spin_unlock_irqrestore(&device->dispatch_lock, flags);
+}
+
+/*
+    Ends a reset started with queue_reset_begin and starts the next search.
+
+    Paramaters:
+        device  -> Card that was reset.
+*/
+void queue_reset_end(struct prime_device *device) {
+    unsigned long flags;
+
+    spin_lock_irqsave(&device->dispatch_lock, flags);
+
+    device->queue.resetting = false;
+    if(!READ_ONCE(device->removed) && !READ_ONCE(device->dead) && !queue_device_busy(device)) {
+        start_next(device, false);
+    }
+
+    spin_unlock_irqrestore(&device->dispatch_lock, flags);
+}
+
+/*
+    Fails every waiting and running request. Called once the card has been
+    removed or has failed to recover from a PCI error.
+
+    Paramaters:
+        device  -> Card that is gone.
+        status  -> Status the requests fail with, -ENODEV or -EIO.
+*/
+void queue_fail_all(struct prime_device *device, int status) {
+    struct search_queue *queue = &device->queue;
+    struct queue_client *client, *next_client;
+    struct search_request *request, *next_request;
+    unsigned long flags;
+
+    spin_lock_irqsave(&device->dispatch_lock, flags);
+
+    list_for_each_entry_safe(client, next_client, &queue->clients, node) {
+        list_for_each_entry_safe(request, next_request, &client->pending, node) {
+            list_del_init(&request->node);
+            request->status = status;
+            complete(&request->done);
+        }
+        list_del_init(&client->node);
+    }
+
+    if(queue->running != NULL) {
+        queue->running->status = status;
+        complete(&queue->running->done);
+        queue->running = NULL;
+    }
+    queue->orphan_running = false;
+    queue->depth = 0;
+
+    spin_unlock_irqrestore(&device->dispatch_lock, flags);
+
+    wake_up_all(&queue->space_wait);
+}
@@ -0,0 +1,237 @@
+#ifndef QUEUE_H
+#define QUEUE_H
+
+#include "device_specific.h"
+
+#include <linux/list.h>
+#include <linux/completion.h>
+#include <linux/wait.h>
+#include <linux/types.h>
+
+struct prime_device;
+
+//Per card state of an open file. While the file has requests waiting on
+//a card it is linked into that card's round robin of clients.
+struct queue_client {
+    //Entry in the card's list of clients with waiting requests
+    struct list_head node;
+    //Requests of this client waiting to be started, oldest first
+    struct list_head pending;
+};
+
+//A blocking search submitted to a card's request queue. It is owned by the
+//caller, who must wait for it with queue_wait before it goes away.
+struct search_request {
+    //Entry in the client's list of waiting requests
+    struct list_head node;
+    struct prime_device *device;
+    struct queue_client *client;
+
+    u32 start_val;
+    u32 search_result;
+    //WAIT_MODE_INTERRUPT or WAIT_MODE_HYBRID
+    unsigned int wait_mode;
+    //0 once the search has finished and negative when it failed
+    int status;
+
+    //Time the caller stops waiting for the search, 0 for no deadline
+    u64 deadline_ns;
+
+    //Time the search was started on the card
+    u64 start_ns;
+    //Time the search was completed, to measure how long its caller takes
+    //to wake up
+    u64 complete_ns;
+
+    //Range searches only, range_results is NULL otherwise. The card is
+    //restarted from the result plus one straight from the interrupt handler
+    //until range_end is reached or range_capacity primes have been stored.
+    u32 *range_results;
+    u32 range_capacity;
+    u32 range_count;
+    u64 range_end;
+    //Where the range continues, range_end once it is finished
+    u64 range_next;
+    //Sum of the cycle counts of the range's searches
+    u64 range_cycles;
+
+    //Completed when the search has finished or failed
+    struct completion done;
+};
+
+//Per card request queue. Embedded in struct prime_device and protected by
+//the card's dispatch lock.
+struct search_queue {
+    //Clients with waiting requests. Each turn the client at the front has
+    //its oldest request started and moves to the back.
+    struct list_head clients;
+    //Number of requests waiting or running
+    unsigned int depth;
+    //Request running on the card, NULL if none
+    struct search_request *running;
+    //Set when the caller of the running request gave up on it. The card
+    //stays busy until the interrupt of that search arrives.
+    bool orphan_running;
+    //Set while the card is being reset. Nothing is started or completed
+    //in the meantime.
+    bool resetting;
+    //Woken when depth drops below the limit or the card is removed
+    wait_queue_head_t space_wait;
+};
+
+/*
+    Initializes the request queue of a card.
+
+    Paramaters:
+        queue   -> Queue to initialize.
+*/
+void queue_init(struct search_queue *queue);
+
+/*
+    Initializes the per card state of an open file.
+
+    Paramaters:
+        client  -> Client to initialize.
+*/
+void queue_client_init(struct queue_client *client);
+
+/*
+    Adds a search to a card's request queue and starts it straight away if
+    the card is idle. When the queue is full the caller waits for room, or
+    gets -EAGAIN if nonblock is set.
+
+    Paramaters:
+        device      -> Card to run the search on.
+        client      -> The submitting file's state for the card.
+        request     -> Request to fill in and queue.
+        start_val   -> Value to start the prime search from.
+        wait_mode   -> One of the WAIT_MODE_* values.
+        timeout_ms  -> Time the caller waits for the search at most, from
+                       now. 0 uses the search_timeout_ms module parameter.
+        nonblock    -> Fail instead of waiting for room in the queue.
+
+    Return:
+        0 on success, -3 if the wait for room was interrupted, -EAGAIN if
+        the queue is full, -ENODEV if the card has been removed and -EIO
+        if it failed to recover from a PCI error.
+*/
+int queue_submit(struct prime_device *device, struct queue_client *client,
+                 struct search_request *request, u32 start_val,
+                 unsigned int wait_mode, unsigned int timeout_ms, bool nonblock);
+
+/*
+    Adds a range search to a card's request queue. It stores every prime in
+    [start_val, range_end) into results until capacity of them have been
+    found, with no round trip to the caller between searches. It is waited
+    on with queue_wait like any other request.
+
+    Paramaters:
+        device      -> Card to run the searches on.
+        client      -> The submitting file's state for the card.
+        request     -> Request to fill in and queue.
+        start_val   -> First value of the range.
+        range_end   -> End of the range, which is not included. At most
+                       2^32.
+        results     -> Kernel buffer the primes are stored in.
+        capacity    -> Number of entries in results. Must not be zero.
+        nonblock    -> Fail instead of waiting for room in the queue.
+
+    Return:
+        The same as queue_submit.
+*/
+int queue_submit_range(struct prime_device *device, struct queue_client *client,
+                       struct search_request *request, u32 start_val, u64 range_end,
+                       u32 *results, u32 capacity, bool nonblock);
+
+/*
+    Waits for a submitted search to finish. If the wait is interrupted or
+    the request's deadline passes the request is taken off the queue, or
+    abandoned if it is already running.
+
+    Paramaters:
+        request     -> Request to wait for.
+
+    Return:
+        0 on success with the result in request->search_result, -3 if the
+        wait was interrupted, -ETIMEDOUT if the deadline passed,
+        -ECANCELED if the search was cancelled and -ENODEV if the card was
+        removed.
+*/
+int queue_wait(struct search_request *request);
+
+/*
+    Returns the number of requests waiting or running on a card.
+
+    Paramaters:
+        device  -> Card to look at.
+*/
+unsigned int queue_depth(struct prime_device *device);
+
+/*
+    Reports whether a search is running on the card. Must be called with
+    the card's dispatch lock held.
+
+    Paramaters:
+        device  -> Card to look at.
+*/
+bool queue_device_busy(struct prime_device *device);
+
+/*
+    Completes every search the card has finished and restarts it straight
+    away, until the card is idle or busy with a search that is not done
+    yet. When both rings and queued requests are waiting they take turns.
+    Called from the interrupt thread and the poller, which may sleep.
+
+    Paramaters:
+        device  -> Card to drain.
+        busy    -> Set to whether a search is still running afterwards.
+
+    Return:
+        The number of searches completed.
+*/
+unsigned int queue_drain(struct prime_device *device, bool *busy);
+
+/*
+    Cancels every waiting and running request of a client with
+    -ECANCELED. A running search is abandoned and the card stays busy
+    until it finishes.
+
+    Paramaters:
+        device  -> Card the requests were submitted to.
+        client  -> The submitting file's state for the card.
+
+    Return:
+        The number of requests cancelled.
+*/
+unsigned int queue_cancel(struct prime_device *device, struct queue_client *client);
+
+/*
+    Takes the running search off the card before it is reset and stops
+    anything else from being started. A queued request goes back to the
+    front of the queue and a ring search is started again once the reset
+    is over. An abandoned search is dropped.
+
+    Paramaters:
+        device  -> Card that is about to be reset.
+*/
+void queue_reset_begin(struct prime_device *device);
+
+/*
+    Ends a reset started with queue_reset_begin and starts the next search.
+
+    Paramaters:
+        device  -> Card that was reset.
+*/
+void queue_reset_end(struct prime_device *device);
+
+/*
+    Fails every waiting and running request. Called once the card has been
+    removed or has failed to recover from a PCI error.
+
+    Paramaters:
+        device  -> Card that is gone.
+        status  -> Status the requests fail with, -ENODEV or -EIO.
+*/
+void queue_fail_all(struct prime_device *device, int status);
+
+#endif
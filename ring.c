@@ -0,0 +1,327 @@
+#include "ring.h"
+#include "queue.h"
+#include "pcie_ctrl.h"
+#include "prime_finder_trace.h"
+
+#include <linux/spinlock.h>
+#include <linux/vmalloc.h>
+#include <linux/io.h>
+#include <linux/ktime.h>
+
+
+/*
+    Pops the next submission and starts it on the card. Must be called
+    with the card's dispatch lock held.
+
+    Paramaters:
+        device  -> Card to start the search on.
+        ring    -> Rings to take the submission from.
+
+    Return:
+        true if a search was started and false if there was nothing to
+        start or the completion queue has no room for the result.
+*/
+static bool ring_start_next(struct prime_device *device, struct ring_shared *ring) {
+    struct ring_device_state *state = &device->ring_state;
+    u32 head = ring->sq_head;
+    u32 tail = smp_load_acquire(&ring->sq_tail);
+    struct ring_sqe *sqe;
+
+    if(head == tail) {
+        return false;
+    }
+
+    //Only one search runs at a time so a single free completion slot is
+    //enough to guarantee that the result can be posted.
+    if(ring->cq_tail - READ_ONCE(ring->cq_head) >= RING_ENTRIES) {
+        return false;
+    }
+
+    sqe = &ring->sq[head & (RING_ENTRIES - 1)];
+    state->running_user_data = READ_ONCE(sqe->user_data);
+    state->running_start_val = READ_ONCE(sqe->start_val);
+
+    //Hand the slot back to userspace before the card is started
+    smp_store_release(&ring->sq_head, head + 1);
+
+    state->search_running = true;
+    trace_prime_submit(state->running_start_val);
+    prime_start_search(device, state->running_start_val, ktime_get_ns());
+
+    return true;
+}
+
+/*
+    Starts the next submission or, if there is none, tells userspace that
+    it has to call IOCTL_RING_ENTER for the next one. Must be called with
+    the card's dispatch lock held.
+
+    Paramaters:
+        device  -> Card to start the search on.
+        ring    -> Rings to take the submission from.
+
+    Return:
+        true if a search was started.
+*/
+static bool ring_start_or_sleep(struct prime_device *device, struct ring_shared *ring) {
+    if(ring_start_next(device, ring)) {
+        return true;
+    }
+
+    //Publish the flag before looking at the queue one last time. Userspace
+    //stores its tail before reading the flag so one of the two sides is
+    //guaranteed to see the other's update.
+    WRITE_ONCE(ring->flags, ring->flags | RING_FLAG_NEED_WAKEUP);
+    smp_mb();
+
+    if(ring_start_next(device, ring)) {
+        WRITE_ONCE(ring->flags, ring->flags & ~RING_FLAG_NEED_WAKEUP);
+        return true;
+    }
+
+    return false;
+}
+
+/*
+    Initializes the ring bookkeeping of a card.
+
+    Paramaters:
+        state   -> State to initialize.
+*/
+void ring_init_device_state(struct ring_device_state *state) {
+    state->active_ring = NULL;
+    state->search_running = false;
+    state->restart_pending = false;
+}
+
+/*
+    Maps a file's rings into userspace. The rings are allocated on the
+    first call.
+
+    Paramaters:
+        ring_ptr    -> Where the file keeps its rings. Filled in when the
+                       rings are allocated.
+        vma         -> Userspace region to map the rings into.
+
+    Return:
+        0 on success and a negative value otherwise.
+*/
+int ring_mmap(struct ring_shared **ring_ptr, struct vm_area_struct *vma) {
+    struct ring_shared *ring;
+
+    if(vma->vm_end - vma->vm_start > PAGE_ALIGN(sizeof(struct ring_shared))) {
+        return -EINVAL;
+    }
+
+    ring = READ_ONCE(*ring_ptr);
+    if(ring == NULL) {
+        //vmalloc_user returns zeroed memory that is safe to map to userspace
+        ring = vmalloc_user(sizeof(struct ring_shared));
+        if(ring == NULL) {
+            return -ENOMEM;
+        }
+        ring->flags = RING_FLAG_NEED_WAKEUP;
+
+        //Another thread may have mapped the rings at the same time
+        if(cmpxchg(ring_ptr, NULL, ring) != NULL) {
+            vfree(ring);
+            ring = *ring_ptr;
+        }
+    }
+
+    return remap_vmalloc_range(vma, ring, 0);
+}
+
+/*
+    Makes a file's rings the ones that own the card and starts their next
+    submission if the card is idle. While the card is busy with a queued
+    blocking search the submissions are picked up by the interrupt handler
+    once it finishes.
+
+    Paramaters:
+        device  -> Card the file was opened on.
+        ring    -> The file's rings.
+
+    Return:
+        0 on success, -EBUSY if another file's rings own the card, -EIO
+        if the card failed to recover from a PCI error and -1 if the rings
+        have not been mapped.
+*/
+long int ring_enter(struct prime_device *device, struct ring_shared *ring) {
+    struct ring_device_state *state = &device->ring_state;
+    unsigned long flags;
+    long int status = 0;
+
+    if(ring == NULL) {
+        return -1;
+    }
+
+    spin_lock_irqsave(&device->dispatch_lock, flags);
+
+    if(READ_ONCE(device->removed)) {
+        status = -ENODEV;
+    }
+    else if(READ_ONCE(device->dead)) {
+        status = -EIO;
+    }
+    else if(state->active_ring != NULL && state->active_ring != ring) {
+        status = -EBUSY;
+    }
+    else if(queue_device_busy(device)) {
+        //The interrupt handler will pick up new submissions by itself
+        state->active_ring = ring;
+        WRITE_ONCE(ring->flags, ring->flags & ~RING_FLAG_NEED_WAKEUP);
+    }
+    else if(ring_start_or_sleep(device, ring)) {
+        state->active_ring = ring;
+        WRITE_ONCE(ring->flags, ring->flags & ~RING_FLAG_NEED_WAKEUP);
+    }
+
+    spin_unlock_irqrestore(&device->dispatch_lock, flags);
+
+    return status;
+}
+
+/*
+    Detaches and frees a file's rings.
+
+    Paramaters:
+        device  -> Card the file was opened on.
+        ring    -> The file's rings. May be NULL.
+*/
+void ring_release(struct prime_device *device, struct ring_shared *ring) {
+    struct ring_device_state *state = &device->ring_state;
+    unsigned long flags;
+
+    if(ring == NULL) {
+        return;
+    }
+
+    //Any search that is still running is left to finish on its own. Its
+    //interrupt is swallowed since search_running stays set.
+    spin_lock_irqsave(&device->dispatch_lock, flags);
+    if(state->active_ring == ring) {
+        state->active_ring = NULL;
+    }
+    spin_unlock_irqrestore(&device->dispatch_lock, flags);
+
+    vfree(ring);
+}
+
+/*
+    Reports which poll events are ready on a file's rings. The rings are
+    readable while there are completions to reap and writable while the
+    submission ring has room.
+
+    Paramaters:
+        ring    -> The file's rings.
+
+    Return:
+        The ready poll events.
+*/
+__poll_t ring_poll(struct ring_shared *ring) {
+    __poll_t mask = 0;
+
+    if(READ_ONCE(ring->cq_head) != smp_load_acquire(&ring->cq_tail)) {
+        mask |= EPOLLIN | EPOLLRDNORM;
+    }
+
+    if(READ_ONCE(ring->sq_tail) - READ_ONCE(ring->sq_head) < RING_ENTRIES) {
+        mask |= EPOLLOUT | EPOLLWRNORM;
+    }
+
+    return mask;
+}
+
+/*
+    Called from queue_drain with the card's dispatch lock held. If the
+    finished search came from a ring its completion is posted.
+
+    Paramaters:
+        device  -> Card that raised the interrupt.
+
+    Return:
+        true if the interrupt belonged to a ring search and false if it
+        should be handled by the request queue.
+*/
+bool ring_complete_search(struct prime_device *device) {
+    struct ring_device_state *state = &device->ring_state;
+    struct ring_shared *ring;
+    struct ring_cqe *cqe;
+    u32 tail;
+
+    if(!state->search_running) {
+        return false;
+    }
+    state->search_running = false;
+    prime_count_completion(device, prime_read_cycles(device));
+
+    ring = state->active_ring;
+    if(ring != NULL) {
+        //Post the completion
+        tail = ring->cq_tail;
+        cqe = &ring->cq[tail & (RING_ENTRIES - 1)];
+        cqe->user_data = state->running_user_data;
+        cqe->start_val = state->running_start_val;
+        cqe->search_result = prime_read_register(device, PRIME_NUMBER);
+        trace_prime_complete(cqe->start_val, cqe->search_result);
+        smp_store_release(&ring->cq_tail, tail + 1);
+    }
+
+    return true;
+}
+
+/*
+    Takes the running ring search off the card before it is reset so that
+    ring_start_active starts it again afterwards. Must be called with the
+    card's dispatch lock held.
+
+    Paramaters:
+        device  -> Card that is about to be reset.
+*/
+void ring_requeue_search(struct prime_device *device) {
+    struct ring_device_state *state = &device->ring_state;
+
+    if(state->search_running) {
+        state->search_running = false;
+        state->restart_pending = true;
+    }
+}
+
+/*
+    Starts the next submission of the rings that own the card. Must be
+    called with the card's dispatch lock held while the card is idle.
+
+    Paramaters:
+        device  -> Card to start the search on.
+
+    Return:
+        true if a search was started. The rings give up the card when they
+        have nothing left to start.
+*/
+bool ring_start_active(struct prime_device *device) {
+    struct ring_device_state *state = &device->ring_state;
+
+    if(state->active_ring == NULL) {
+        state->restart_pending = false;
+        return false;
+    }
+
+    //A search taken off the card by a reset goes first. Its submission
+    //slot was already handed back so it is started from the saved values.
+    if(state->restart_pending) {
+        state->restart_pending = false;
+        state->search_running = true;
+        trace_prime_submit(state->running_start_val);
+        prime_start_search(device, state->running_start_val, ktime_get_ns());
+        return true;
+    }
+
+    //Keep the card busy with the next submission
+    if(!ring_start_or_sleep(device, state->active_ring)) {
+        state->active_ring = NULL;
+        return false;
+    }
+
+    return true;
+}
@@ -0,0 +1,162 @@
+#ifndef RING_H
+#define RING_H
+
+#include "device_specific.h"
+
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/types.h>
+#include <linux/spinlock.h>
+#include <linux/poll.h>
+
+struct prime_device;
+
+//Submission queue entry written by userspace
+struct ring_sqe {
+    u64 user_data;
+    u32 start_val;
+    u32 reserved;
+};
+
+//Completion queue entry written by the driver
+struct ring_cqe {
+    u64 user_data;
+    u32 start_val;
+    u32 search_result;
+};
+
+//Layout of the pages shared between the driver and userspace. This
+//structure is mirrored in prime.c using the stdint.h integer definitions.
+//Userspace produces into sq and consumes from cq, the driver does the
+//opposite. The head and tail values are free running and are masked with
+//RING_ENTRIES - 1 to get the slot index.
+struct ring_shared {
+    u32 sq_head;
+    u32 sq_tail;
+    u32 cq_head;
+    u32 cq_tail;
+    u32 flags;
+    u32 reserved[3];
+    struct ring_sqe sq[RING_ENTRIES];
+    struct ring_cqe cq[RING_ENTRIES];
+};
+
+//Per card ring bookkeeping. Embedded in struct prime_device and
+//protected by the card's dispatch lock.
+struct ring_device_state {
+    //Rings that currently own the card. NULL when the card is free or
+    //when the owning file was closed while its last search was running.
+    struct ring_shared *active_ring;
+
+    //Set while a search started from a ring is running on the card. This
+    //is tracked separately from active_ring so that the interrupt of an
+    //orphaned search is not mistaken for the completion of a queued
+    //blocking search.
+    bool search_running;
+    //Set when the running search was taken off the card to reset it. It
+    //is started again before the next submission.
+    bool restart_pending;
+
+    //Details of the running search needed to fill in its completion entry
+    u64 running_user_data;
+    u32 running_start_val;
+};
+
+/*
+    Initializes the ring bookkeeping of a card.
+
+    Paramaters:
+        state   -> State to initialize.
+*/
+void ring_init_device_state(struct ring_device_state *state);
+
+/*
+    Maps a file's rings into userspace. The rings are allocated on the
+    first call.
+
+    Paramaters:
+        ring_ptr    -> Where the file keeps its rings. Filled in when the
+                       rings are allocated.
+        vma         -> Userspace region to map the rings into.
+
+    Return:
+        0 on success and a negative value otherwise.
+*/
+int ring_mmap(struct ring_shared **ring_ptr, struct vm_area_struct *vma);
+
+/*
+    Makes a file's rings the ones that own the card and starts their next
+    submission if the card is idle. While the card is busy with a queued
+    blocking search the submissions are picked up by the interrupt handler
+    once it finishes.
+
+    Paramaters:
+        device  -> Card the file was opened on.
+        ring    -> The file's rings.
+
+    Return:
+        0 on success, -EBUSY if another file's rings own the card, -EIO
+        if the card failed to recover from a PCI error and -1 if the rings
+        have not been mapped.
+*/
+long int ring_enter(struct prime_device *device, struct ring_shared *ring);
+
+/*
+    Detaches and frees a file's rings.
+
+    Paramaters:
+        device  -> Card the file was opened on.
+        ring    -> The file's rings. May be NULL.
+*/
+void ring_release(struct prime_device *device, struct ring_shared *ring);
+
+/*
+    Reports which poll events are ready on a file's rings. The rings are
+    readable while there are completions to reap and writable while the
+    submission ring has room.
+
+    Paramaters:
+        ring    -> The file's rings.
+
+    Return:
+        The ready poll events.
+*/
+__poll_t ring_poll(struct ring_shared *ring);
+
+/*
+    Called from queue_drain with the card's dispatch lock held. If the
+    finished search came from a ring its completion is posted.
+
+    Paramaters:
+        device  -> Card that raised the interrupt.
+
+    Return:
+        true if the interrupt belonged to a ring search and false if it
+        should be handled by the request queue.
+*/
+bool ring_complete_search(struct prime_device *device);
+
+/*
+    Takes the running ring search off the card before it is reset so that
+    ring_start_active starts it again afterwards. Must be called with the
+    card's dispatch lock held.
+
+    Paramaters:
+        device  -> Card that is about to be reset.
+*/
+void ring_requeue_search(struct prime_device *device);
+
+/*
+    Starts the next submission of the rings that own the card. Must be
+    called with the card's dispatch lock held while the card is idle.
+
+    Paramaters:
+        device  -> Card to start the search on.
+
+    Return:
+        true if a search was started. The rings give up the card when they
+        have nothing left to start.
+*/
+bool ring_start_active(struct prime_device *device);
+
+#endif
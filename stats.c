@@ -0,0 +1,165 @@
+#include "stats.h"
+#include "pcie_ctrl.h"
+
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/percpu.h>
+#include <linux/cpumask.h>
+
+
+//Counters for events on the aggregate node
+struct prime_stats __percpu *driver_stats;
+
+//debugfs directory of the driver
+static struct dentry *stats_root;
+
+
+/*
+    Allocates zeroed per-CPU counters.
+
+    Return:
+        The counters, or NULL on failure.
+*/
+struct prime_stats __percpu *stats_alloc(void) {
+    return alloc_percpu(struct prime_stats);
+}
+
+/*
+    Frees counters returned by stats_alloc.
+
+    Paramaters:
+        stats   -> Counters to free. May be NULL.
+*/
+void stats_free(struct prime_stats __percpu *stats) {
+    free_percpu(stats);
+}
+
+/*
+    Prints a histogram as its name followed by the count of every bucket.
+
+    Paramaters:
+        s       -> File being read.
+        name    -> Name of the histogram.
+        stats   -> Counters the histogram is part of.
+        offset  -> Offset of the histogram in struct prime_stats.
+*/
+static void stats_show_histogram(struct seq_file *s, const char *name,
+                                 struct prime_stats __percpu *stats, size_t offset) {
+    const u64 *hist;
+    u64 total;
+    int bucket;
+    int cpu;
+
+    seq_printf(s, "%s", name);
+    for(bucket = 0; bucket < STATS_BUCKETS; bucket++) {
+        total = 0;
+        for_each_possible_cpu(cpu) {
+            hist = (const u64*) ((const u8*) per_cpu_ptr(stats, cpu) + offset);
+            total += READ_ONCE(hist[bucket]);
+        }
+        seq_printf(s, " %llu", total);
+    }
+    seq_putc(s, '\n');
+}
+
+//Adds up one counter over every CPU
+#define stats_sum(stats, field) ({                          \
+    u64 __total = 0;                                        \
+    int __cpu;                                              \
+    for_each_possible_cpu(__cpu) {                          \
+        __total += READ_ONCE(per_cpu_ptr(stats, __cpu)->field); \
+    }                                                       \
+    __total;                                                \
+})
+
+/*
+    Prints every counter as a name and a value per line, and every
+    histogram as a name and STATS_BUCKETS counts on one line, so that
+    monitoring can scrape the file without parsing logs.
+
+    Paramaters:
+        s       -> File being read. Its private data is the counters.
+        unused  -> Not used.
+    Return:
+        0
+*/
+static int stats_show(struct seq_file *s, void *unused) {
+    struct prime_stats __percpu *stats = (struct prime_stats __percpu __force *) s->private;
+
+    seq_printf(s, "searches_started %llu\n", stats_sum(stats, searches_started));
+    seq_printf(s, "searches_completed %llu\n", stats_sum(stats, searches_completed));
+    seq_printf(s, "interrupts %llu\n", stats_sum(stats, interrupts));
+    seq_printf(s, "polled_completions %llu\n", stats_sum(stats, polled_completions));
+    seq_printf(s, "poll_entries %llu\n", stats_sum(stats, poll_entries));
+    seq_printf(s, "errors %llu\n", stats_sum(stats, errors));
+    seq_printf(s, "copy_failures %llu\n", stats_sum(stats, copy_failures));
+    seq_printf(s, "timeouts %llu\n", stats_sum(stats, timeouts));
+    seq_printf(s, "cancels %llu\n", stats_sum(stats, cancels));
+    seq_printf(s, "resets %llu\n", stats_sum(stats, resets));
+    seq_printf(s, "watchdog_resets %llu\n", stats_sum(stats, watchdog_resets));
+
+    stats_show_histogram(s, "cycles_log2", stats, offsetof(struct prime_stats, cycles_hist));
+    stats_show_histogram(s, "submit_to_irq_ns_log2", stats, offsetof(struct prime_stats, submit_to_irq_hist));
+    stats_show_histogram(s, "irq_to_wakeup_ns_log2", stats, offsetof(struct prime_stats, irq_to_wakeup_hist));
+
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(stats);
+
+/*
+    Allocates the driver's counters and creates the debugfs directory of
+    the driver.
+
+    Return:
+        0 on success and a negative value on failure.
+*/
+int stats_init(void) {
+    driver_stats = stats_alloc();
+    if(driver_stats == NULL) {
+        return -ENOMEM;
+    }
+
+    //debugfs is optional, the driver works the same without it
+    stats_root = debugfs_create_dir(DEVICE_NAME, NULL);
+    debugfs_create_file("stats", 0444, stats_root, (void __force *) driver_stats, &stats_fops);
+
+    return 0;
+}
+
+/*
+    Removes the debugfs directory of the driver and frees its counters.
+*/
+void stats_exit(void) {
+    debugfs_remove_recursive(stats_root);
+    stats_root = NULL;
+
+    stats_free(driver_stats);
+    driver_stats = NULL;
+}
+
+/*
+    Creates the debugfs directory of a card. A failure only means the card
+    has no statistics file, so nothing is reported.
+
+    Paramaters:
+        device  -> Card with a minor number.
+*/
+void stats_add_device(struct prime_device *device) {
+    char name[16];
+
+    snprintf(name, sizeof(name), "card%d", device->minor);
+    device->debugfs_dir = debugfs_create_dir(name, stats_root);
+    debugfs_create_file("stats", 0444, device->debugfs_dir, (void __force *) device->stats, &stats_fops);
+}
+
+/*
+    Removes the debugfs directory of a card. Waits for readers of its
+    statistics file to finish.
+
+    Paramaters:
+        device  -> Card to remove the directory of.
+*/
+void stats_remove_device(struct prime_device *device) {
+    debugfs_remove_recursive(device->debugfs_dir);
+    device->debugfs_dir = NULL;
+}
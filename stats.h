@@ -0,0 +1,116 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <linux/types.h>
+#include <linux/percpu.h>
+#include <linux/bitops.h>
+#include <linux/minmax.h>
+
+struct prime_device;
+
+//Buckets of each histogram. Bucket b counts the values in [2^(b-1), 2^b),
+//bucket 0 counts zeros and the last bucket everything larger.
+#define STATS_BUCKETS 64
+
+//Counters of a card, or of the driver for events on the aggregate node.
+//One copy is kept per CPU and updated with this_cpu_inc, so no lock or
+//atomic is needed on the hot paths. Readers add up the copies of every
+//CPU. They are exported through debugfs:
+//    /sys/kernel/debug/prime_finder/stats
+//    /sys/kernel/debug/prime_finder/card<minor>/stats
+struct prime_stats {
+    u64 searches_started;
+    u64 searches_completed;
+    u64 interrupts;
+    //Searches completed by polling with the interrupt masked and the
+    //number of times the card switched to polling
+    u64 polled_completions;
+    u64 poll_entries;
+    //Searches that failed or whose wait was interrupted
+    u64 errors;
+    //Copies to or from userspace that failed
+    u64 copy_failures;
+    //Searches whose deadline passed and searches cancelled with
+    //IOCTL_CANCEL
+    u64 timeouts;
+    u64 cancels;
+    //Times the card was reset in place, and how many of those were the
+    //watchdog finding it stalled
+    u64 resets;
+    u64 watchdog_resets;
+
+    //Device cycles of each search, from CYCLE_COUNT_HIGH and CYCLE_COUNT_LOW
+    u64 cycles_hist[STATS_BUCKETS];
+    //Time from starting a search to the driver seeing it done in ns
+    u64 submit_to_irq_hist[STATS_BUCKETS];
+    //Time from completing a blocking search to its caller running again
+    //in ns
+    u64 irq_to_wakeup_hist[STATS_BUCKETS];
+};
+
+//Counters for events on the aggregate node, which has no card
+extern struct prime_stats __percpu *driver_stats;
+
+/*
+    Returns the histogram bucket of a value.
+
+    Paramaters:
+        value   -> Value to sort into a bucket.
+*/
+static inline unsigned int stats_bucket(u64 value) {
+    return min_t(unsigned int, fls64(value), STATS_BUCKETS - 1);
+}
+
+//Counts a value into one of the histograms of a struct prime_stats
+#define stats_histogram_add(stats, hist, value) \
+    this_cpu_inc((stats)->hist[stats_bucket(value)])
+
+/*
+    Allocates zeroed per-CPU counters.
+
+    Return:
+        The counters, or NULL on failure.
+*/
+struct prime_stats __percpu *stats_alloc(void);
+
+/*
+    Frees counters returned by stats_alloc.
+
+    Paramaters:
+        stats   -> Counters to free. May be NULL.
+*/
+void stats_free(struct prime_stats __percpu *stats);
+
+/*
+    Allocates the driver's counters and creates the debugfs directory of
+    the driver.
+
+    Return:
+        0 on success and a negative value on failure.
+*/
+int stats_init(void);
+
+/*
+    Removes the debugfs directory of the driver and frees its counters.
+*/
+void stats_exit(void);
+
+/*
+    Creates the debugfs directory of a card. A failure only means the card
+    has no statistics file, so nothing is reported.
+
+    Paramaters:
+        device  -> Card with a minor number.
+*/
+void stats_add_device(struct prime_device *device);
+
+/*
+    Removes the debugfs directory of a card. Waits for readers of its
+    statistics file to finish.
+
+    Paramaters:
+        device  -> Card to remove the directory of.
+*/
+void stats_remove_device(struct prime_device *device);
+
+#endif
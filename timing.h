@@ -0,0 +1,14 @@
+#ifndef TIMING_H
+#define TIMING_H
+
+#include <stdint.h>
+#include <time.h>
+
+//Returns a monotonic timestamp in nanoseconds
+static inline uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+#endif
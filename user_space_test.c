@@ -3,21 +3,175 @@
 #include <fcntl.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/ioctl.h>
+#include <time.h>
 
 #include "prime.h"
+#include "cpu_sieve.h"
+#include "hybrid.h"
+#include "miller_rabin.h"
 
 
 int main(int argc, char *argv[]) {
     int count;
 
+    //CPU range mode runs the same range search on the CPU sieve, which needs
+    //no device, so the two can be compared
+    if(argc >= 4 && strcmp(argv[1], "cpu-range") == 0) {
+        static uint32_t primes[1 << 20];
+        struct range_stats stats;
+        uint32_t low = strtoul(argv[2], NULL, 0);
+        uint64_t high = strtoull(argv[3], NULL, 0);
+        uint64_t total = 0, elapsed_ns = 0;
+        uint32_t found, i;
+        int status;
+
+        if(argc >= 5) {
+            cpu_sieve_set_threads(atoi(argv[4]));
+        }
+
+        do {
+            status = cpu_find_primes_in_range(low, high, primes, 1 << 20, &found, &stats);
+            if(status < 0) {
+                fprintf(stderr, "Range search failed\n");
+                return -1;
+            }
+            for(i = 0; i < found; i++) {
+                printf("%u\n", primes[i]);
+            }
+            total += found;
+            elapsed_ns += stats.elapsed_ns;
+            if(found > 0) {
+                low = primes[found - 1] + 1;
+            }
+        } while(status == 1);
+
+        fprintf(stderr, "Primes: %lu\n", total);
+        fprintf(stderr, "Primes per second: %.0f\n", elapsed_ns ? total * 1e9 / elapsed_ns : 0.0);
+        return 0;
+    }
+
     //Open the device file and check that it was opened correctly
-    int fd = open("/dev/prime_finder", O_RDWR);
+    int fd = open_device("/dev/prime_finder");
     if(fd < 0) {
         printf("Failed to open device file\n");
         return -1;
     }
 
+    //Range mode lists every prime in [low, high) on stdout and reports the
+    //throughput on stderr
+    if(argc >= 4 && strcmp(argv[1], "range") == 0) {
+        struct range_stats stats;
+        struct verify_stats verified;
+        uint32_t low = strtoul(argv[2], NULL, 0);
+        uint64_t high = strtoull(argv[3], NULL, 0);
+
+        if(stream_primes_in_range(fd, low, high, STDOUT_FILENO, &stats) != 0) {
+            fprintf(stderr, "Range search failed\n");
+            return -1;
+        }
+
+        fprintf(stderr, "Primes: %lu\n", stats.primes);
+        fprintf(stderr, "Primes per second: %.0f\n",
+                stats.elapsed_ns ? stats.primes * 1e9 / stats.elapsed_ns : 0.0);
+        fprintf(stderr, "Cycles per prime: %.1f\n",
+                stats.primes ? (double) stats.cycles / stats.primes : 0.0);
+
+        get_verify_stats(&verified);
+        fprintf(stderr, "Checked on the CPU: %lu, wrong: %lu\n", verified.checked, verified.mismatches);
+        return 0;
+    }
+
+    //Hybrid mode splits the range between the device and the CPU sieve and
+    //reports how it was split on stderr
+    if(argc >= 4 && strcmp(argv[1], "hybrid") == 0) {
+        struct hybrid_stats stats;
+        uint32_t low = strtoul(argv[2], NULL, 0);
+        uint64_t high = strtoull(argv[3], NULL, 0);
+
+        if(argc >= 5) {
+            cpu_sieve_set_threads(atoi(argv[4]));
+        }
+
+        if(hybrid_stream_primes_in_range(fd, low, high, STDOUT_FILENO, &stats) != 0) {
+            fprintf(stderr, "Range search failed\n");
+            return -1;
+        }
+
+        fprintf(stderr, "Primes: %lu\n", stats.primes);
+        fprintf(stderr, "Primes per second: %.0f\n",
+                stats.elapsed_ns ? stats.primes * 1e9 / stats.elapsed_ns : 0.0);
+        fprintf(stderr, "Device: %lu numbers in %lu chunks, %lu primes, busy %.3fs, %lu cycles\n",
+                stats.device_numbers, stats.device_chunks, stats.device_primes,
+                stats.device_busy_ns / 1e9, stats.device_cycles);
+        fprintf(stderr, "CPU: %lu numbers in %lu chunks, %lu primes, busy %.3fs\n",
+                stats.cpu_numbers, stats.cpu_chunks, stats.cpu_primes, stats.cpu_busy_ns / 1e9);
+        fprintf(stderr, "Device share: %.1f%%\n",
+                stats.device_numbers + stats.cpu_numbers ?
+                100.0 * stats.device_numbers / (stats.device_numbers + stats.cpu_numbers) : 0.0);
+        return 0;
+    }
+
+    //64 bit mode runs a batch of count searches spread from start, which
+    //may be past 2^32, and prints each start value with its prime. Values
+    //the device cannot take run on the CPU Miller-Rabin engine.
+    if(argc >= 3 && strcmp(argv[1], "prime64") == 0) {
+        uint64_t start = strtoull(argv[2], NULL, 0);
+        uint32_t batch = argc >= 4 ? strtoul(argv[3], NULL, 0) : 1;
+        uint64_t *start_vals = malloc(sizeof(uint64_t) * batch);
+        uint64_t *results = malloc(sizeof(uint64_t) * batch);
+        struct timespec begin, end;
+        double elapsed;
+        uint32_t i;
+
+        if(start_vals == NULL || results == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            return -1;
+        }
+        if(argc >= 5) {
+            miller_rabin_set_threads(atoi(argv[4]));
+        }
+
+        //The batch stops short of wrapping past 2^64
+        for(i = 0; i < batch && (UINT64_MAX - start) / 1000 >= i; i++) {
+            start_vals[i] = start + (uint64_t) i * 1000;
+        }
+        batch = i;
+
+        clock_gettime(CLOCK_MONOTONIC, &begin);
+        if(find_primes_batch64(fd, start_vals, results, batch) != 0) {
+            fprintf(stderr, "Search failed\n");
+            return -1;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        for(i = 0; i < batch; i++) {
+            printf("%lu %lu\n", start_vals[i], results[i]);
+        }
+
+        elapsed = (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9;
+        fprintf(stderr, "Searches per second: %.0f\n", elapsed > 0 ? batch / elapsed : 0.0);
+        free(start_vals);
+        free(results);
+        return 0;
+    }
+
+    //Reset mode resets the device in place and reports how long it took
+    if(argc >= 2 && strcmp(argv[1], "reset") == 0) {
+        struct timespec begin, end;
+
+        clock_gettime(CLOCK_MONOTONIC, &begin);
+        if(reset_device(fd) != 0) {
+            perror("Reset failed");
+            return -1;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        fprintf(stderr, "Reset took %.3f ms\n",
+                (end.tv_sec - begin.tv_sec) * 1e3 + (end.tv_nsec - begin.tv_nsec) / 1e6);
+        return 0;
+    }
 
     //Determine the number that the prime number search should start from
     //If a start number was provided on the command line then use that
@@ -46,32 +200,25 @@ int main(int argc, char *argv[]) {
         return -1;
     }
 
-    //Busy loop until the prime search completes
-    uint32_t complete;
+    //Loop until the prime search completes. Each check reads a snapshot
+    //of the done flag, result and cycle count registers in a single call
+    //and between checks the process sleeps until the device raises its
+    //interrupt.
+    struct prime_status search_status;
     do {
-        status = check_complete(fd, &complete);
+        status = read_status(fd, &search_status);
         if(status != 0) {
             printf("Error checking search completion\n");
             return -1;
         }
-        usleep(250000);
-    } while(complete != 1);
-
-    uint64_t cycle_count;
-    status = read_cycle_count(fd, &cycle_count);
-    if(status != 0) {
-        printf("Error reading cycle count\n");
-        return -1;
-    }
-    printf("Cycle count: %lu\n", cycle_count);
+        if(search_status.done != 1 && wait_search(fd, -1) < 0) {
+            printf("Error waiting for the search\n");
+            return -1;
+        }
+    } while(search_status.done != 1);
 
-    uint32_t result;
-    status = read_result(fd, &result);
-    if(status != 0) {
-        printf("Error reading search result\n");
-        return -1;
-    }
-    printf("Prime search result: %u\n", result);
+    printf("Cycle count: %lu\n", search_status.cycles);
+    printf("Prime search result: %u\n", search_status.result);
     
 
     ///////////////////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,561 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <immintrin.h>
+
+#include "prime.h"
+#include "verify.h"
+#include "miller_rabin.h"
+
+//Samples a thread collects before checking them together
+#define VERIFY_BATCH 64
+
+//Rate used until set_verify_rate() is called. The PRIME_FINDER_VERIFY_RATE
+//environment variable overrides it.
+#define VERIFY_DEFAULT_RATE 64
+
+//Largest gap between consecutive primes below 2^32, which follows
+//3842610773. A result further than this from its start value is wrong.
+#define MAX_PRIME_GAP 336
+
+//Candidates the primality kernel is run on at a time
+#define CANDIDATE_BATCH 256
+
+//Bit n is set when n is prime, for n below 64
+#define SMALL_PRIMES_MASK 0x28208a20a08a28acull
+
+//Miller-Rabin with these bases is exact for every value below 2^32
+static const uint32_t witness_bases[3] = {2, 7, 61};
+
+//Odd candidates above 63 with the values Montgomery multiplication modulo
+//each of them needs. Lane i of every array belongs to candidate i.
+struct candidates {
+    uint32_t n[CANDIDATE_BATCH];
+    //n^-1 mod 2^32
+    uint32_t n_inv[CANDIDATE_BATCH];
+    //2^64 mod n, used to convert into Montgomery form
+    uint32_t r2[CANDIDATE_BATCH];
+    //n - 1 is d * 2^shift with d odd
+    uint32_t d[CANDIDATE_BATCH];
+    uint32_t shift[CANDIDATE_BATCH];
+    //Largest d and shift of the batch, which bound the loops of the kernels
+    uint32_t max_d;
+    uint32_t max_shift;
+    uint32_t count;
+
+    //Whether each candidate should be prime and the sample it belongs to
+    bool expected[CANDIDATE_BATCH];
+    uint8_t owner[CANDIDATE_BATCH];
+};
+
+//A sampled search
+struct verify_sample {
+    uint32_t start_val;
+    uint32_t result;
+};
+
+//Tests every candidate of a batch and stores whether it is prime
+typedef void (*primality_fn)(const struct candidates *c, bool *prime);
+
+static primality_fn primality_test;
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+//One in every verify_rate results is checked, none when it is 0
+static uint32_t verify_rate = VERIFY_DEFAULT_RATE;
+
+//Totals of every thread
+static uint64_t total_checked = 0;
+static uint64_t total_mismatches = 0;
+//Guards the latest mismatch
+static pthread_mutex_t mismatch_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t last_mismatch_start = 0;
+static uint32_t last_mismatch_result = 0;
+
+//Samples of the calling thread that have not been checked yet
+static __thread struct verify_sample pending[VERIFY_BATCH];
+static __thread uint32_t pending_count = 0;
+//Results seen since the calling thread last took a sample
+static __thread uint32_t since_sample = 0;
+
+
+/*
+    Multiplies two values in Montgomery form with R = 2^32.
+
+    Paramaters:
+        a       -> First factor, below n.
+        b       -> Second factor, below n.
+        n       -> Odd modulus.
+        n_inv   -> n^-1 mod 2^32.
+    Return:
+        a * b / 2^32 mod n.
+*/
+static inline uint32_t montgomery_mul32(uint32_t a, uint32_t b, uint32_t n, uint32_t n_inv) {
+    uint64_t product = (uint64_t) a * b;
+    uint32_t m = (uint32_t) product * n_inv;
+    uint32_t high = product >> 32;
+    uint32_t mn_high = ((uint64_t) m * n) >> 32;
+
+    return high - mn_high + (high < mn_high ? n : 0);
+}
+
+/*
+    Tests one candidate with plain 64 bit operations.
+
+    Paramaters:
+        c   -> Batch of candidates.
+        i   -> Candidate to test.
+    Return:
+        true if the candidate is prime.
+*/
+static bool primality_one(const struct candidates *c, uint32_t i) {
+    uint32_t n = c->n[i], n_inv = c->n_inv[i];
+    uint32_t one = montgomery_mul32(1, c->r2[i], n, n_inv);
+    uint32_t minus_one = n - one;
+    uint32_t x, power, j;
+    bool pass;
+    int b, bit;
+
+    for(b = 0; b < 3; b++) {
+        power = montgomery_mul32(witness_bases[b], c->r2[i], n, n_inv);
+        x = one;
+        for(bit = 31 - __builtin_clz(c->d[i]); bit >= 0; bit--) {
+            x = montgomery_mul32(x, x, n, n_inv);
+            if((c->d[i] >> bit) & 1) {
+                x = montgomery_mul32(x, power, n, n_inv);
+            }
+        }
+
+        pass = x == one || x == minus_one;
+        for(j = 1; j < c->shift[i] && !pass; j++) {
+            x = montgomery_mul32(x, x, n, n_inv);
+            pass = x == minus_one;
+        }
+        if(!pass) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*
+    Tests every candidate of a batch one at a time.
+
+    Paramaters:
+        c       -> Batch of candidates.
+        prime   -> Set to whether each candidate is prime.
+*/
+static void primality_scalar(const struct candidates *c, bool *prime) {
+    uint32_t i;
+
+    for(i = 0; i < c->count; i++) {
+        prime[i] = primality_one(c, i);
+    }
+}
+
+/*
+    Montgomery multiplication of four candidates at once with AVX2. Each
+    candidate sits in the low half of a 64 bit lane so _mm256_mul_epu32
+    gives the full 64 bit products.
+*/
+__attribute__((target("avx2")))
+static inline __m256i montgomery_mul_avx2(__m256i a, __m256i b, __m256i n, __m256i n_inv) {
+    __m256i product = _mm256_mul_epu32(a, b);
+    __m256i m = _mm256_mul_epu32(product, n_inv);
+    __m256i high = _mm256_srli_epi64(product, 32);
+    __m256i mn_high = _mm256_srli_epi64(_mm256_mul_epu32(m, n), 32);
+    //Both halves are below 2^32 so the signed compare is enough
+    __m256i borrow = _mm256_cmpgt_epi64(mn_high, high);
+
+    return _mm256_add_epi64(_mm256_sub_epi64(high, mn_high), _mm256_and_si256(borrow, n));
+}
+
+/*
+    Tests the candidates of a batch eight at a time with AVX2, as two
+    vectors of four whose multiplications are interleaved so one vector's
+    overlap the latency of the other's. Candidates with a shorter d stay
+    at 1 until their own top bit, since squaring 1 gives 1.
+*/
+__attribute__((target("avx2")))
+static void primality_avx2(const struct candidates *c, bool *prime) {
+    __m256i n[2], n_inv[2], r2[2], d[2], shift[2], one[2], minus_one[2], power[2], x[2], y, pass[2], all_pass[2];
+    __m256i bit_mask;
+    uint32_t i, j, lane;
+    uint64_t lanes[4];
+    int b, bit, v;
+    int top_bit = 31 - __builtin_clz(c->max_d);
+
+    for(i = 0; i + 8 <= c->count; i += 8) {
+        for(v = 0; v < 2; v++) {
+            n[v] = _mm256_cvtepu32_epi64(_mm_loadu_si128((const __m128i*) (c->n + i + 4 * v)));
+            n_inv[v] = _mm256_cvtepu32_epi64(_mm_loadu_si128((const __m128i*) (c->n_inv + i + 4 * v)));
+            r2[v] = _mm256_cvtepu32_epi64(_mm_loadu_si128((const __m128i*) (c->r2 + i + 4 * v)));
+            d[v] = _mm256_cvtepu32_epi64(_mm_loadu_si128((const __m128i*) (c->d + i + 4 * v)));
+            shift[v] = _mm256_cvtepu32_epi64(_mm_loadu_si128((const __m128i*) (c->shift + i + 4 * v)));
+
+            one[v] = montgomery_mul_avx2(_mm256_set1_epi64x(1), r2[v], n[v], n_inv[v]);
+            minus_one[v] = _mm256_sub_epi64(n[v], one[v]);
+            all_pass[v] = _mm256_set1_epi64x(-1);
+        }
+
+        for(b = 0; b < 3; b++) {
+            for(v = 0; v < 2; v++) {
+                power[v] = montgomery_mul_avx2(_mm256_set1_epi64x(witness_bases[b]), r2[v], n[v], n_inv[v]);
+                x[v] = one[v];
+            }
+            for(bit = top_bit; bit >= 0; bit--) {
+                bit_mask = _mm256_set1_epi64x(1ll << bit);
+                for(v = 0; v < 2; v++) {
+                    x[v] = montgomery_mul_avx2(x[v], x[v], n[v], n_inv[v]);
+                    y = montgomery_mul_avx2(x[v], power[v], n[v], n_inv[v]);
+                    x[v] = _mm256_blendv_epi8(x[v], y, _mm256_cmpeq_epi64(_mm256_and_si256(d[v], bit_mask), bit_mask));
+                }
+            }
+
+            for(v = 0; v < 2; v++) {
+                pass[v] = _mm256_or_si256(_mm256_cmpeq_epi64(x[v], one[v]), _mm256_cmpeq_epi64(x[v], minus_one[v]));
+            }
+            for(j = 1; j < c->max_shift; j++) {
+                for(v = 0; v < 2; v++) {
+                    x[v] = montgomery_mul_avx2(x[v], x[v], n[v], n_inv[v]);
+                    pass[v] = _mm256_or_si256(pass[v],
+                                              _mm256_and_si256(_mm256_cmpeq_epi64(x[v], minus_one[v]),
+                                                               _mm256_cmpgt_epi64(shift[v], _mm256_set1_epi64x(j))));
+                }
+            }
+            for(v = 0; v < 2; v++) {
+                all_pass[v] = _mm256_and_si256(all_pass[v], pass[v]);
+            }
+        }
+
+        for(v = 0; v < 2; v++) {
+            _mm256_storeu_si256((__m256i*) lanes, all_pass[v]);
+            for(lane = 0; lane < 4; lane++) {
+                prime[i + 4 * v + lane] = lanes[lane] != 0;
+            }
+        }
+    }
+
+    for(; i < c->count; i++) {
+        prime[i] = primality_one(c, i);
+    }
+}
+
+/*
+    Montgomery multiplication of eight candidates at once with AVX-512.
+*/
+__attribute__((target("avx512f")))
+static inline __m512i montgomery_mul_avx512(__m512i a, __m512i b, __m512i n, __m512i n_inv) {
+    __m512i product = _mm512_mul_epu32(a, b);
+    __m512i m = _mm512_mul_epu32(product, n_inv);
+    __m512i high = _mm512_srli_epi64(product, 32);
+    __m512i mn_high = _mm512_srli_epi64(_mm512_mul_epu32(m, n), 32);
+    __m512i difference = _mm512_sub_epi64(high, mn_high);
+
+    return _mm512_mask_add_epi64(difference, _mm512_cmplt_epu64_mask(high, mn_high), difference, n);
+}
+
+/*
+    Tests the candidates of a batch sixteen at a time with AVX-512, as two
+    interleaved vectors of eight like primality_avx2().
+*/
+__attribute__((target("avx512f")))
+static void primality_avx512(const struct candidates *c, bool *prime) {
+    __m512i n[2], n_inv[2], r2[2], d[2], shift[2], one[2], minus_one[2], power[2], x[2], y;
+    __m512i bit_mask;
+    __mmask8 pass[2], all_pass[2];
+    uint32_t i, j, lane;
+    int b, bit, v;
+    int top_bit = 31 - __builtin_clz(c->max_d);
+
+    for(i = 0; i + 16 <= c->count; i += 16) {
+        for(v = 0; v < 2; v++) {
+            n[v] = _mm512_cvtepu32_epi64(_mm256_loadu_si256((const __m256i*) (c->n + i + 8 * v)));
+            n_inv[v] = _mm512_cvtepu32_epi64(_mm256_loadu_si256((const __m256i*) (c->n_inv + i + 8 * v)));
+            r2[v] = _mm512_cvtepu32_epi64(_mm256_loadu_si256((const __m256i*) (c->r2 + i + 8 * v)));
+            d[v] = _mm512_cvtepu32_epi64(_mm256_loadu_si256((const __m256i*) (c->d + i + 8 * v)));
+            shift[v] = _mm512_cvtepu32_epi64(_mm256_loadu_si256((const __m256i*) (c->shift + i + 8 * v)));
+
+            one[v] = montgomery_mul_avx512(_mm512_set1_epi64(1), r2[v], n[v], n_inv[v]);
+            minus_one[v] = _mm512_sub_epi64(n[v], one[v]);
+            all_pass[v] = 0xff;
+        }
+
+        for(b = 0; b < 3; b++) {
+            for(v = 0; v < 2; v++) {
+                power[v] = montgomery_mul_avx512(_mm512_set1_epi64(witness_bases[b]), r2[v], n[v], n_inv[v]);
+                x[v] = one[v];
+            }
+            for(bit = top_bit; bit >= 0; bit--) {
+                bit_mask = _mm512_set1_epi64(1ll << bit);
+                for(v = 0; v < 2; v++) {
+                    x[v] = montgomery_mul_avx512(x[v], x[v], n[v], n_inv[v]);
+                    y = montgomery_mul_avx512(x[v], power[v], n[v], n_inv[v]);
+                    x[v] = _mm512_mask_blend_epi64(_mm512_test_epi64_mask(d[v], bit_mask), x[v], y);
+                }
+            }
+
+            for(v = 0; v < 2; v++) {
+                pass[v] = _mm512_cmpeq_epi64_mask(x[v], one[v]) | _mm512_cmpeq_epi64_mask(x[v], minus_one[v]);
+            }
+            for(j = 1; j < c->max_shift; j++) {
+                for(v = 0; v < 2; v++) {
+                    x[v] = montgomery_mul_avx512(x[v], x[v], n[v], n_inv[v]);
+                    pass[v] |= _mm512_cmpeq_epi64_mask(x[v], minus_one[v]) &
+                               _mm512_cmpgt_epu64_mask(shift[v], _mm512_set1_epi64(j));
+                }
+            }
+            for(v = 0; v < 2; v++) {
+                all_pass[v] &= pass[v];
+            }
+        }
+
+        for(v = 0; v < 2; v++) {
+            for(lane = 0; lane < 8; lane++) {
+                prime[i + 8 * v + lane] = (all_pass[v] >> lane) & 1;
+            }
+        }
+    }
+
+    for(; i < c->count; i++) {
+        prime[i] = primality_one(c, i);
+    }
+}
+
+/*
+    Picks the widest primality kernel the CPU supports and reads the
+    sampling rate from the environment. Runs once.
+*/
+static void verify_init(void) {
+    const char *rate = getenv("PRIME_FINDER_VERIFY_RATE");
+
+    if(rate != NULL) {
+        __atomic_store_n(&verify_rate, (uint32_t) strtoul(rate, NULL, 0), __ATOMIC_RELAXED);
+    }
+
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx512f")) {
+        primality_test = primality_avx512;
+    }
+    else if(__builtin_cpu_supports("avx2")) {
+        primality_test = primality_avx2;
+    }
+    else {
+        primality_test = primality_scalar;
+    }
+}
+
+/*
+    Runs the primality kernel on a batch of candidates, marks the samples
+    with a candidate that came out different than expected and empties the
+    batch.
+
+    Paramaters:
+        c       -> Batch of candidates.
+        wrong   -> Set for each sample with a mismatch.
+*/
+static void test_candidates(struct candidates *c, bool *wrong) {
+    bool prime[CANDIDATE_BATCH];
+    uint32_t i;
+
+    if(c->count > 0) {
+        primality_test(c, prime);
+        for(i = 0; i < c->count; i++) {
+            if(prime[i] != c->expected[i]) {
+                wrong[c->owner[i]] = true;
+            }
+        }
+    }
+
+    c->count = 0;
+    c->max_d = 1;
+    c->max_shift = 0;
+}
+
+/*
+    Adds a candidate to a batch. Even values, values below 64 and multiples
+    of 3, 5 and 7 are decided here instead, which leaves about a quarter of
+    the numbers of a gap for the kernel.
+
+    Paramaters:
+        c           -> Batch of candidates.
+        n           -> Value to test.
+        expected    -> Whether n should be prime.
+        owner       -> Sample n belongs to.
+        wrong       -> Set for each sample with a mismatch.
+*/
+static void add_candidate(struct candidates *c, uint32_t n, bool expected, uint8_t owner, bool *wrong) {
+    uint32_t i = c->count;
+
+    if(n < 64 || n % 2 == 0 || n % 3 == 0 || n % 5 == 0 || n % 7 == 0) {
+        if((n < 64 && ((SMALL_PRIMES_MASK >> n) & 1)) != expected) {
+            wrong[owner] = true;
+        }
+        return;
+    }
+
+    c->n[i] = n;
+    c->n_inv[i] = (uint32_t) odd_inverse64(n);
+    c->r2[i] = (0 - (uint64_t) n) % n;
+    c->shift[i] = __builtin_ctz(n - 1);
+    c->d[i] = (n - 1) >> c->shift[i];
+    c->expected[i] = expected;
+    c->owner[i] = owner;
+    if(c->d[i] > c->max_d) c->max_d = c->d[i];
+    if(c->shift[i] > c->max_shift) c->max_shift = c->shift[i];
+
+    if(++c->count == CANDIDATE_BATCH) {
+        test_candidates(c, wrong);
+    }
+}
+
+/*
+    Checks the samples of the calling thread and adds the outcome to the
+    totals.
+*/
+static void check_pending(void) {
+    struct candidates c;
+    bool wrong[VERIFY_BATCH] = {false};
+    uint64_t mismatches = 0;
+    uint32_t start_val, result, n, s;
+
+    c.count = 0;
+    c.max_d = 1;
+    c.max_shift = 0;
+
+    for(s = 0; s < pending_count; s++) {
+        start_val = pending[s].start_val;
+        result = pending[s].result;
+
+        //The device returns 0 once no prime is left below 2^32
+        if(result == 0) {
+            wrong[s] = start_val <= MAX_DEVICE_PRIME;
+            continue;
+        }
+        if(result < start_val || result - start_val > MAX_PRIME_GAP) {
+            wrong[s] = true;
+            continue;
+        }
+
+        //The result must be prime and every number before it composite
+        for(n = start_val; n < result; n++) {
+            add_candidate(&c, n, false, s, wrong);
+        }
+        add_candidate(&c, result, true, s, wrong);
+    }
+    test_candidates(&c, wrong);
+
+    for(s = 0; s < pending_count; s++) {
+        if(wrong[s]) {
+            mismatches++;
+            pthread_mutex_lock(&mismatch_lock);
+            last_mismatch_start = pending[s].start_val;
+            last_mismatch_result = pending[s].result;
+            pthread_mutex_unlock(&mismatch_lock);
+        }
+    }
+
+    __atomic_fetch_add(&total_checked, pending_count, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&total_mismatches, mismatches, __ATOMIC_RELAXED);
+    pending_count = 0;
+}
+
+/*
+    Samples the result of one device search.
+
+    Paramaters:
+        start_val   -> Value the search started from.
+        result      -> Result the device returned.
+*/
+void verify_result(uint32_t start_val, uint32_t result) {
+    uint32_t rate;
+
+    pthread_once(&init_once, verify_init);
+
+    rate = __atomic_load_n(&verify_rate, __ATOMIC_RELAXED);
+    if(rate == 0 || ++since_sample < rate) {
+        return;
+    }
+    since_sample = 0;
+
+    pending[pending_count].start_val = start_val;
+    pending[pending_count].result = result;
+    if(++pending_count == VERIFY_BATCH) {
+        check_pending();
+    }
+}
+
+/*
+    Samples the results of a batch of device searches.
+
+    Paramaters:
+        start_vals  -> Values the searches started from.
+        results     -> Results the device returned.
+        count       -> Number of searches.
+*/
+void verify_results(const uint32_t *start_vals, const uint32_t *results, uint32_t count) {
+    uint32_t i;
+
+    for(i = 0; i < count; i++) {
+        verify_result(start_vals[i], results[i]);
+    }
+}
+
+/*
+    Samples the primes of a device range search. Each prime is the result
+    of a search from the value after the prime before it.
+
+    Paramaters:
+        low     -> First value of the range.
+        primes  -> Primes found, in order.
+        count   -> Number of primes.
+*/
+void verify_range(uint32_t low, const uint32_t *primes, uint32_t count) {
+    uint32_t i;
+
+    for(i = 0; i < count; i++) {
+        verify_result(i == 0 ? low : primes[i - 1] + 1, primes[i]);
+    }
+}
+
+/*
+    Checks the samples the calling thread has not checked yet.
+*/
+void verify_flush(void) {
+    if(pending_count > 0) {
+        check_pending();
+    }
+}
+
+/*
+    Sets how often device results are checked on the CPU.
+
+    Paramaters:
+        rate    -> One in every rate results is checked. 0 turns checking
+                   off and 1 checks every result.
+*/
+void set_verify_rate(uint32_t rate) {
+    pthread_once(&init_once, verify_init);
+    __atomic_store_n(&verify_rate, rate, __ATOMIC_RELAXED);
+}
+
+/*
+    Reads the totals of the checks of every thread. The samples of the
+    calling thread are checked first. Other threads check theirs once
+    they have VERIFY_BATCH of them or call get_verify_stats().
+
+    Paramaters:
+        stats   -> Set to the totals.
+*/
+void get_verify_stats(struct verify_stats *stats) {
+    verify_flush();
+
+    stats->checked = __atomic_load_n(&total_checked, __ATOMIC_RELAXED);
+    stats->mismatches = __atomic_load_n(&total_mismatches, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&mismatch_lock);
+    stats->last_mismatch_start = last_mismatch_start;
+    stats->last_mismatch_result = last_mismatch_result;
+    pthread_mutex_unlock(&mismatch_lock);
+}
@@ -0,0 +1,50 @@
+#ifndef VERIFY_H
+#define VERIFY_H
+
+#include <stdint.h>
+
+//Spot checks of device results on the CPU. One in every rate results is
+//sampled and checked in batches. A result is right when it is prime and
+//no prime lies between the start value and it, or when it is 0 and no
+//prime is left below 2^32. The candidates are tested with Miller-Rabin
+//with the bases 2, 7 and 61, which is exact below 2^32, sixteen or eight
+//candidates at a time with AVX-512 or AVX2 when the CPU has them.
+//Samples are kept per thread, so sampling takes no locks. set_verify_rate() and
+//get_verify_stats() in prime.h are the public side.
+
+/*
+    Samples the result of one device search.
+
+    Paramaters:
+        start_val   -> Value the search started from.
+        result      -> Result the device returned.
+*/
+void verify_result(uint32_t start_val, uint32_t result);
+
+/*
+    Samples the results of a batch of device searches.
+
+    Paramaters:
+        start_vals  -> Values the searches started from.
+        results     -> Results the device returned.
+        count       -> Number of searches.
+*/
+void verify_results(const uint32_t *start_vals, const uint32_t *results, uint32_t count);
+
+/*
+    Samples the primes of a device range search. Each prime is the result
+    of a search from the value after the prime before it.
+
+    Paramaters:
+        low     -> First value of the range.
+        primes  -> Primes found, in order.
+        count   -> Number of primes.
+*/
+void verify_range(uint32_t low, const uint32_t *primes, uint32_t count);
+
+/*
+    Checks the samples the calling thread has not checked yet.
+*/
+void verify_flush(void);
+
+#endif